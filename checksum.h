@@ -0,0 +1,225 @@
+#ifndef DFS_CHECKSUM_H
+#define DFS_CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+/* ------------------------------------------------------
+    CRC32C (Castagnoli)
+    Every block carries the CRC32C of its data in its BlockInfo.
+    crc32c(crc, buf, len) extends a running checksum, starting
+    from 0, so data can be checked as it streams past:
+        crc = crc32c(crc32c(0, a, n), b, m) == crc32c(0, ab, n + m)
+    The CPU's CRC32C instruction (SSE4.2, ARMv8 CRC) does 8 bytes
+    per step; elsewhere it is a slicing-by-8 table walk. The
+    implementation is picked on first use.
+    The instruction has a 3-cycle latency but issues every cycle,
+    so on x86-64 long buffers are cut in three lanes checksummed
+    side by side; the lane CRCs are then joined by shifting each
+    over the length of the next (multiplying by x^(8n) mod P, done
+    with tables built once for CRC32C_LONG and CRC32C_SHORT).
+------------------------------------------------------ */
+#define CRC32C_POLY 0x82f63b78     // reflected Castagnoli polynomial
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+// Tables that advance a CRC register over len zero bytes
+static void crc32c_zeros(uint32_t zeros[][256], size_t len) {
+    uint32_t even[32], odd[32];
+    odd[0] = CRC32C_POLY;       // operator for one zero bit
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+    gf2_matrix_square(even, odd);   // two zero bits
+    gf2_matrix_square(odd, even);   // four zero bits
+
+    // Square up to len bytes; the first pass makes one byte
+    const uint32_t *op = odd;
+    do {
+        gf2_matrix_square(even, odd);
+        op = even;
+        len >>= 1;
+        if (len == 0) break;
+        gf2_matrix_square(odd, even);
+        op = odd;
+        len >>= 1;
+    } while (len);
+
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+           zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    // Three lanes of CRC32C_LONG, then of CRC32C_SHORT bytes
+    size_t lanes[2] = {CRC32C_LONG, CRC32C_SHORT};
+    for (int l = 0; l < 2; l++) {
+        size_t lane = lanes[l];
+        while (len >= 3 * lane) {
+            uint64_t crc0 = crc, crc1 = 0, crc2 = 0;
+            const unsigned char *end = p + lane;
+            do {
+                uint64_t v0, v1, v2;
+                memcpy(&v0, p, 8);
+                memcpy(&v1, p + lane, 8);
+                memcpy(&v2, p + 2 * lane, 8);
+                crc0 = _mm_crc32_u64(crc0, v0);
+                crc1 = _mm_crc32_u64(crc1, v1);
+                crc2 = _mm_crc32_u64(crc2, v2);
+                p += 8;
+            } while (p < end);
+            uint32_t (*zeros)[256] = (l == 0) ? crc32c_long : crc32c_short;
+            crc = crc32c_shift(zeros, (uint32_t)crc0) ^ (uint32_t)crc1;
+            crc = crc32c_shift(zeros, crc) ^ (uint32_t)crc2;
+            p += 2 * lane;
+            len -= 3 * lane;
+        }
+    }
+
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARM
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+    return crc;
+}
+#endif
+
+static crc32c_fn crc32c_select() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+        }
+    }
+    crc32c_zeros(crc32c_long, CRC32C_LONG);
+    crc32c_zeros(crc32c_short, CRC32C_SHORT);
+
+#if defined(CRC32C_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) return crc32c_hw;
+#elif defined(CRC32C_ARM)
+    return crc32c_hw;
+#endif
+    return crc32c_sw;
+}
+
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    // Initialized once, thread-safely, on first use
+    static const crc32c_fn impl = crc32c_select();
+    return ~impl(~crc, (const unsigned char *)buf, len);
+}
+
+#endif
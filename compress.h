@@ -0,0 +1,256 @@
+#ifndef DFS_COMPRESS_H
+#define DFS_COMPRESS_H
+
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <stddef.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "protocol.h"
+
+/* ------------------------------------------------------
+    LZ4 (block format)
+    A block is a run of sequences, each a token byte (high
+    nibble: literal count, low nibble: match length - 4; 15 means
+    more length bytes follow, 255 each until a smaller one),
+    the literals, then a little-endian u16 back-offset to copy
+    the match from. The last sequence is literals only, and the
+    last LZ4_LAST_LITERALS bytes are always literals. Compression
+    is the greedy single-probe hash search, stepping faster the
+    longer it goes without a match so incompressible data passes
+    quickly.
+------------------------------------------------------ */
+#define LZ4_HASH_LOG 16
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5
+#define LZ4_MFLIMIT 12          // a match must start this far from the end
+#define LZ4_MAX_OFFSET 65535
+
+static inline size_t lz4_bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+static inline uint32_t lz4_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+static inline uint8_t *lz4_put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Compress n bytes into out, which holds lz4_bound(n); returns the
+// compressed size
+static size_t lz4_compress(const uint8_t *in, size_t n, uint8_t *out) {
+    std::vector<uint32_t> table(1 << LZ4_HASH_LOG, 0);
+    const uint8_t *end = in + n;
+    const uint8_t *ip = in, *anchor = in;
+    uint8_t *op = out;
+    size_t misses = 0;
+
+    if (n > LZ4_MFLIMIT) {
+        const uint8_t *limit = end - LZ4_MFLIMIT;
+        const uint8_t *match_limit = end - LZ4_LAST_LITERALS;
+        while (ip < limit) {
+            uint32_t seq = lz4_read32(ip);
+            uint32_t h = lz4_hash(seq);
+            const uint8_t *ref = in + table[h];
+            table[h] = (uint32_t)(ip - in);
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != seq) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + LZ4_MIN_MATCH, *rp = ref + LZ4_MIN_MATCH;
+            while (mp < match_limit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t lit = ip - anchor, mlen = mp - ip - LZ4_MIN_MATCH;
+            uint8_t *token = op++;
+            *token = (uint8_t)(((lit >= 15) ? 15 : lit) << 4 | ((mlen >= 15) ? 15 : mlen));
+            if (lit >= 15) op = lz4_put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            size_t offset = ip - ref;
+            *op++ = (uint8_t)offset;
+            *op++ = (uint8_t)(offset >> 8);
+            if (mlen >= 15) op = lz4_put_length(op, mlen - 15);
+
+            ip = anchor = mp;
+            misses = 0;
+            if (ip < limit) table[lz4_hash(lz4_read32(ip - 2))] = (uint32_t)(ip - 2 - in);
+        }
+    }
+
+    size_t lit = end - anchor;
+    *op++ = (uint8_t)(((lit >= 15) ? 15 : lit) << 4);
+    if (lit >= 15) op = lz4_put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - out;
+}
+
+// Decompress into exactly out_len bytes; false if the input is malformed
+static bool lz4_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t out_len) {
+    const uint8_t *ip = in, *iend = in + n;
+    uint8_t *op = out, *oend = out + out_len;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return false;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return false;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) return false;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return false;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ4_MIN_MATCH;
+        if ((size_t)(oend - op) < mlen) return false;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            for (size_t i = 0; i < mlen; i++) *op++ = *ref++;
+        }
+    }
+    return op == oend;
+}
+
+/* ------------------------------------------------------
+    BLOCK CODECS
+    A block's data may be stored and sent compressed; its
+    BlockInfo then names the codec and raw_length gives the size
+    it inflates to. Compression only pays on some data, so
+    before spending time on a block codec_worth_trying() takes an
+    order-0 entropy estimate from a few spread-out samples:
+    already-compressed input (JPEG, PNG, archives) measures close
+    to 8 bits per byte and is sent as is. A block whose output
+    doesn't save at least 1/CODEC_MIN_SAVING of it is sent raw too.
+------------------------------------------------------ */
+#define CODEC_MIN_BLOCK 256             // not worth a codec below this
+#define CODEC_SAMPLES 16
+#define CODEC_SAMPLE_BYTES 256
+#define CODEC_MAX_ENTROPY 7.5           // bits per byte
+#define CODEC_MIN_SAVING 16
+#define ZSTD_LEVEL 3
+
+static inline bool codec_supported(int codec) {
+    if (codec == BLOCK_CODEC_LZ4) return true;
+#ifdef HAVE_ZSTD
+    if (codec == BLOCK_CODEC_ZSTD) return true;
+#endif
+    return false;
+}
+
+static inline const char *codec_name(int codec) {
+    switch (codec) {
+    case BLOCK_CODEC_NONE: return "none";
+    case BLOCK_CODEC_LZ4: return "lz4";
+    case BLOCK_CODEC_ZSTD: return "zstd";
+    default: return "?";
+    }
+}
+
+static inline bool codec_worth_trying(const uint8_t *data, size_t n) {
+    if (n < CODEC_MIN_BLOCK) return false;
+
+    size_t count[256] = {0};
+    size_t total = 0;
+    size_t stride = n / CODEC_SAMPLES;
+    for (int s = 0; s < CODEC_SAMPLES; s++) {
+        const uint8_t *p = data + s * stride;
+        size_t len = (stride < CODEC_SAMPLE_BYTES) ? stride : CODEC_SAMPLE_BYTES;
+        for (size_t i = 0; i < len; i++) count[p[i]]++;
+        total += len;
+    }
+
+    double entropy = 0;
+    for (int b = 0; b < 256; b++) {
+        if (count[b] == 0) continue;
+        double p = (double)count[b] / total;
+        entropy -= p * log2(p);
+    }
+    return entropy < CODEC_MAX_ENTROPY;
+}
+
+// Compress n bytes with codec into out from offset at on (out is
+// resized to fit); false if that failed or didn't save enough to be
+// worth it
+static inline bool codec_compress(int codec, const uint8_t *in, size_t n, std::vector<char> &out,
+                                  size_t at) {
+    size_t len;
+    if (codec == BLOCK_CODEC_LZ4) {
+        out.resize(at + lz4_bound(n));
+        len = lz4_compress(in, n, (uint8_t *)out.data() + at);
+#ifdef HAVE_ZSTD
+    } else if (codec == BLOCK_CODEC_ZSTD) {
+        out.resize(at + ZSTD_compressBound(n));
+        len = ZSTD_compress(out.data() + at, out.size() - at, in, n, ZSTD_LEVEL);
+        if (ZSTD_isError(len)) return false;
+#endif
+    } else {
+        return false;
+    }
+    if (len > n - n / CODEC_MIN_SAVING) return false;
+    out.resize(at + len);
+    return true;
+}
+
+static inline bool codec_decompress(int codec, const uint8_t *in, size_t n, uint8_t *out,
+                                    size_t out_len) {
+    if (codec == BLOCK_CODEC_LZ4) {
+        return lz4_decompress(in, n, out, out_len);
+    }
+#ifdef HAVE_ZSTD
+    if (codec == BLOCK_CODEC_ZSTD) {
+        size_t len = ZSTD_decompress(out, out_len, in, n);
+        return !ZSTD_isError(len) && len == out_len;
+    }
+#endif
+    return false;
+}
+
+#endif
@@ -3,26 +3,110 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
 #include <cerrno>
 #include <ctime>
+#include <cmath>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/socket.h>
-#include <openssl/md5.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "protocol.h"
+#include "erasure.h"
+#include "checksum.h"
+#include "compress.h"
+#include "placement.h"
+#include "stats.h"
+#include "log.h"
 
 using namespace std;
 
-struct ServerInfo {
-    string ip;
-    int port;
-    int server_fd;
-    struct hostent *server;
+#define SESSION_TIMEOUT_SEC 10
+#define RECV_BUFSIZE 65536
+#define MAX_IOV 64
+#define PUT_WINDOW_BYTES (64 * 1024 * 1024)
+#define LATENCY_SAMPLES 256
+#define LATENCY_MIN_SAMPLES 16
+#define GET_BATCH 256
+#define CACHE_DEFAULT_SIZE (1ULL << 30)
+#define LIST_PAGE 1000
+#define HAVE_BATCH (PROTO_MAX_CONTROL / BLOCK_HASH_SIZE)
+#define HAVE_GROUP_BYTES (16 * 1024 * 1024)
+
+/* ----------------------------------------------------------
+   Client tunables (from dfc.conf)
+     hedge <ms>|off         how long a GET may go without block
+                            data before it asks the other replica
+                            for blocks still missing
+     hedge_percentile <p>   once enough chunk latencies have been
+                            seen, use their p-th percentile as the
+                            deadline instead (0 = keep <ms> fixed)
+     block_size <n>[K|M|G]  stripe unit for files larger than one
+                            block per server (default 4M)
+     dedup on|off           before a PUT, ask content-addressed
+                            servers which blocks they already
+                            store and send only the others
+     erasure <k>+<m>|off    store new files as stripes of k data
+                            and m parity blocks on k+m different
+                            servers instead of two full copies
+     compression lz4|zstd|off  compress blocks that look like they
+                            will shrink; servers store and return
+                            them compressed (zstd only if built
+                            with HAVE_ZSTD)
+     placement modulo|ring  modulo: blocks go round-robin from a
+                            server picked by name hash (the
+                            default); ring: consistent hashing,
+                            so adding a server moves ~1/N of the
+                            data. Every client must agree.
+     vnodes <n>             ring points per server (default 128),
+                            times its weight
+     cache <dir> [size]     keep blocks GET receives in <dir>, up
+                            to size bytes (K/M/G, default 1G), and
+                            reuse them while the servers report
+                            the same version (see CHUNK CACHE)
+   Servers are listed as "server <name> <ip:port> [weight]"; any
+   number of them.
+---------------------------------------------------------- */
+struct ClientConfig {
+    bool hedge_enabled;
+    double hedge_ms;
+    double hedge_percentile;
+    uint64_t block_size;
+    bool dedup;
+    int ec_data;                // 0 = replicate
+    int ec_parity;
+    int codec;                  // BLOCK_CODEC_* for new blocks
+    bool ring;                  // consistent-hash placement
+    int vnodes;                 // ring points per unit of weight
+    string cache_dir;           // empty = no chunk cache
+    uint64_t cache_size;
+
+    ClientConfig() : hedge_enabled(true), hedge_ms(50), hedge_percentile(95),
+                     block_size(DEFAULT_BLOCK_SIZE), dedup(true), ec_data(0), ec_parity(0),
+                     codec(BLOCK_CODEC_NONE), ring(false), vnodes(DEFAULT_VNODES),
+                     cache_size(CACHE_DEFAULT_SIZE) {}
 };
 
+ClientConfig client_config;
+
+// EXIT_FAILURE once any block of a put or any file of a get fails
+static int exit_status = EXIT_SUCCESS;
+
 struct ChunkedFile {
     char *data;
     size_t size;
@@ -32,390 +116,2334 @@ struct ChunkedFile {
     ~ChunkedFile() { if (data) free(data); }
 };
 
+/* ----------------------------------------------------------
+   Jobs track one logical operation that fans out to several
+   servers. The engine calls back into them as responses arrive.
+---------------------------------------------------------- */
+struct ServerInfo;
+
+// A stripe of an erasure-coded file that lost a data block: whole
+// blocks are collected here until any ec_data of them rebuild it
+struct ErasureStripe {
+    map<int, ChunkedFile*> shards;      // position in the stripe -> block
+    set<int> asked;                     // positions requested for the rebuild
+    set<int> failed;                    // ...of which the request came back without it
+};
+
+struct GetJob {
+    string filename;
+    int chunk_count;                    // blocks needed to rebuild the file
+    uint32_t file_key;                  // placement hash of the name (see block_server)
+    vector<bool> have;                  // per block: already written out
+    int received;                       // blocks written out so far
+    map<int, ChunkedFile*> legacy;      // pre-striping chunks, written once all are in
+    string output;                      // file the result is saved as
+    int out_fd;                         // <output>.part, renamed into place when complete
+    vector<char> *out_buf;              // keep the result in memory instead
+    bool ranged;                        // only want [range_offset, range_offset + range_length)
+    uint64_t range_offset;
+    uint64_t range_length;
+    uint64_t requested_offset;          // the range as asked for, before clipping to the file
+    uint64_t requested_length;
+    BlockInfo layout;                   // learned from the first block header
+    bool have_layout;
+    map<int, ErasureStripe> stripes;    // erasure-coded: stripes being rebuilt
+    bool ok;                            // every block needed arrived
+    vector<set<int>> asked;             // per block: servers already asked for it
+    vector<int> open;                   // per block: requests still covering it
+    int outstanding;                    // requests that haven't finished yet
+    double hedge_at_ms;                 // when to hedge missing blocks, 0 = done
+    bool finished;
+    vector<ServerInfo> *servers;
+
+    GetJob() : chunk_count(0), file_key(0), received(0), out_fd(-1), out_buf(nullptr),
+               ranged(false), range_offset(0), range_length(0), requested_offset(0),
+               requested_length(0), have_layout(false), ok(false),
+               outstanding(0), hedge_at_ms(0), finished(false), servers(nullptr) {}
+};
+
+struct PutJob {
+    string filename;
+    map<int, vector<char>> chunks;      // blocks (BlockInfo + data) referenced by the send queue
+    map<int, int> refs;                 // per block: acks still expected
+    map<int, string> hashes;            // per block: SHA-256 of the data, when deduplicating
+    map<int, set<ServerInfo*>> stored;  // per block: servers that already hold its data
+    int have_pending;                   // have-checks still unanswered
+    int outstanding;                    // acks still expected
+    size_t inflight_bytes;
+
+    PutJob() : have_pending(0), outstanding(0), inflight_bytes(0) {}
+};
+
+enum RequestKind { REQ_LIST, REQ_GET, REQ_PUT, REQ_HAVE, REQ_STAT, REQ_METRICS };
+
+// One server's answer to a GET's revalidation (see CHUNK CACHE)
+struct StatCursor {
+    map<int, BlockInfo> *blocks;        // per block: newest header any server reported
+    uint32_t next;                      // first block not described yet
+    bool more;                          // ask again from next
+
+    StatCursor() : blocks(nullptr), next(0), more(false) {}
+};
+
+// One server's place in a paged listing (see LIST)
+struct ListEntry {
+    string name;
+    int block;
+    bool legacy;            // stored before block headers: no layout
+    BlockInfo info;         // generation, nblocks, flags, ec_data, ec_parity
+};
+
+struct ListCursor {
+    string page;                        // body of the last LISTING
+    vector<ListEntry> entries;          // page parsed
+    size_t next;                        // first entry not yet merged
+    bool more;                          // server has entries past this page
+    bool answered;                      // the last request got its LISTING
+
+    ListCursor() : next(0), more(true), answered(false) {}
+};
+
+struct Request {
+    unsigned int id;
+    RequestKind kind;
+    GetJob *get;
+    PutJob *put;
+    int chunk_index;                    // PUT: chunk carried by this request
+    bool by_ref;                        // PUT: sent as a hash, not the data
+    vector<int> get_chunks;             // GET: chunk indices asked for, HAVE: whose hashes were sent
+    ListCursor *list;                   // LIST: where to store the page
+    StatCursor *stat;                   // STAT: where to record the headers
+    string *report;                     // METRICS: where to store the report
+    bool cancelled;                     // response is drained and dropped
+    double sent_ms;
+
+    Request() : id(0), kind(REQ_LIST), get(nullptr), put(nullptr), chunk_index(-1),
+                by_ref(false), list(nullptr), stat(nullptr), report(nullptr), cancelled(false), sent_ms(0) {}
+};
+
+// One piece of the outgoing byte stream: owned header bytes or a
+// borrowed payload that must stay alive until it has been sent.
+struct OutSegment {
+    string owned;
+    const char *data;
+    size_t len;
+};
+
+enum RecvState { RX_HEADER, RX_CHUNK, RX_LIST };
+
+/* ----------------------------------------------------------
+   ServerInfo doubles as the client's session with one dfs node:
+   the address is resolved once, the TCP connection is opened on
+   first use and reused for every request of this run. Requests
+   carry increasing ids that the server echoes back; they are
+   answered in order, so inflight.front() is always the request
+   the next response belongs to.
+---------------------------------------------------------- */
+struct ServerInfo : ServerAddress {
+    int server_fd;              // persistent session socket, -1 if not open
+    struct sockaddr_in addr;    // resolved once at startup
+    bool resolved;
+    bool down;                  // connect failed; don't retry this run
+    bool no_dedup;              // not content-addressed; skip have-checks
+    bool connecting;            // non-blocking connect still in progress
+    unsigned int next_req_id;
+    time_t last_activity;
+
+    deque<OutSegment> outq;
+    size_t out_off;             // bytes of outq.front() already sent
+    RecvBuffer inbuf;
+    deque<Request> inflight;
+
+    RecvState rx_state;
+    ChunkedFile *rx_chunk;      // destination of the chunk body, null = discard
+    int rx_chunk_index;
+    BlockInfo rx_info;          // header of the block being received
+    uint32_t rx_crc;            // CRC32C of its data so far
+    size_t rx_remaining;
+    double rx_done_ms;          // when the last block from this server finished arriving
+
+    ServerInfo() : server_fd(-1), resolved(false), down(false), no_dedup(false), connecting(false),
+                   next_req_id(1), last_activity(0), out_off(0), rx_state(RX_HEADER),
+                   rx_chunk(nullptr), rx_chunk_index(-1), rx_crc(0), rx_remaining(0), rx_done_ms(0) {
+        memset(&addr, 0, sizeof(addr));
+    }
+};
+
 void handle_error(const char *msg) {
     perror(msg);
     exit(EXIT_FAILURE);
 }
 
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
 /* ----------------------------------------------------------
-   send_all() – send full buffer over TCP
+   Recent chunk latencies, used to pick the hedging deadline.
+   A block's latency runs from its request being sent or, if
+   later, from the block before it on the same session finishing;
+   the blocks ahead of it in a batch are not charged to it. That
+   is the gap the deadline has to cover, as get_progress() pushes
+   it back whenever block data flows.
 ---------------------------------------------------------- */
-static int send_all(int fd, const void *buf, size_t len) {
-    const char *p = (const char*)buf;
-    while (len > 0) {
-        ssize_t n = send(fd, p, len, 0);
-        if (n <= 0) return -1;
-        p += n;
-        len -= n;
+static vector<double> latency_samples;
+static size_t latency_next = 0;
+
+static void record_latency(double ms) {
+    if (latency_samples.size() < LATENCY_SAMPLES) {
+        latency_samples.push_back(ms);
+    } else {
+        latency_samples[latency_next] = ms;
+        latency_next = (latency_next + 1) % LATENCY_SAMPLES;
     }
+}
+
+static double hedge_deadline_ms() {
+    if (client_config.hedge_percentile <= 0 || latency_samples.size() < LATENCY_MIN_SAMPLES) {
+        return client_config.hedge_ms;
+    }
+    vector<double> sorted(latency_samples);
+    size_t idx = (size_t)ceil(client_config.hedge_percentile / 100.0 * sorted.size()) - 1;
+    if (idx >= sorted.size()) idx = sorted.size() - 1;
+    nth_element(sorted.begin(), sorted.begin() + idx, sorted.end());
+    return sorted[idx];
+}
+
+/* ----------------------------------------------------------
+   resolve_server() – look up the server address once
+---------------------------------------------------------- */
+int resolve_server(ServerInfo *server) {
+    struct hostent *host = gethostbyname(server->ip.c_str());
+    if (!host) {
+        LOG(LOG_WARN) << "gethostbyname failed for " << server->ip;
+        return -1;
+    }
+
+    memset(&server->addr, 0, sizeof(server->addr));
+    server->addr.sin_family = AF_INET;
+    server->addr.sin_port = htons(server->port);
+    memcpy(&server->addr.sin_addr.s_addr, host->h_addr, host->h_length);
+    server->resolved = true;
     return 0;
 }
 
 /* ----------------------------------------------------------
-   connect_to_server() – open a fresh TCP connection
+   connect_to_server() – return the session socket, starting a
+   non-blocking connect on first use. Requests may be queued
+   right away; they are flushed once the connect completes.
 ---------------------------------------------------------- */
 int connect_to_server(ServerInfo *server) {
+    if (server->server_fd >= 0) {
+        return server->server_fd;
+    }
+    if (server->down || (!server->resolved && resolve_server(server) < 0)) {
+        server->down = true;
+        return -1;
+    }
+
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("socket");
         return -1;
     }
+    fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    if (connect(sockfd, (struct sockaddr *)&server->addr, sizeof(server->addr)) < 0) {
+        if (errno != EINPROGRESS) {
+            perror("connect");
+            close(sockfd);
+            server->down = true;
+            return -1;
+        }
+        server->connecting = true;
+    }
+
+    server->server_fd = sockfd;
+    server->last_activity = time(NULL);
+    return sockfd;
+}
+
+/* ----------------------------------------------------------
+   Request completion
+---------------------------------------------------------- */
+static void get_request_done(GetJob *job, const Request &req);
+
+static void complete_request(ServerInfo *server, Request &req, bool ok) {
+    if (req.kind == REQ_GET) {
+        GetJob *job = req.get;
+        job->outstanding--;
+        for (int idx : req.get_chunks) {
+            job->open[idx]--;
+        }
+        if (!job->finished) {
+            get_request_done(job, req);
+        }
+    } else if (req.kind == REQ_PUT) {
+        PutJob *job = req.put;
+        if (!ok) {
+            exit_status = EXIT_FAILURE;
+            LOG(LOG_WARN) << "[PUT] Failed to store chunk " << req.chunk_index << " of " << job->filename
+                          << " on server " << server->ip << ":" << server->port;
+        }
+        job->outstanding--;
+        job->inflight_bytes -= job->chunks[req.chunk_index].size();
+        // Both replicas are done with the block; drop it
+        if (--job->refs[req.chunk_index] == 0) {
+            job->chunks.erase(req.chunk_index);
+            job->refs.erase(req.chunk_index);
+            job->hashes.erase(req.chunk_index);
+        }
+    } else if (req.kind == REQ_HAVE) {
+        req.put->have_pending--;
+    }
+}
+
+/* ----------------------------------------------------------
+   close_session() – drop the session socket; anything still in
+   flight on it is failed
+---------------------------------------------------------- */
+void close_session(ServerInfo *server) {
+    if (server->server_fd >= 0) {
+        close(server->server_fd);
+        server->server_fd = -1;
+    }
+    server->connecting = false;
+    server->outq.clear();
+    server->out_off = 0;
+    server->inbuf.clear();
+    delete server->rx_chunk;
+    server->rx_chunk = nullptr;
+    server->rx_state = RX_HEADER;
+
+    deque<Request> failed;
+    failed.swap(server->inflight);
+    for (auto &req : failed) {
+        complete_request(server, req, false);
+    }
+}
+
+/* ----------------------------------------------------------
+   queue_request() – append a request frame (see protocol.h) to
+   the session's send queue: header, name and the owned body
+   bytes in one segment, then an optional borrowed payload.
+   Returns the request id on success, -1 on failure
+---------------------------------------------------------- */
+int queue_request(ServerInfo *server, Request req, uint8_t opcode, uint32_t arg, const string &name,
+                  const string &body = "", const char *payload = nullptr, size_t payload_len = 0,
+                  bool expect_reply = true) {
+    if (connect_to_server(server) < 0) {
+        return -1;
+    }
+
+    req.id = server->next_req_id++;
+
+    OutSegment header;
+    header.owned = encode_frame(opcode, req.id, arg, name, body.size() + payload_len);
+    header.owned += body;
+    header.data = nullptr;
+    header.len = header.owned.size();
+    server->outq.push_back(header);
+
+    if (payload_len > 0) {
+        OutSegment body;
+        body.data = payload;
+        body.len = payload_len;
+        server->outq.push_back(body);
+    }
+
+    if (!expect_reply) {
+        return req.id;
+    }
+    if (server->inflight.empty()) {
+        server->last_activity = time(NULL);
+    }
+    req.sent_ms = now_ms();
+    server->inflight.push_back(req);
+    return req.id;
+}
+
+static void get_block_info(GetJob *job, const BlockInfo &info);
+static bool same_generation(GetJob *job, const BlockInfo &info);
+int put_sender(ServerInfo *server, PutJob *job, int chunk_index, bool by_ref);
+static void get_chunk_arrived(GetJob *job, int chunk_index, ChunkedFile *chunk, const BlockInfo &info);
+static void get_progress(GetJob *job);
+static bool want_chunk(GetJob *job, int chunk_index);
+
+/* ----------------------------------------------------------
+   ENGINE - response parsing
+   Consumes as much of server->inbuf as possible. CHUNK and LIST
+   bodies are streamed into their destination as they arrive;
+   other replies are handled once their (small) body is
+   buffered. Returns -1 on a protocol error (the session is then
+   dropped).
+---------------------------------------------------------- */
+static int handle_response(ServerInfo *server, const FrameHeader &hdr, const char *body) {
+    if (server->inflight.empty() || hdr.req_id != server->inflight.front().id) {
+        LOG(LOG_WARN) << "[ENGINE] Unexpected response: " << opcode_name(hdr.opcode) << " " << hdr.req_id;
+        return -1;
+    }
+    Request &req = server->inflight.front();
+
+    if (hdr.opcode == OP_CHUNK && req.kind == REQ_GET) {
+        GetJob *job = req.get;
+        int chunk_index = (int)hdr.arg;
+        BlockInfo info;
+        if (hdr.body_len < BLOCK_INFO_SIZE || !decode_block_info(body, info) ||
+            info.length != hdr.body_len - BLOCK_INFO_SIZE ||
+            (!(info.flags & BLOCK_LEGACY) && info.offset + block_raw_length(info) > info.file_size)) {
+            LOG(LOG_WARN) << "[ENGINE] Invalid block header from " << server->ip << ":" << server->port;
+            return -1;
+        }
+        server->rx_state = RX_CHUNK;
+        server->rx_chunk_index = chunk_index;
+        server->rx_info = info;
+        server->rx_crc = 0;
+        server->rx_remaining = info.length;
+        server->rx_chunk = nullptr;
+
+        if (!req.cancelled && !job->finished) {
+            if (!same_generation(job, info)) {
+                LOG(LOG_DEBUG) << "[GET] Skipping chunk " << chunk_index << " from an older upload";
+                return 0;
+            }
+            get_block_info(job, info);
+        }
+
+        // Only store if we don't already have this chunk
+        if (req.cancelled || job->finished || !want_chunk(job, chunk_index)) {
+            LOG(LOG_DEBUG) << "[GET] Skipping duplicate chunk " << chunk_index;
+            return 0;
+        }
+
+        ChunkedFile *chunk = new ChunkedFile();
+        chunk->data = (char*)malloc(info.length > 0 ? info.length : 1);
+        if (!chunk->data) {
+            perror("malloc failed");
+            delete chunk;
+            return -1;
+        }
+        server->rx_chunk = chunk;
+        return 0;
+    }
+
+    if (hdr.opcode == OP_LISTING && req.kind == REQ_LIST) {
+        if (req.list) req.list->more = (hdr.arg & LIST_MORE) != 0;
+        server->rx_state = RX_LIST;
+        server->rx_remaining = hdr.body_len;
+        return 0;
+    }
+
+    // A server without -c refuses have-checks: it only can't dedup
+    if (hdr.opcode == OP_ERROR && req.kind == REQ_HAVE) {
+        LOG(LOG_DEBUG) << "[PUT] " << server->ip << ":" << server->port << " does not dedup: "
+                       << string(body, hdr.body_len);
+    } else if (hdr.opcode == OP_ERROR) {
+        LOG(LOG_WARN) << "[ENGINE] Error from " << server->ip << ":" << server->port << ": "
+                      << string(body, hdr.body_len);
+    }
+
+    if ((hdr.opcode == OP_END || hdr.opcode == OP_NOT_FOUND || hdr.opcode == OP_ERROR) &&
+        req.kind == REQ_GET) {
+        if (hdr.opcode == OP_NOT_FOUND) {
+            LOG(LOG_DEBUG) << "[GET] No chunks on " << server->ip << ":" << server->port;
+        } else {
+            LOG(LOG_DEBUG) << "[GET] End of response from " << server->ip << ":" << server->port;
+        }
+        Request done = req;
+        server->inflight.pop_front();
+        complete_request(server, done, true);
+        return 0;
+    }
+
+    if ((hdr.opcode == OP_OK || hdr.opcode == OP_ERROR) && req.kind == REQ_PUT) {
+        Request done = req;
+        server->inflight.pop_front();
+        complete_request(server, done, hdr.opcode == OP_OK);
+        return 0;
+    }
+
+    if (hdr.opcode == OP_NOT_FOUND && req.kind == REQ_PUT && req.by_ref) {
+        // The object went away since the have-check: send the data after all
+        Request done = req;
+        server->inflight.pop_front();
+        put_sender(server, done.put, done.chunk_index, false);
+        complete_request(server, done, true);
+        return 0;
+    }
+
+    if ((hdr.opcode == OP_HAVE_LIST || hdr.opcode == OP_ERROR) && req.kind == REQ_HAVE) {
+        PutJob *job = req.put;
+        if (hdr.opcode == OP_ERROR) {
+            server->no_dedup = true;
+        } else if (hdr.body_len != req.get_chunks.size()) {
+            LOG(LOG_WARN) << "[ENGINE] Invalid have list from " << server->ip << ":" << server->port;
+            return -1;
+        } else {
+            for (size_t i = 0; i < req.get_chunks.size(); i++) {
+                if (body[i]) job->stored[req.get_chunks[i]].insert(server);
+            }
+        }
+        Request done = req;
+        server->inflight.pop_front();
+        complete_request(server, done, true);
+        return 0;
+    }
+
+    if ((hdr.opcode == OP_STAT_LIST || hdr.opcode == OP_ERROR) && req.kind == REQ_STAT) {
+        StatCursor *cursor = req.stat;
+        if (hdr.opcode == OP_STAT_LIST) {
+            if (hdr.body_len % STAT_ENTRY != 0) {
+                LOG(LOG_WARN) << "[ENGINE] Invalid stat list from " << server->ip << ":" << server->port;
+                return -1;
+            }
+            for (size_t off = 0; off < hdr.body_len; off += STAT_ENTRY) {
+                int idx = (int)get_u32((const unsigned char *)body + off);
+                BlockInfo info;
+                if (idx < 0 || !decode_block_info(body + off + 4, info)) continue;
+                auto known = cursor->blocks->find(idx);
+                if (known == cursor->blocks->end() || known->second.generation < info.generation) {
+                    (*cursor->blocks)[idx] = info;
+                }
+                cursor->next = idx + 1;
+            }
+            cursor->more = (hdr.arg & LIST_MORE) && hdr.body_len > 0;
+        }
+        server->inflight.pop_front();
+        return 0;
+    }
+
+    if ((hdr.opcode == OP_METRICS_REPORT || hdr.opcode == OP_ERROR) && req.kind == REQ_METRICS) {
+        if (hdr.opcode == OP_METRICS_REPORT) req.report->assign(body, hdr.body_len);
+        server->inflight.pop_front();
+        return 0;
+    }
+
+    if (hdr.opcode == OP_ERROR && req.kind == REQ_LIST) {
+        server->inflight.pop_front();
+        return 0;
+    }
+
+    LOG(LOG_WARN) << "[ENGINE] Invalid response: " << opcode_name(hdr.opcode) << " " << hdr.req_id;
+    return -1;
+}
+
+// Check a received chunk against its CRC and inflate it if it came
+// compressed; false if it can't be used
+static bool finish_chunk(ServerInfo *server, GetJob *job) {
+    ChunkedFile *chunk = server->rx_chunk;
+    BlockInfo &info = server->rx_info;
+    const char *fault = nullptr;
+    if (server->rx_crc != info.crc) {
+        fault = "failed its checksum";
+    } else if (info.codec != BLOCK_CODEC_NONE) {
+        char *raw = (char*)malloc(info.raw_length > 0 ? info.raw_length : 1);
+        if (!codec_supported(info.codec)) {
+            fault = "uses an unsupported codec";
+        } else if (!raw || !codec_decompress(info.codec, (const uint8_t *)chunk->data, chunk->size,
+                                             (uint8_t *)raw, info.raw_length)) {
+            fault = "failed to decompress";
+        }
+        if (fault) {
+            free(raw);
+        } else {
+            free(chunk->data);
+            chunk->data = raw;
+            chunk->size = info.raw_length;
+            info.length = info.raw_length;
+            info.codec = BLOCK_CODEC_NONE;
+        }
+    }
+    if (fault) {
+        LOG(LOG_WARN) << "[GET] Chunk " << server->rx_chunk_index << " of " << job->filename << " from "
+                      << server->ip << ":" << server->port << " " << fault;
+        return false;
+    }
+    return true;
+}
+
+static int process_responses(ServerInfo *server) {
+    RecvBuffer &in = server->inbuf;
+    while (!in.empty()) {
+        if (server->rx_state == RX_HEADER) {
+            FrameHeader hdr;
+            if (in.size() < FRAME_HEADER_SIZE) break;
+            if (!decode_frame_header(in.data(), hdr) || hdr.name_len > PROTO_MAX_NAME) {
+                LOG(LOG_WARN) << "[ENGINE] Invalid frame header from " << server->ip << ":" << server->port;
+                return -1;
+            }
+
+            bool streamed = hdr.opcode == OP_CHUNK || hdr.opcode == OP_LISTING;
+            size_t need = FRAME_HEADER_SIZE + hdr.name_len;
+            if (hdr.opcode == OP_CHUNK) {
+                // The BlockInfo in front of the data is read up front
+                need += min<uint64_t>(hdr.body_len, BLOCK_INFO_SIZE);
+            } else if (!streamed) {
+                if (hdr.body_len > PROTO_MAX_CONTROL) return -1;
+                need += hdr.body_len;
+            }
+            if (in.size() < need) break;
+
+            const char *body = in.data() + FRAME_HEADER_SIZE + hdr.name_len;
+            if (handle_response(server, hdr, body) < 0) {
+                return -1;
+            }
+            in.consume(need);
+            // A zero-length body completes immediately
+            if (server->rx_state == RX_HEADER || server->rx_remaining > 0) continue;
+        }
+
+        size_t avail = in.size();
+        size_t take = (avail < server->rx_remaining) ? avail : server->rx_remaining;
+        Request &req = server->inflight.front();
+
+        if (server->rx_state == RX_CHUNK && server->rx_chunk) {
+            memcpy(server->rx_chunk->data + server->rx_chunk->size, in.data(), take);
+            server->rx_crc = crc32c(server->rx_crc, in.data(), take);
+            server->rx_chunk->size += take;
+            get_progress(req.get);
+        } else if (server->rx_state == RX_LIST && req.list) {
+            req.list->page.append(in.data(), take);
+        }
+        in.consume(take);
+        server->rx_remaining -= take;
+        if (server->rx_remaining > 0) break;
+
+        double block_ms = 0;
+        if (server->rx_state == RX_CHUNK) {
+            double done_ms = now_ms();
+            block_ms = done_ms - max(req.sent_ms, server->rx_done_ms);
+            server->rx_done_ms = done_ms;
+        }
+        if (server->rx_state == RX_CHUNK && server->rx_chunk) {
+            if (finish_chunk(server, req.get)) {
+                record_latency(block_ms);
+                get_chunk_arrived(req.get, server->rx_chunk_index, server->rx_chunk, server->rx_info);
+            } else {
+                // Dropped; the request ends without it and the block
+                // is fetched elsewhere
+                delete server->rx_chunk;
+            }
+            server->rx_chunk = nullptr;
+        } else if (server->rx_state == RX_LIST) {
+            if (req.list) req.list->answered = true;
+            server->inflight.pop_front();
+        }
+        server->rx_state = RX_HEADER;
+    }
+    return 0;
+}
+
+/* ----------------------------------------------------------
+   ENGINE - socket I/O
+---------------------------------------------------------- */
+static int flush_output(ServerInfo *server) {
+    while (!server->outq.empty()) {
+        struct iovec iov[MAX_IOV];
+        int iovcnt = 0;
+        size_t off = server->out_off;
+        for (auto it = server->outq.begin(); it != server->outq.end() && iovcnt < MAX_IOV; ++it) {
+            const char *base = it->data ? it->data : it->owned.data();
+            iov[iovcnt].iov_base = (void*)(base + off);
+            iov[iovcnt].iov_len = it->len - off;
+            iovcnt++;
+            off = 0;
+        }
+
+        ssize_t n = writev(server->server_fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("send failed");
+            return -1;
+        }
+        server->last_activity = time(NULL);
+
+        size_t sent = n;
+        while (sent > 0) {
+            OutSegment &seg = server->outq.front();
+            size_t left = seg.len - server->out_off;
+            if (sent >= left) {
+                sent -= left;
+                server->outq.pop_front();
+                server->out_off = 0;
+            } else {
+                server->out_off += sent;
+                sent = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+static int read_input(ServerInfo *server) {
+    char buf[RECV_BUFSIZE];
+    while (1) {
+        ssize_t n = recv(server->server_fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            perror("recv failed");
+            return -1;
+        }
+        if (n == 0) {
+            return -1; // Connection closed
+        }
+        server->last_activity = time(NULL);
+        server->inbuf.append(buf, n);
+        if (process_responses(server) < 0) {
+            return -1;
+        }
+    }
+}
+
+/* ----------------------------------------------------------
+   engine_poll() – one round of non-blocking I/O across every
+   session. Returns the number of sessions with work left.
+---------------------------------------------------------- */
+int engine_poll(vector<ServerInfo> &servers, int timeout_ms) {
+    vector<struct pollfd> fds;
+    vector<ServerInfo*> owners;
+    time_t now = time(NULL);
+
+    for (auto &server : servers) {
+        if (server.server_fd < 0) continue;
+        if (server.inflight.empty() && server.outq.empty()) continue;
+
+        if (now - server.last_activity > SESSION_TIMEOUT_SEC) {
+            LOG(LOG_WARN) << "[RECV] Timeout from " << server.ip << ":" << server.port;
+            close_session(&server);
+            continue;
+        }
+
+        struct pollfd p;
+        p.fd = server.server_fd;
+        p.events = POLLIN;
+        if (server.connecting || !server.outq.empty()) p.events |= POLLOUT;
+        p.revents = 0;
+        fds.push_back(p);
+        owners.push_back(&server);
+    }
+    if (fds.empty()) return 0;
+
+    int n = poll(fds.data(), fds.size(), timeout_ms);
+    if (n < 0) {
+        if (errno != EINTR) perror("poll");
+        return fds.size();
+    }
+
+    for (size_t i = 0; i < fds.size(); i++) {
+        ServerInfo *server = owners[i];
+        short rev = fds[i].revents;
+        if (rev == 0) continue;
+
+        if (server->connecting) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(server->server_fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err != 0) {
+                LOG(LOG_WARN) << "connect: " << strerror(err) << " (" << server->ip << ":" << server->port << ")";
+                server->down = true;
+                close_session(server);
+                continue;
+            }
+            server->connecting = false;
+        }
+
+        if ((rev & (POLLIN | POLLHUP | POLLERR)) && read_input(server) < 0) {
+            close_session(server);
+            continue;
+        }
+        if ((rev & POLLOUT) && flush_output(server) < 0) {
+            close_session(server);
+            continue;
+        }
+    }
+    return fds.size();
+}
+
+// Run the engine until every session is idle
+static void engine_drain(vector<ServerInfo> &servers) {
+    while (engine_poll(servers, 1000) > 0) {
+    }
+}
+
+/* ----------------------------------------------------------
+   LIST
+   Every server answers in pages of LIST_PAGE entries sorted by
+   file name, then block index, so the listings are merged like
+   sorted runs: take the smallest name at the head of any
+   server's page, gather its blocks from all of them, print it,
+   and ask a server for its next page only once the current one
+   is used up. Memory stays at a page per server however many
+   files there are. A server that can't be reached (or drops
+   out part way) simply contributes nothing more.
+---------------------------------------------------------- */
+static void parse_list_page(ListCursor &cursor) {
+    cursor.entries.clear();
+    cursor.next = 0;
+    size_t start = 0;
+    while (start < cursor.page.size()) {
+        size_t end = cursor.page.find('\n', start);
+        if (end == string::npos) end = cursor.page.size();
+        string line = cursor.page.substr(start, end - start);
+        start = end + 1;
+
+        // The layout fields follow the last '.' (names may hold spaces)
+        ListEntry entry;
+        entry.legacy = true;
+        size_t pos = line.rfind('.');
+        if (pos == string::npos) continue;
+        unsigned long long generation;
+        unsigned nblocks, flags, ec_data, ec_parity;
+        int block, used = 0;
+        if (sscanf(line.c_str() + pos + 1, "%d %llu %u %u %u %u%n", &block, &generation, &nblocks, &flags,
+                   &ec_data, &ec_parity, &used) == 6 && pos + 1 + used == line.size()) {
+            entry.legacy = false;
+            entry.info.generation = generation;
+            entry.info.nblocks = nblocks;
+            entry.info.flags = flags;
+            entry.info.ec_data = ec_data;
+            entry.info.ec_parity = ec_parity;
+        } else {
+            string suffix = line.substr(pos + 1);
+            if (suffix.empty() || !all_of(suffix.begin(), suffix.end(), ::isdigit)) continue;
+            block = atoi(suffix.c_str());
+        }
+        entry.name = line.substr(0, pos);
+        entry.block = block;
+        if (block >= 0) cursor.entries.push_back(entry);
+    }
+    cursor.page.clear();
+}
+
+// Fetch the next page, in parallel, for every server whose
+// current one is used up
+static void fetch_list_pages(vector<ServerInfo> &servers, vector<ListCursor> &cursors,
+                             const string &prefix) {
+    vector<bool> asked(servers.size(), false);
+    for (size_t i = 0; i < servers.size(); i++) {
+        ListCursor &cursor = cursors[i];
+        if (cursor.next < cursor.entries.size() || !cursor.more) continue;
+
+        // Resume after the last entry handed out
+        string after;
+        if (!cursor.entries.empty()) {
+            const ListEntry &last = cursor.entries.back();
+            after.resize(4);
+            put_u32((unsigned char *)&after[0], last.block);
+            after += last.name;
+        }
+        cursor.answered = false;
+        cursor.page.clear();
+
+        Request req;
+        req.kind = REQ_LIST;
+        req.list = &cursor;
+        asked[i] = queue_request(&servers[i], req, OP_LIST, LIST_PAGE, prefix, after) >= 0;
+        if (!asked[i]) {
+            cursor.entries.clear();
+            cursor.next = 0;
+            cursor.more = false;
+        }
+    }
+    engine_drain(servers);
+
+    for (size_t i = 0; i < servers.size(); i++) {
+        if (!asked[i]) continue;
+        ListCursor &cursor = cursors[i];
+        if (!cursor.answered) {
+            cursor.page.clear();
+            cursor.more = false;
+        }
+        parse_list_page(cursor);
+    }
+}
+
+// Whether the newest upload of a file can be read back from the
+// blocks listed: every block of a replicated layout, k of each
+// stripe of an erasure-coded one. A file stored before block
+// headers needs blocks 0..max, at least one per server.
+static bool list_complete(const vector<ListEntry> &blocks, size_t server_count) {
+    const ListEntry *newest = nullptr;
+    for (const auto &b : blocks) {
+        if (!b.legacy && (!newest || b.info.generation > newest->info.generation)) newest = &b;
+    }
+    if (!newest) {
+        set<int> seen;
+        for (const auto &b : blocks) seen.insert(b.block);
+        return *seen.begin() == 0 && *seen.rbegin() + 1 == (int)seen.size() && seen.size() >= server_count;
+    }
+
+    const BlockInfo &layout = newest->info;
+    int width = stripe_width(layout);
+    set<int> seen;
+    for (const auto &b : blocks) {
+        if (!b.legacy && b.info.generation == layout.generation && (uint32_t)b.block < layout.nblocks) {
+            seen.insert(b.block);
+        }
+    }
+    if (width == 0) return seen.size() == layout.nblocks;
+
+    vector<int> per_stripe(layout.nblocks / width, 0);
+    for (int b : seen) per_stripe[b / width]++;
+    for (int n : per_stripe) {
+        if (n < layout.ec_data) return false;
+    }
+    return true;
+}
+
+void list(vector<ServerInfo> &servers, const string &prefix) {
+    vector<ListCursor> cursors(servers.size());
+
+    while (true) {
+        fetch_list_pages(servers, cursors, prefix);
+
+        const string *smallest = nullptr;
+        for (auto &cursor : cursors) {
+            if (cursor.next == cursor.entries.size()) continue;
+            const string &name = cursor.entries[cursor.next].name;
+            if (!smallest || name < *smallest) smallest = &name;
+        }
+        if (!smallest) break;
+        string name = *smallest;
+
+        // Its blocks on every server; one may run off the end of a
+        // page part way through them
+        vector<ListEntry> blocks;
+        bool refill;
+        do {
+            refill = false;
+            for (auto &cursor : cursors) {
+                while (cursor.next < cursor.entries.size() && cursor.entries[cursor.next].name == name) {
+                    blocks.push_back(cursor.entries[cursor.next]);
+                    cursor.next++;
+                }
+                if (cursor.next == cursor.entries.size() && cursor.more) refill = true;
+            }
+            if (refill) fetch_list_pages(servers, cursors, prefix);
+        } while (refill);
+
+        if (list_complete(blocks, servers.size())) {
+            cout << name << endl;
+        } else {
+            cout << name << " (incomplete) " << endl;
+        }
+    }
+}
+
+/* ----------------------------------------------------------
+   STATS
+   Every server reports its counters (see METRICS in dfs.cpp);
+   each one's is printed, then the cluster's. Counters add up,
+   rates are each server's count over its uptime added up, and
+   latency histograms are merged bucket by bucket before the
+   percentiles are read off them.
+---------------------------------------------------------- */
+struct ServerMetrics {
+    map<string, uint64_t> values;
+    map<string, vector<uint64_t>> latency;      // op -> LAT_BUCKETS counts
+};
+
+static void parse_metrics(const string &report, ServerMetrics &m) {
+    size_t start = 0;
+    while (start < report.size()) {
+        size_t end = report.find('\n', start);
+        if (end == string::npos) end = report.size();
+        string line = report.substr(start, end - start);
+        start = end + 1;
+
+        size_t space = line.find(' ');
+        string name = line.substr(0, space);
+        const string suffix = ".latency_us";
+        if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            vector<uint64_t> &counts = m.latency[name.substr(0, name.size() - suffix.size())];
+            counts.resize(LAT_BUCKETS, 0);
+            char *p = (space == string::npos) ? nullptr : &line[space];
+            while (p && *p) {
+                char *next;
+                long b = strtol(p, &next, 10);
+                if (next == p || *next != ':') break;
+                uint64_t n = strtoull(next + 1, &p, 10);
+                if (b >= 0 && b < LAT_BUCKETS) counts[b] += n;
+            }
+        } else if (space != string::npos) {
+            m.values[name] = strtoull(line.c_str() + space + 1, NULL, 10);
+        }
+    }
+}
+
+void stats(vector<ServerInfo> &servers) {
+    vector<string> reports(servers.size());
+    vector<bool> asked(servers.size(), false);
+    for (size_t i = 0; i < servers.size(); i++) {
+        Request req;
+        req.kind = REQ_METRICS;
+        req.report = &reports[i];
+        asked[i] = queue_request(&servers[i], req, OP_METRICS, 0, "") >= 0;
+    }
+    engine_drain(servers);
+
+    static const char *ops[] = {"list", "get", "put", "stat"};
+    ServerMetrics total;
+    map<string, double> rates;                  // per second, summed over servers
+    int answered = 0;
+    for (size_t i = 0; i < servers.size(); i++) {
+        ServerInfo &server = servers[i];
+        if (!asked[i] || reports[i].empty()) {
+            printf("%-8s %s:%d  unreachable\n", server.name.c_str(), server.ip.c_str(), server.port);
+            continue;
+        }
+        answered++;
+        ServerMetrics m;
+        parse_metrics(reports[i], m);
+        double uptime = max<uint64_t>(m.values["uptime_s"], 1);
+        printf("%-8s %s:%d  up %llus, %llu connections open (%llu total), %llu bytes queued\n",
+               server.name.c_str(), server.ip.c_str(), server.port,
+               (unsigned long long)m.values["uptime_s"], (unsigned long long)m.values["connections_open"],
+               (unsigned long long)m.values["connections_total"], (unsigned long long)m.values["queued_bytes"]);
+        for (auto &v : m.values) {
+            total.values[v.first] += v.second;
+            rates[v.first] += v.second / uptime;
+        }
+        for (auto &h : m.latency) {
+            vector<uint64_t> &counts = total.latency[h.first];
+            counts.resize(LAT_BUCKETS, 0);
+            for (int b = 0; b < LAT_BUCKETS; b++) counts[b] += h.second[b];
+        }
+    }
+    if (answered == 0) return;
+
+    printf("\nCluster (%d of %zu servers)\n", answered, servers.size());
+    printf("  %-5s %12s %8s %10s %10s %10s %10s\n", "op", "count", "errors", "ops/s", "p50(us)", "p99(us)",
+           "p999(us)");
+    for (const char *op : ops) {
+        string name = op;
+        vector<uint64_t> &counts = total.latency[name];
+        counts.resize(LAT_BUCKETS, 0);
+        printf("  %-5s %12llu %8llu %10.1f %10llu %10llu %10llu\n", op,
+               (unsigned long long)total.values[name + ".count"], (unsigned long long)total.values[name + ".errors"],
+               rates[name + ".count"], (unsigned long long)lat_percentile(counts.data(), 0.5),
+               (unsigned long long)lat_percentile(counts.data(), 0.99),
+               (unsigned long long)lat_percentile(counts.data(), 0.999));
+    }
+    printf("  bytes in %llu (%.2f MB/s), out %llu (%.2f MB/s)\n", (unsigned long long)total.values["bytes_in"],
+           rates["bytes_in"] / 1e6, (unsigned long long)total.values["bytes_out"], rates["bytes_out"] / 1e6);
+    printf("  disk time: read %.1f ms, write %.1f ms\n", total.values["disk_read_us"] / 1000.0,
+           total.values["disk_write_us"] / 1000.0);
+    uint64_t hits = total.values["hot_cache_hits"], misses = total.values["hot_cache_misses"];
+    printf("  hot cache: %llu hits, %llu misses (%.1f%% hits), %llu evictions, %llu bytes held\n",
+           (unsigned long long)hits, (unsigned long long)misses, hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+           (unsigned long long)total.values["hot_cache_evictions"],
+           (unsigned long long)total.values["hot_cache_bytes"]);
+}
+
+/* ----------------------------------------------------------
+   BLOCK LAYOUT
+   How a file is cut into blocks and where they go is worked out
+   by the helpers in placement.h; block_layout() applies the
+   dfc.conf settings. Each upload gets a new generation: the wall
+   clock in microseconds, with GENERATION_RANDOM_BITS random low
+   bits so two clients uploading at the same instant still differ.
+---------------------------------------------------------- */
+#define GENERATION_RANDOM_BITS 12
+
+static uint64_t new_generation() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    uint16_t noise = 0;
+    if (RAND_bytes((unsigned char *)&noise, sizeof(noise)) != 1) noise = getpid();
+    return (us << GENERATION_RANDOM_BITS) | (noise & ((1 << GENERATION_RANDOM_BITS) - 1));
+}
+
+static BlockInfo block_layout(uint64_t file_size, int server_count) {
+    BlockInfo layout = plan_layout(file_size, server_count, client_config.block_size,
+                                   client_config.ec_data, client_config.ec_parity);
+    layout.generation = new_generation();
+    return layout;
+}
+
+/* ----------------------------------------------------------
+   CHUNK CACHE
+   With "cache <dir>" in dfc.conf every block a GET receives whole
+   is kept in <dir>, decompressed, as <key>.<block index> (key
+   being a hash of the file name): a CACHE_HEADER_SIZE-byte header
+       magic       u32   CACHE_MAGIC
+       reserved    u32
+       generation  u64   of the block, as the servers report it
+       block_crc   u32   crc32c in the block's BlockInfo
+       data_crc    u32   crc32c of the cached bytes
+       length      u64   bytes of data following the header
+   then the data. Before downloading, a GET asks every server for
+   the headers of the file's blocks (OP_STAT, answered from the
+   server's index without touching the disk); each block whose
+   newest header matches a cached copy comes from the cache and
+   only the others go over the network, so a file nobody changed
+   is put back together after one round trip.
+   The directory is kept under cache_size bytes by dropping the
+   least recently used blocks. The LRU index is loaded from the
+   directory on first use, ordered by mtime; a hit touches the
+   file so the order carries over to the next run.
+---------------------------------------------------------- */
+#define CACHE_MAGIC 0x44464343          // "DFCC"
+#define CACHE_HEADER_SIZE 32
+#define CACHE_KEY_BYTES 16
+
+struct CacheEntry {
+    string name;                        // file in the cache directory
+    uint64_t size;
+};
+
+static std::list<CacheEntry> cache_lru;                  // most recently used first
+static unordered_map<string, std::list<CacheEntry>::iterator> cache_index;
+static uint64_t cache_bytes = 0;
+static bool cache_loaded = false;
+
+static bool cache_enabled() {
+    return !client_config.cache_dir.empty();
+}
+
+static string cache_entry_name(const string &filename, int chunk_index) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_Digest(filename.data(), filename.size(), digest, &len, EVP_sha256(), NULL);
+    static const char hex[] = "0123456789abcdef";
+    string name;
+    for (int i = 0; i < CACHE_KEY_BYTES; i++) {
+        name += hex[digest[i] >> 4];
+        name += hex[digest[i] & 15];
+    }
+    return name + "." + to_string(chunk_index);
+}
+
+static string cache_path(const string &name) {
+    return client_config.cache_dir + "/" + name;
+}
+
+static void cache_drop(std::list<CacheEntry>::iterator it) {
+    unlink(cache_path(it->name).c_str());
+    cache_bytes -= it->size;
+    cache_index.erase(it->name);
+    cache_lru.erase(it);
+}
+
+static void cache_evict() {
+    while (cache_bytes > client_config.cache_size && !cache_lru.empty()) {
+        cache_drop(prev(cache_lru.end()));
+    }
+}
+
+// Build the LRU index from the directory, newest first
+static void cache_load() {
+    if (cache_loaded) return;
+    cache_loaded = true;
+    mkdir(client_config.cache_dir.c_str(), 0755);
+    DIR *dir = opendir(client_config.cache_dir.c_str());
+    if (!dir) {
+        perror("opendir failed");
+        client_config.cache_dir.clear();
+        return;
+    }
+
+    vector<pair<time_t, CacheEntry>> found;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != nullptr) {
+        string name = ent->d_name;
+        struct stat st;
+        if (name[0] == '.' || stat(cache_path(name).c_str(), &st) < 0 || !S_ISREG(st.st_mode)) continue;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".tmp") == 0) {
+            // Left by a run that died while storing a block
+            unlink(cache_path(name).c_str());
+            continue;
+        }
+        CacheEntry entry;
+        entry.name = name;
+        entry.size = st.st_size;
+        found.push_back(make_pair(st.st_mtime, entry));
+    }
+    closedir(dir);
+
+    sort(found.begin(), found.end(), [](const pair<time_t, CacheEntry> &a, const pair<time_t, CacheEntry> &b) {
+        return a.first > b.first;
+    });
+    for (auto &f : found) {
+        cache_lru.push_back(f.second);
+        cache_index[f.second.name] = prev(cache_lru.end());
+        cache_bytes += f.second.size;
+    }
+    cache_evict();
+}
+
+// The cached data of block chunk_index if it is the version info
+// describes; false on a miss
+static bool cache_lookup(const string &filename, int chunk_index, const BlockInfo &info,
+                         vector<char> &data) {
+    cache_load();
+    string name = cache_entry_name(filename, chunk_index);
+    auto found = cache_index.find(name);
+    if (found == cache_index.end()) return false;
+
+    int fd = open(cache_path(name).c_str(), O_RDONLY);
+    if (fd < 0) {
+        cache_drop(found->second);
+        return false;
+    }
+    unsigned char hdr[CACHE_HEADER_SIZE];
+    bool ok = read(fd, hdr, CACHE_HEADER_SIZE) == CACHE_HEADER_SIZE && get_u32(hdr) == CACHE_MAGIC;
+    uint64_t length = ok ? get_u64(hdr + 24) : 0;
+    if (!ok || get_u64(hdr + 8) != info.generation || get_u32(hdr + 16) != info.crc ||
+        length != block_raw_length(info)) {
+        // An older version of the block; it is replaced once fetched
+        close(fd);
+        return false;
+    }
+    data.resize(length);
+    ok = pread(fd, data.data(), length, CACHE_HEADER_SIZE) == (ssize_t)length &&
+         crc32c(0, data.data(), length) == get_u32(hdr + 20);
+    close(fd);
+    if (!ok) {
+        LOG(LOG_WARN) << "[CACHE] Dropping damaged copy of block " << chunk_index << " of " << filename;
+        cache_drop(found->second);
+        return false;
+    }
+
+    cache_lru.splice(cache_lru.begin(), cache_lru, found->second);
+    utimes(cache_path(name).c_str(), NULL);
+    return true;
+}
+
+// Keep a block that just arrived; info is its header as stored
+static void cache_store(const string &filename, int chunk_index, const BlockInfo &info,
+                        const char *data, size_t len) {
+    cache_load();
+    if (!cache_enabled() || CACHE_HEADER_SIZE + len > client_config.cache_size) return;
+    string name = cache_entry_name(filename, chunk_index);
+    string tmp = cache_path(name + ".tmp");
+    uint64_t size = CACHE_HEADER_SIZE + len;
+
+    unsigned char hdr[CACHE_HEADER_SIZE];
+    memset(hdr, 0, sizeof(hdr));
+    put_u32(hdr, CACHE_MAGIC);
+    put_u64(hdr + 8, info.generation);
+    put_u32(hdr + 16, info.crc);
+    put_u32(hdr + 20, crc32c(0, data, len));
+    put_u64(hdr + 24, len);
+
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open failed");
+        return;
+    }
+    bool ok = write(fd, hdr, CACHE_HEADER_SIZE) == CACHE_HEADER_SIZE;
+    while (ok && len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) {
+            data += n;
+            len -= n;
+        }
+    }
+    if (close(fd) < 0 || !ok || rename(tmp.c_str(), cache_path(name).c_str()) < 0) {
+        perror("cache write failed");
+        unlink(tmp.c_str());
+        return;
+    }
+
+    auto found = cache_index.find(name);
+    if (found != cache_index.end()) {
+        cache_bytes -= found->second->size;
+        cache_lru.erase(found->second);
+    }
+    CacheEntry entry;
+    entry.name = name;
+    entry.size = size;
+    cache_lru.push_front(entry);
+    cache_index[name] = cache_lru.begin();
+    cache_bytes += size;
+    cache_evict();
+}
+
+// A whole block of a GET's file arrived and was checked
+static void cache_block(GetJob *job, int chunk_index, const ChunkedFile *chunk, const BlockInfo &info) {
+    if (cache_enabled() && !job->ranged && !(info.flags & BLOCK_LEGACY)) {
+        cache_store(job->filename, chunk_index, info, chunk->data, chunk->size);
+    }
+}
+
+/* ----------------------------------------------------------
+   GET
+   Each block is first asked of the server that holds its primary
+   copy. Until a block arrives the client can't know how many
+   there are, so the first stripe (one block per server) goes out
+   first and the rest is requested, GET_BATCH blocks per request,
+   as soon as a BlockInfo reveals the real count. Blocks are
+   written to <file>.part at their offset as they land, which is
+   renamed into place once every block is in.
+   If the download stalls (no block data at all) for the hedging
+   deadline, or a request comes back empty, missing blocks are
+   asked of the other replica; whichever copy lands first wins and
+   requests that can no longer contribute are cancelled. If both
+   replicas fail, every other server is tried before the file is
+   reported incomplete.
+   An erasure-coded file is read from its data blocks alone. A
+   data block that can't be had (or, when hedging, is late) puts
+   its stripe into rebuild: whole blocks of that stripe, parity
+   included, are gathered until any k of them decode the rest.
+   Only blocks of one generation (upload) of the file are used.
+   A block from an older one is skipped, so it is fetched from
+   the next candidate; a block from a newer one means the file
+   was uploaded again meanwhile, and the download starts over on
+   that version.
+---------------------------------------------------------- */
+static string part_path(GetJob *job) {
+    return job->output + ".part";
+}
+
+// What bytes offset to offset + length of filename are saved as
+static string range_name(const string &filename, uint64_t offset, uint64_t length) {
+    return filename + "." + to_string(offset) + "-" + to_string(offset + length);
+}
+
+static int get_output(GetJob *job) {
+    if (job->out_fd < 0) {
+        job->out_fd = open(part_path(job).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (job->out_fd < 0) {
+            perror("open failed");
+        }
+    }
+    return job->out_fd;
+}
+
+// offset is the position of data in the file being fetched; a
+// ranged job only keeps the part inside its range
+static int write_block(GetJob *job, const char *data, size_t len, uint64_t offset) {
+    if (job->ranged) {
+        uint64_t start = max(offset, job->range_offset);
+        uint64_t end = min(offset + len, job->range_offset + job->range_length);
+        if (start >= end) return 0;
+        data += start - offset;
+        len = end - start;
+        offset = start;
+    }
+    offset -= job->range_offset;
+    if (job->out_buf) {
+        if (offset + len > job->out_buf->size()) job->out_buf->resize(offset + len);
+        memcpy(job->out_buf->data() + offset, data, len);
+        return 0;
+    }
+
+    int fd = get_output(job);
+    if (fd < 0) return -1;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write failed");
+            return -1;
+        }
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static void finish_get(GetJob *job) {
+    const string &filename = job->filename;
+    job->finished = true;
+
+    // Check if we have all chunks
+    bool have_all = true;
+    for (int i = 0; i < job->chunk_count; i++) {
+        if (!job->have[i]) {
+            LOG(LOG_WARN) << "[GET] Missing chunk " << i << " for " << filename;
+            have_all = false;
+        }
+    }
 
-    struct hostent *host = gethostbyname(server->ip.c_str());
-    if (!host) {
-        perror("gethostbyname");
-        close(sockfd);
-        return -1;
+    // Chunks stored before striping carry no offset; they are the
+    // file's pieces in index order
+    uint64_t offset = 0;
+    for (auto &pair : job->legacy) {
+        if (have_all && write_block(job, pair.second->data, pair.second->size, offset) < 0) {
+            have_all = false;
+        }
+        offset += pair.second->size;
+        delete pair.second;
+    }
+    job->legacy.clear();
+    for (auto &stripe : job->stripes) {
+        for (auto &shard : stripe.second.shards) {
+            delete shard.second;
+        }
     }
+    job->stripes.clear();
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(server->port);
-    memcpy(&addr.sin_addr.s_addr, host->h_addr, host->h_length);
+    if (have_all && job->out_buf) {
+        job->ok = true;
+        return;
+    }
+    // A range is saved under the bytes it got once clipped to the file
+    string saved = job->ranged ? range_name(filename, job->range_offset, job->range_length) : job->output;
+    if (have_all && get_output(job) >= 0 && close(job->out_fd) == 0 &&
+        rename(part_path(job).c_str(), saved.c_str()) == 0) {
+        job->out_fd = -1;
+        job->ok = true;
+        if (job->ranged) {
+            LOG(LOG_INFO) << "[GET] Saved bytes " << job->range_offset << "-" << job->range_offset + job->range_length
+                          << " of " << filename << " as " << saved;
+        } else {
+            LOG(LOG_INFO) << "[GET] Successfully reassembled file " << filename;
+        }
+        return;
+    }
 
-    if (connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("connect");
-        close(sockfd);
-        return -1;
+    exit_status = EXIT_FAILURE;
+    if (have_all) {
+        perror("write failed");
+    } else {
+        cout << filename << " incomplete" << endl;
     }
+    if (job->out_fd >= 0) {
+        close(job->out_fd);
+        unlink(part_path(job).c_str());
+    }
+    job->out_fd = -1;
+}
 
-    return sockfd;
+static bool have_chunk(GetJob *job, int chunk_index) {
+    return job->have[chunk_index];
 }
 
-/* ----------------------------------------------------------
-   GENERIC sender() – open connection and send "COMMAND PAYLOAD\n"
-   Returns the socket fd on success (caller must close), -1 on failure
----------------------------------------------------------- */
-int sender(ServerInfo *server, const char *command, const char *payload) {
-    if (!payload) payload = "";
+// Whether a block arriving now would be used: it is still missing,
+// or it is part of a stripe being rebuilt that lacks it
+static bool want_chunk(GetJob *job, int chunk_index) {
+    if (chunk_index < 0 || chunk_index >= job->chunk_count) return false;
+    if (!job->have[chunk_index]) return true;
+    int width = stripe_width(job->layout);
+    if (width == 0) return false;
+    auto stripe = job->stripes.find(chunk_index / width);
+    return stripe != job->stripes.end() && !stripe->second.shards.count(chunk_index % width);
+}
 
-    int sockfd = connect_to_server(server);
-    if (sockfd < 0) {
-        return -1;
+// A block asked for a rebuild won't come: no request for it is left
+static void rebuild_block_failed(GetJob *job, int chunk_index) {
+    int width = stripe_width(job->layout);
+    if (width == 0 || job->open[chunk_index] > 0) return;
+    auto stripe = job->stripes.find(chunk_index / width);
+    int position = chunk_index % width;
+    if (stripe != job->stripes.end() && stripe->second.asked.count(position) &&
+        !stripe->second.shards.count(position)) {
+        stripe->second.failed.insert(position);
     }
+}
 
-    char buffer[1024];
-    int len = snprintf(buffer, sizeof(buffer), "%s %s\n", command, payload);
+// Cancel in-flight requests of this job that can no longer
+// contribute: all of their chunks arrived, or the job is over
+static void cancel_covered_requests(GetJob *job) {
+    for (auto &server : *job->servers) {
+        for (auto &req : server.inflight) {
+            if (req.kind != REQ_GET || req.get != job || req.cancelled) continue;
 
-    if (send_all(sockfd, buffer, len) < 0) {
-        perror("send failed");
-        close(sockfd);
-        return -1;
+            bool covered = true;
+            for (int idx : req.get_chunks) {
+                if (want_chunk(job, idx)) covered = false;
+            }
+            if (!covered && !job->finished) continue;
+
+            req.cancelled = true;
+            Request cancel;
+            queue_request(&server, cancel, OP_CANCEL, req.id, "", "", nullptr, 0, false);
+        }
     }
+}
 
-    // Store the new socket in the server struct for response reading
-    server->server_fd = sockfd;
-    return sockfd;
+// Part of block idx a ranged job wants, relative to the block's data
+static void block_slice(GetJob *job, int idx, uint64_t &offset, uint64_t &length) {
+    if (!job->have_layout) {
+        // Probing block 0 for the layout; it starts the file
+        offset = job->range_offset;
+        length = job->range_length;
+        return;
+    }
+    int width = stripe_width(job->layout);
+    if (width > 0 && job->stripes.count(idx / width)) {
+        // Decoding needs whole blocks
+        offset = 0;
+        length = UINT64_MAX;
+        return;
+    }
+    uint64_t block_off, block_len;
+    block_extent(job->layout, idx, block_off, block_len);
+    uint64_t start = max(block_off, job->range_offset);
+    uint64_t end = min(block_off + block_len, job->range_offset + job->range_length);
+    offset = start - block_off;
+    length = end > start ? end - start : 0;
 }
 
-char* get_response(ServerInfo *server, char *buf, size_t buflen, int timeout_sec = 5) {
-    time_t start_time = time(NULL);
-    while (1) {
-        if (time(NULL) - start_time > timeout_sec) {
-            cout << "[GET RESPONSE] Timeout after " << timeout_sec << " seconds" << endl;
-            close(server->server_fd);
-            return nullptr;
+// Ask one server for a set of chunks, GET_BATCH per request;
+// returns false if it can't be reached
+static bool request_chunks(GetJob *job, int srv, const vector<int> &indices) {
+    ServerInfo *server = &(*job->servers)[srv];
+    size_t entry = job->ranged ? GET_RANGE_ENTRY : 4;
+
+    for (size_t start = 0; start < indices.size(); start += GET_BATCH) {
+        size_t count = min<size_t>(GET_BATCH, indices.size() - start);
+        string body(count * entry, '\0');
+        for (size_t k = 0; k < count; k++) {
+            unsigned char *p = (unsigned char *)&body[k * entry];
+            put_u32(p, indices[start + k]);
+            if (job->ranged) {
+                uint64_t offset, length;
+                block_slice(job, indices[start + k], offset, length);
+                put_u64(p + 4, offset);
+                put_u64(p + 12, length);
+            }
         }
-        ssize_t n = recv(server->server_fd, buf, buflen - 1, 0);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            perror("recv failed");
-            close(server->server_fd);
-            return nullptr;
+
+        Request req;
+        req.kind = REQ_GET;
+        req.get = job;
+        req.get_chunks.assign(indices.begin() + start, indices.begin() + start + count);
+        for (int idx : req.get_chunks) {
+            job->asked[idx].insert(srv);
+        }
+        if (queue_request(server, req, OP_GET, job->ranged ? GET_RANGES : 0, job->filename, body) < 0) {
+            LOG(LOG_WARN) << "[GET] Error fetching chunks from "
+                          << server->ip << ":" << server->port;
+            // Mark the rest as asked too so failover moves past this server
+            for (size_t k = start; k < indices.size(); k++) {
+                job->asked[indices[k]].insert(srv);
+                rebuild_block_failed(job, indices[k]);
+            }
+            return false;
+        }
+        job->outstanding++;
+        for (int idx : req.get_chunks) {
+            job->open[idx]++;
         }
-        buf[n] = '\0';
-        close(server->server_fd);
-        return buf;
     }
+    return true;
 }
 
-int hash_file_to_index(const char *filename, int server_count) {
-    unsigned char digest[MD5_DIGEST_LENGTH];
-    MD5((unsigned char*)filename, strlen(filename), digest);
-    uint32_t h = *((uint32_t*)digest);
-    return h % server_count;
+// Put chunk_index's stripe into rebuild and plan requests for enough
+// of its other blocks to reach k; false if too few are left to try
+static bool plan_rebuild(GetJob *job, int chunk_index, map<int, vector<int>> &plan) {
+    const BlockInfo &layout = job->layout;
+    int width = stripe_width(layout);
+    int first_block = chunk_index / width * width;
+    ErasureStripe &stripe = job->stripes[chunk_index / width];
+
+    // Blocks in hand or on their way
+    int expected = stripe.shards.size();
+    for (int position : stripe.asked) {
+        if (!stripe.shards.count(position) && !stripe.failed.count(position)) expected++;
+    }
+    for (int position = 0; position < width && expected < layout.ec_data; position++) {
+        int idx = first_block + position;
+        if (idx == chunk_index || stripe.asked.count(position)) continue;
+        int srv = block_server(layout, job->file_key, idx, 0, job->servers->size());
+        vector<int> &planned = plan[srv];
+        if (find(planned.begin(), planned.end(), idx) == planned.end()) planned.push_back(idx);
+        stripe.asked.insert(position);
+        expected++;
+    }
+    return expected >= layout.ec_data;
 }
 
-/* ----------------------------------------------------------
-   LIST
----------------------------------------------------------- */
-void list(vector<ServerInfo> &servers) {
+// Ask for missing chunks from the next candidate server that hasn't
+// been tried yet, looking at the first max_rank servers of each
+// chunk's placement (rank 0 primary, rank 1 replica, then the rest).
+// An erasure-coded chunk has only its primary; once that failed (or,
+// when hedging, is slow) its stripe is rebuilt instead.
+// only_stalled restricts this to chunks no open request covers.
+// Returns the number of chunks a request went out for, or -1 if
+// some stalled chunk has no candidates left.
+static int ask_next_candidates(GetJob *job, int max_rank, bool only_stalled) {
+    int server_count = job->servers->size();
+    bool erasure = stripe_width(job->layout) > 0;
+    int issued = 0;
 
-    map <string, int> file_map;
-    for (auto &server : servers) {
-        int sockfd = sender(&server, "list", "");
-        if (sockfd < 0) continue;
-        char response[1024];
-        char* result = get_response(&server, response, sizeof(response));
-
-        // parse response and update file_map
-        char *line = strtok(result, "\n");
-        while (line != nullptr) {
-            // remove chunk .[int] suffix
-            string entry_name(line);
-            size_t pos = entry_name.rfind('.');
-            if (pos != string::npos) {
-                string suffix = entry_name.substr(pos + 1);
-                if (all_of(suffix.begin(), suffix.end(), ::isdigit)) {
-                    entry_name = entry_name.substr(0, pos);
-                }
+    while (1) {
+        map<int, vector<int>> plan;     // server -> chunks to ask it for
+        bool exhausted = false;
+        for (int i = 0; i < job->chunk_count; i++) {
+            if (have_chunk(job, i)) continue;
+            if (only_stalled && job->open[i] > 0) continue;
+
+            bool planned = false;
+            for (int rank = 0; rank < max_rank; rank++) {
+                int srv = block_server(job->layout, job->file_key, i, rank, server_count);
+                if (srv < 0) break;
+                if (job->asked[i].count(srv)) continue;
+                plan[srv].push_back(i);
+                planned = true;
+                break;
             }
-            file_map[entry_name]++;
-            line = strtok(nullptr, "\n");
+            if (planned) continue;
+
+            bool stalled = (job->open[i] == 0);
+            if (erasure && (stalled || max_rank > 1) && plan_rebuild(job, i, plan)) continue;
+            if (stalled) exhausted = true;
         }
-        for (auto &entry : file_map) {
-            if (entry.second == servers.size()) {
-                cout << entry.first << endl;
-            } else { 
-                cout << entry.first << " (incomplete) "  << endl;
+        if (plan.empty()) return exhausted ? -1 : issued;
+
+        bool all_sent = true;
+        for (auto &p : plan) {
+            if (request_chunks(job, p.first, p.second)) {
+                issued += p.second.size();
+            } else {
+                all_sent = false;
             }
         }
-        // if (result != nullptr) {
-        //     cout << "[LIST] Response from " << server.ip << ":" << server.port
-        //          << " : " << response << endl;
-        // }
-        // get_response closes the socket
+        // Unreachable servers are marked as asked; move straight on
+        if (all_sent) return issued;
     }
 }
 
-/* ----------------------------------------------------------
-   GET - Helper to receive exactly n bytes
----------------------------------------------------------- */
-static int recv_all(int fd, char *buf, size_t len, int timeout_sec = 10) {
-    time_t start = time(NULL);
-    size_t total = 0;
-    while (total < len) {
-        if (time(NULL) - start > timeout_sec) {
-            cerr << "[RECV] Timeout" << endl;
-            return -1;
-        }
-        ssize_t n = recv(fd, buf + total, len - total, 0);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            perror("recv failed");
-            return -1;
-        }
-        if (n == 0) {
-            // Connection closed
-            return total;
+// Count the blocks a job won't ask for as done: those outside
+// [first, last], parity (fetched only to rebuild a stripe) and
+// probed indices past the end of the file
+static void skip_unneeded_blocks(GetJob *job, uint32_t first, uint32_t last) {
+    for (int i = 0; i < job->chunk_count; i++) {
+        bool needed = (uint32_t)i >= first && (uint32_t)i <= last && (uint32_t)i < job->layout.nblocks &&
+                      !is_parity(job->layout, i);
+        if (!needed && !job->have[i]) {
+            job->have[i] = true;
+            job->received++;
         }
-        total += n;
     }
-    return total;
 }
 
-/* ----------------------------------------------------------
-   GET - Read a line (up to newline) from socket
----------------------------------------------------------- */
-static int recv_line(int fd, char *buf, size_t maxlen, int timeout_sec = 10) {
-    time_t start = time(NULL);
-    size_t pos = 0;
-    while (pos < maxlen - 1) {
-        if (time(NULL) - start > timeout_sec) {
-            return -1;
-        }
-        char c;
-        ssize_t n = recv(fd, &c, 1, 0);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        if (n == 0) {
-            break; // Connection closed
+// The first block header of a ranged job gives the file's layout:
+// only blocks overlapping the range are still needed
+static void get_range_layout(GetJob *job, const BlockInfo &info) {
+    if (info.flags & BLOCK_LEGACY) {
+        LOG(LOG_WARN) << "[GET] " << job->filename << " was stored before block striping; "
+                      << "byte ranges need it uploaded again";
+        finish_get(job);
+        cancel_covered_requests(job);
+        return;
+    }
+
+    if (job->range_offset >= info.file_size && job->range_length > 0) {
+        LOG(LOG_WARN) << "[GET] " << job->filename << " is " << info.file_size << " bytes; bytes "
+                      << job->range_offset << "-" << job->range_offset + job->range_length << " lie past its end";
+        exit_status = EXIT_FAILURE;
+        job->finished = true;
+        if (job->out_fd >= 0) {
+            // Started on an older upload that was longer
+            close(job->out_fd);
+            unlink(part_path(job).c_str());
+            job->out_fd = -1;
         }
-        buf[pos++] = c;
-        if (c == '\n') break;
+        cancel_covered_requests(job);
+        return;
     }
-    buf[pos] = '\0';
-    return pos;
+
+    job->have_layout = true;
+    job->layout = info;
+    uint64_t start = min(job->range_offset, info.file_size);
+    uint64_t end = min(start + job->range_length, info.file_size);
+    job->range_offset = start;
+    job->range_length = end - start;
+    if (job->out_buf) {
+        job->out_buf->assign(job->range_length, 0);
+    }
+
+    // Never shrinks: requests still in flight may cover higher indices
+    job->chunk_count = max(job->chunk_count, (int)info.nblocks);
+    job->have.resize(job->chunk_count, false);
+    job->asked.resize(job->chunk_count);
+    job->open.resize(job->chunk_count, 0);
+    uint32_t first = (start < end) ? block_at(info, start) : info.nblocks;
+    uint32_t last = (start < end) ? block_at(info, end - 1) : 0;
+    skip_unneeded_blocks(job, first, last);
+    LOG(LOG_INFO) << "[GET] Bytes " << start << "-" << end << " of " << job->filename << " span "
+                  << (start < end ? last - first + 1 : 0) << " block(s)";
+
+    if (job->received >= job->chunk_count) {
+        finish_get(job);
+        cancel_covered_requests(job);
+        return;
+    }
+    ask_next_candidates(job, 1, false);
 }
 
-/* ----------------------------------------------------------
-   GET - Fetch chunks from a single server
----------------------------------------------------------- */
-int fetch_chunks_from_server(ServerInfo *server, const char *filename,
-                               map<int, ChunkedFile*> &chunks) {
-    int sockfd = sender(server, "get", filename);
-    if (sockfd < 0) {
-        return -1;
+// The first block header tells how the file is laid out; grow the
+// job and ask the primaries for the blocks beyond the first stripe
+static void get_block_info(GetJob *job, const BlockInfo &info) {
+    if (job->ranged) {
+        if (!job->have_layout) get_range_layout(job, info);
+        return;
     }
+    if (info.flags & BLOCK_LEGACY || job->have_layout) return;
+
+    job->have_layout = true;
+    job->layout = info;
+    if ((int)info.nblocks > job->chunk_count) {
+        LOG(LOG_INFO) << "[GET] " << job->filename << " has " << info.nblocks << " blocks";
+        job->chunk_count = info.nblocks;
+        job->have.resize(job->chunk_count, false);
+        job->asked.resize(job->chunk_count);
+        job->open.resize(job->chunk_count, 0);
+    }
+    if (info.flags & BLOCK_ERASURE) {
+        LOG(LOG_INFO) << "[GET] " << job->filename << " is erasure-coded " << (int)info.ec_data << "+"
+                      << (int)info.ec_parity;
+    }
+    skip_unneeded_blocks(job, 0, info.nblocks - 1);
+    ask_next_candidates(job, 1, false);
+}
 
-    char line[256];
-    while (1) {
-        int line_len = recv_line(sockfd, line, sizeof(line));
-        if (line_len <= 0) {
-            break;
+// Forget everything gathered so far: it belongs to an older upload
+static void restart_get(GetJob *job) {
+    LOG(LOG_INFO) << "[GET] Found a newer version of " << job->filename << "; starting over on it";
+    for (int i = 0; i < job->chunk_count; i++) {
+        job->have[i] = false;
+        job->asked[i].clear();
+    }
+    job->received = 0;
+    for (auto &pair : job->legacy) {
+        delete pair.second;
+    }
+    job->legacy.clear();
+    for (auto &stripe : job->stripes) {
+        for (auto &shard : stripe.second.shards) {
+            delete shard.second;
         }
+    }
+    job->stripes.clear();
+    job->have_layout = false;
+    job->layout = BlockInfo();
+    job->range_offset = job->requested_offset;
+    job->range_length = job->requested_length;
+    if (job->out_buf) {
+        job->out_buf->clear();
+    }
+    if (job->out_fd >= 0 && ftruncate(job->out_fd, 0) < 0) {
+        perror("ftruncate failed");
+    }
+}
 
-        // Check for end marker
-        if (strncmp(line, "END", 3) == 0) {
-            cout << "[GET] End of response from " << server->ip << ":" << server->port << endl;
-            break;
-        }
+// Whether a block with this header belongs to the generation being
+// assembled; one from a newer upload restarts the job on it
+static bool same_generation(GetJob *job, const BlockInfo &info) {
+    if ((info.flags & BLOCK_LEGACY) || !job->have_layout || info.generation == job->layout.generation) {
+        return true;
+    }
+    if (info.generation < job->layout.generation) {
+        return false;
+    }
+    restart_get(job);
+    return true;
+}
 
-        // Check for file not found
-        if (strncmp(line, "FILE_NOT_FOUND", 14) == 0) {
-            cout << "[GET] No chunks on " << server->ip << ":" << server->port << endl;
-            break;
-        }
+// Block data is flowing: push the hedging deadline back
+static void get_progress(GetJob *job) {
+    if (client_config.hedge_enabled && !job->finished) {
+        job->hedge_at_ms = now_ms() + hedge_deadline_ms();
+    }
+}
 
-        // Parse chunk header: CHUNK <index> <size>\n
-        int chunk_index;
-        long chunk_size;
-        if (sscanf(line, "CHUNK %d %ld", &chunk_index, &chunk_size) != 2) {
-            cerr << "[GET] Invalid chunk header: " << line << endl;
-            break;
+// Decode the missing data blocks of a stripe in rebuild once k of
+// its blocks are in; the stripe is dropped when nothing is missing
+static int rebuild_stripe(GetJob *job, int s) {
+    const BlockInfo &layout = job->layout;
+    int k = layout.ec_data;
+    int width = stripe_width(layout);
+    ErasureStripe &stripe = job->stripes[s];
+
+    vector<int> missing;
+    for (int position = 0; position < k; position++) {
+        if (!job->have[s * width + position]) missing.push_back(position);
+    }
+    if (!missing.empty() && (int)stripe.shards.size() < k) return 0;
+
+    int ret = 0;
+    if (!missing.empty()) {
+        vector<int> rows;
+        vector<const uint8_t*> shards;
+        vector<size_t> shard_len;
+        for (auto &shard : stripe.shards) {
+            if ((int)rows.size() == k) break;
+            rows.push_back(shard.first);
+            shards.push_back((const uint8_t *)shard.second->data);
+            shard_len.push_back(shard.second->size);
         }
 
-        // Only store if we don't already have this chunk
-        if (chunks.find(chunk_index) != chunks.end()) {
-            // Skip this chunk's data - we already have it
-            char *discard = (char*)malloc(chunk_size);
-            if (discard) {
-                recv_all(sockfd, discard, chunk_size);
-                free(discard);
-            }
-            cout << "[GET] Skipping duplicate chunk " << chunk_index << endl;
-            continue;
+        // Every block of the stripe fits in its first one's length
+        uint64_t offset, len;
+        block_extent(layout, s * width, offset, len);
+        vector<vector<uint8_t>> out(missing.size(), vector<uint8_t>(len));
+        vector<uint8_t*> out_ptrs;
+        for (auto &block : out) out_ptrs.push_back(block.data());
+
+        gf_init();
+        if (!ec_decode(k, rows.data(), shards.data(), shard_len.data(), missing, out_ptrs.data(), len)) {
+            LOG(LOG_WARN) << "[GET] Cannot decode stripe " << s << " of " << job->filename;
+            ret = -1;
         }
-
-        // Allocate and receive chunk data
-        char *data = (char*)malloc(chunk_size);
-        if (!data) {
-            perror("malloc failed");
-            break;
+        for (size_t t = 0; t < missing.size() && ret == 0; t++) {
+            int idx = s * width + missing[t];
+            block_extent(layout, idx, offset, len);
+            if (write_block(job, (const char *)out[t].data(), len, offset) < 0) {
+                ret = -1;
+                break;
+            }
+            job->have[idx] = true;
+            job->received++;
         }
+        if (ret == 0) {
+            LOG(LOG_INFO) << "[GET] Rebuilt " << missing.size() << " block(s) of stripe " << s << " of "
+                          << job->filename << " from parity";
+        }
+    }
+
+    for (auto &shard : stripe.shards) {
+        delete shard.second;
+    }
+    job->stripes.erase(s);
+    return ret;
+}
+
+// A block of an erasure-coded file: data goes out as usual, and
+// whole blocks of a stripe in rebuild are kept for decoding
+static int erasure_chunk_arrived(GetJob *job, int chunk_index, ChunkedFile *chunk, const BlockInfo &info) {
+    int width = stripe_width(job->layout);
+    int s = chunk_index / width;
 
-        int received = recv_all(sockfd, data, chunk_size);
-        if (received != chunk_size) {
-            cerr << "[GET] Failed to receive chunk " << chunk_index
-                 << " (got " << received << "/" << chunk_size << " bytes)" << endl;
-            free(data);
-            break;
+    if (!job->have[chunk_index]) {
+        if (write_block(job, chunk->data, chunk->size, info.offset) < 0) {
+            delete chunk;
+            return -1;
         }
+        cache_block(job, chunk_index, chunk, info);
+        job->have[chunk_index] = true;
+        job->received++;
+    }
 
-        ChunkedFile *chunk = new ChunkedFile();
-        chunk->data = data;
-        chunk->size = chunk_size;
-        chunks[chunk_index] = chunk;
+    auto stripe = job->stripes.find(s);
+    uint64_t offset, length;
+    block_extent(job->layout, chunk_index, offset, length);
+    if (stripe == job->stripes.end() || stripe->second.shards.count(chunk_index % width) ||
+        info.offset != offset || info.length != length) {
+        delete chunk;
+        return 0;
+    }
+    stripe->second.shards[chunk_index % width] = chunk;
+    return rebuild_stripe(job, s);
+}
 
+static void get_chunk_arrived(GetJob *job, int chunk_index, ChunkedFile *chunk, const BlockInfo &info) {
+    // Started streaming before the job moved on to a newer upload
+    if (!(info.flags & BLOCK_LEGACY) && job->have_layout && info.generation != job->layout.generation) {
+        delete chunk;
+        return;
+    }
+    if (!job->finished && stripe_width(job->layout) > 0) {
+        if (erasure_chunk_arrived(job, chunk_index, chunk, info) < 0) {
+            finish_get(job);
+            cancel_covered_requests(job);
+            return;
+        }
+        get_progress(job);
+        if (job->received >= job->chunk_count) {
+            LOG(LOG_INFO) << "[GET] Got all " << job->chunk_count << " chunks";
+            finish_get(job);
+        }
+        cancel_covered_requests(job);
+        return;
     }
 
-    close(sockfd);
-    return 0;
+    // Another copy may have won the race while this one streamed in
+    if (job->finished || have_chunk(job, chunk_index)) {
+        delete chunk;
+        return;
+    }
+
+    if (info.flags & BLOCK_LEGACY) {
+        job->legacy[chunk_index] = chunk;
+    } else {
+        if (write_block(job, chunk->data, chunk->size, info.offset) < 0) {
+            delete chunk;
+            finish_get(job);
+            cancel_covered_requests(job);
+            return;
+        }
+        cache_block(job, chunk_index, chunk, info);
+        delete chunk;
+    }
+    job->have[chunk_index] = true;
+    job->received++;
+    get_progress(job);
+
+    // Done as soon as every chunk index is covered
+    if (job->received >= job->chunk_count) {
+        LOG(LOG_INFO) << "[GET] Got all " << job->chunk_count << " chunks";
+        finish_get(job);
+    }
+    cancel_covered_requests(job);
 }
 
-void get(vector<ServerInfo> &servers, vector<string> &filenames) {
-    int server_count = servers.size();
+// Fail over chunks that no longer have a request working on them:
+// first to the other replica, then to any server at all
+static void fail_over(GetJob *job) {
+    if (ask_next_candidates(job, job->servers->size(), true) < 0) {
+        finish_get(job);
+        cancel_covered_requests(job);
+    }
+}
 
-    printf("[GET] Starting file retrieval for %zu files\n", filenames.size());
-    for (const auto &filename : filenames) {
-        cout << "[GET] Downloading " << filename << endl;
+static void get_request_done(GetJob *job, const Request &req) {
+    for (int idx : req.get_chunks) {
+        rebuild_block_failed(job, idx);
+    }
+    if (req.cancelled) return;
+    fail_over(job);
+}
 
-        map<int, ChunkedFile*> chunks;
+// Fire hedged requests for jobs whose deadline has passed
+static void check_hedges(std::list<GetJob> &jobs) {
+    double now = now_ms();
+    for (auto &job : jobs) {
+        if (job.finished || job.hedge_at_ms == 0 || now < job.hedge_at_ms) continue;
+        job.hedge_at_ms = 0;
+        int hedged = ask_next_candidates(&job, 2, false);
+        if (hedged > 0) {
+            LOG(LOG_INFO) << "[GET] Hedging " << hedged << " chunk(s) of " << job.filename;
+        }
+    }
+}
 
-        // Query each server sequentially to collect chunks
-        for (int j = 0; j < server_count; j++) {
-            if (fetch_chunks_from_server(&servers[j], filename.c_str(), chunks) < 0) {
-                cerr << "[GET] Error fetching chunks from "
-                     << servers[j].ip << ":" << servers[j].port << " attempting second server" << endl;
-                // fetch_chunks_from_server(&servers[(j + 1) % server_count], filename.c_str(), chunks);
-            }
+// Queue a job for filename and send its first requests; blocks
+// is how many to ask for before a header says how many there are
+static GetJob *start_get(vector<ServerInfo> &servers, std::list<GetJob> &jobs,
+                         const string &filename, int blocks) {
+    jobs.push_back(GetJob());
+    GetJob *job = &jobs.back();
+    job->filename = filename;
+    job->output = filename;
+    job->chunk_count = blocks;
+    job->file_key = hash_file_key(filename.c_str());
+    job->have.resize(blocks, false);
+    job->asked.resize(blocks);
+    job->open.resize(blocks, 0);
+    job->servers = &servers;
+    return job;
+}
 
+static void run_get_jobs(vector<ServerInfo> &servers, std::list<GetJob> &jobs) {
+    for (auto &job : jobs) {
+        ask_next_candidates(&job, 1, false);
+        if (client_config.hedge_enabled) {
+            job.hedge_at_ms = now_ms() + hedge_deadline_ms();
+        }
+        fail_over(&job);
+    }
 
-            // Check if we have all chunks
-            if ((int)chunks.size() == server_count) {
-                cout << "[GET] Got all " << server_count << " chunks" << endl;
-                break;
+    while (1) {
+        double wait_ms = 1000;
+        bool pending = false;
+        for (auto &job : jobs) {
+            if (job.finished) continue;
+            pending = true;
+            if (job.hedge_at_ms > 0) {
+                wait_ms = min(wait_ms, max(0.0, job.hedge_at_ms - now_ms()));
             }
         }
 
-        // Check if we have all chunks
-        bool have_all = true;
-        for (int i = 0; i < server_count; i++) {
-            if (chunks.find(i) == chunks.end()) {
-                cerr << "[GET] Missing chunk " << i << " for " << filename << endl;
-                // attempt second server
-                have_all = false;
+        if (!pending) break;
+        engine_poll(servers, (int)ceil(wait_ms));
+        check_hedges(jobs);
+    }
 
-            }
+    // Losing hedges may still be in flight; rather than draining
+    // them, drop those sessions while the jobs they point at exist
+    for (auto &server : servers) {
+        if (!server.inflight.empty()) {
+            close_session(&server);
         }
+    }
+}
 
-        if (!have_all) {
-            cout << filename << " incomplete" << endl;
-            for (auto &pair : chunks) {
-                delete pair.second;
-            }
+// Take the blocks of the newest version the servers reported
+// that the cache holds; the job then only asks for the rest
+static void use_cached_blocks(GetJob *job, const map<int, BlockInfo> &headers) {
+    const BlockInfo *newest = nullptr;
+    for (auto &h : headers) {
+        if (!newest || h.second.generation > newest->generation) newest = &h.second;
+    }
+    if (!newest) return;
+
+    job->have_layout = true;
+    job->layout = *newest;
+    job->chunk_count = max(job->chunk_count, (int)newest->nblocks);
+    job->have.resize(job->chunk_count, false);
+    job->asked.resize(job->chunk_count);
+    job->open.resize(job->chunk_count, 0);
+    skip_unneeded_blocks(job, 0, newest->nblocks - 1);
+
+    int hits = 0;
+    vector<char> data;
+    for (auto &h : headers) {
+        int i = h.first;
+        if (i >= job->chunk_count || job->have[i] || h.second.generation != newest->generation ||
+            !cache_lookup(job->filename, i, h.second, data)) {
             continue;
         }
+        if (write_block(job, data.data(), data.size(), h.second.offset) < 0) {
+            finish_get(job);
+            return;
+        }
+        job->have[i] = true;
+        job->received++;
+        hits++;
+    }
+    if (hits > 0) {
+        LOG(LOG_INFO) << "[GET] " << hits << " of " << newest->nblocks << " blocks of " << job->filename
+                      << " unchanged; using the cached copies";
+    }
+    if (job->received >= job->chunk_count) {
+        finish_get(job);
+    }
+}
 
-        // Reassemble file
-        ofstream outfile(filename, ios::binary);
-        if (!outfile) {
-            perror("fopen failed");
-            for (auto &pair : chunks) {
-                delete pair.second;
+// Ask every server, in parallel, for the headers of each job's
+// blocks and start the jobs off with what the cache has
+static void revalidate_cache(vector<ServerInfo> &servers, std::list<GetJob> &jobs) {
+    size_t server_count = servers.size();
+    vector<map<int, BlockInfo>> headers(jobs.size());
+    vector<StatCursor> cursors(jobs.size() * server_count);
+    for (size_t c = 0; c < cursors.size(); c++) {
+        cursors[c].blocks = &headers[c / server_count];
+        cursors[c].more = true;
+    }
+
+    bool asked = true;
+    while (asked) {
+        asked = false;
+        size_t j = 0;
+        for (auto &job : jobs) {
+            for (size_t srv = 0; srv < server_count; srv++) {
+                StatCursor &cursor = cursors[j * server_count + srv];
+                if (!cursor.more) continue;
+                cursor.more = false;
+                Request req;
+                req.kind = REQ_STAT;
+                req.stat = &cursor;
+                if (queue_request(&servers[srv], req, OP_STAT, cursor.next, job.filename) >= 0) {
+                    asked = true;
+                }
             }
-            continue;
+            j++;
         }
+        if (asked) engine_drain(servers);
+    }
 
-        for (int i = 0; i < server_count; i++) {
-            outfile.write(chunks[i]->data, chunks[i]->size);
-            delete chunks[i];
-        }
-        outfile.close();
-        cout << "[GET] Successfully reassembled file " << filename << endl;
+    size_t j = 0;
+    for (auto &job : jobs) {
+        use_cached_blocks(&job, headers[j++]);
     }
 }
 
+void get(vector<ServerInfo> &servers, vector<string> &filenames) {
+    LOG(LOG_INFO) << "[GET] Starting file retrieval for " << filenames.size() << " files";
+    std::list<GetJob> jobs;
+    for (const auto &filename : filenames) {
+        LOG(LOG_INFO) << "[GET] Downloading " << filename;
+        start_get(servers, jobs, filename, servers.size());
+    }
+    if (cache_enabled()) {
+        revalidate_cache(servers, jobs);
+    }
+    run_get_jobs(servers, jobs);
+}
+
+/* ----------------------------------------------------------
+   BYTE RANGES
+   fetch_range() fetches length bytes of filename starting at
+   offset (clipped to the file), into a file for getrange or,
+   through read_range(), into a buffer; a range that starts at
+   or past the end of the file fails. Block 0 is asked for the
+   part of the range it holds; its header gives the layout, and
+   then only the blocks overlapping the range are asked for,
+   each for just the bytes it contributes. Returns 0 on success.
+   dfc is not built as a library: read_range() runs the GET
+   engine of this program and is only for code compiled in.
+---------------------------------------------------------- */
+static int fetch_range(vector<ServerInfo> &servers, const string &filename, uint64_t offset,
+                       uint64_t length, vector<char> *out_buf, const string &output) {
+    std::list<GetJob> jobs;
+    GetJob *job = start_get(servers, jobs, filename, 1);
+    job->ranged = true;
+    job->range_offset = job->requested_offset = offset;
+    job->range_length = job->requested_length = length;
+    job->out_buf = out_buf;
+    job->output = output;
+    run_get_jobs(servers, jobs);
+    return job->ok ? 0 : -1;
+}
+
+int read_range(vector<ServerInfo> &servers, const string &filename, uint64_t offset,
+               uint64_t length, vector<char> &out) {
+    return fetch_range(servers, filename, offset, length, &out, "");
+}
+
+// A decimal byte count; false unless value is all of s
+static bool parse_bytes(const string &s, uint64_t &value) {
+    if (s.empty() || !isdigit((unsigned char)s[0])) return false;
+    char *end;
+    errno = 0;
+    value = strtoull(s.c_str(), &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+// getrange <file> <offset> <length>: saves the bytes as
+// <file>.<start>-<end>, the range clipped to the file
+void get_range(vector<ServerInfo> &servers, vector<string> &args) {
+    uint64_t offset, length;
+    if (args.size() != 3 || !parse_bytes(args[1], offset) || !parse_bytes(args[2], length)) {
+        cerr << "usage: getrange <file> <offset> <length>" << endl;
+        exit_status = EXIT_FAILURE;
+        return;
+    }
+    length = min(length, UINT64_MAX - offset);
+    fetch_range(servers, args[0], offset, length, nullptr, range_name(args[0], offset, length));
+}
+
 /* ----------------------------------------------------------
    PUT HELPERS
 ---------------------------------------------------------- */
-int put_sender(ServerInfo *server, const char *data, size_t data_len,
-               const char *filename, int chunk_index) {
+// Queues one chunk on the session without waiting for the ack;
+// the payload is sent straight out of job->chunks. by_ref sends
+// only the block's BlockInfo and hash, for a server that already
+// stores the data.
+int put_sender(ServerInfo *server, PutJob *job, int chunk_index, bool by_ref) {
     // remove slashes from filename
+    const char *filename = job->filename.c_str();
     if (strchr(filename, '/')) {
         filename = strrchr(filename, '/') + 1;
     }
 
-
-    // Open a fresh connection
-    int sockfd = connect_to_server(server);
-    if (sockfd < 0) {
+    const vector<char> &data = job->chunks[chunk_index];
+
+    Request req;
+    req.kind = REQ_PUT;
+    req.put = job;
+    req.chunk_index = chunk_index;
+    req.by_ref = by_ref;
+    int req_id;
+    if (by_ref) {
+        string body(data.data(), BLOCK_INFO_SIZE);
+        body += job->hashes[chunk_index];
+        req_id = queue_request(server, req, OP_PUT_REF, chunk_index, filename, body);
+    } else {
+        req_id = queue_request(server, req, OP_PUT, chunk_index, filename, "", data.data(), data.size());
+    }
+    if (req_id < 0) {
         return -1;
     }
 
-    // Send header with total data length
-    char header[256];
-    int header_len = snprintf(header, sizeof(header),
-                              "put %s %d %zu\n", filename, chunk_index, data_len);
+    job->outstanding++;
+    job->refs[chunk_index]++;
+    job->inflight_bytes += data.size();
+    if (by_ref) {
+        LOG(LOG_DEBUG) << "[PUT] Queued reference: put " << req_id << " " << filename << " " << chunk_index
+                       << " (" << data.size() - BLOCK_INFO_SIZE << " bytes already stored)";
+    } else {
+        LOG(LOG_DEBUG) << "[PUT] Queued " << data.size() << " bytes: put " << req_id << " " << filename
+                       << " " << chunk_index;
+    }
+    return req_id;
+}
+
+// Poll until at most PUT_WINDOW_BYTES of block data is in flight,
+// releasing finished jobs other than the one still being read
+static void put_window(vector<ServerInfo> &servers, std::list<PutJob> &jobs, PutJob *current) {
+    while (1) {
+        size_t inflight = 0;
+        for (auto it = jobs.begin(); it != jobs.end();) {
+            if (it->outstanding == 0 && &*it != current) {
+                it = jobs.erase(it);
+            } else {
+                inflight += it->inflight_bytes;
+                ++it;
+            }
+        }
+        if (inflight <= PUT_WINDOW_BYTES || engine_poll(servers, 1000) == 0) break;
+    }
+}
 
-    // Send header first
-    if (send_all(sockfd, header, header_len) < 0) {
-        perror("send header failed");
-        close(sockfd);
-        return -1;
+static bool dedup_possible(const vector<ServerInfo> &servers) {
+    if (!client_config.dedup) return false;
+    for (const auto &server : servers) {
+        if (!server.down && !server.no_dedup) return true;
+    }
+    return false;
+}
+
+static string block_hash(const vector<char> &block) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_Digest(block.data() + BLOCK_INFO_SIZE, block.size() - BLOCK_INFO_SIZE, digest, &len,
+               EVP_sha256(), NULL);
+    return string((const char *)digest, len);
+}
+
+// Ask every server which of its blocks in group it already stores
+// (one HAVE per server) and wait for the answers in job->stored.
+// A server that isn't content-addressed says so and is skipped
+// from then on.
+static void have_check(vector<ServerInfo> &servers, PutJob *job, const vector<int> &group,
+                       const BlockInfo &layout, uint32_t key) {
+    int server_count = servers.size();
+    vector<vector<int>> blocks(server_count);
+    for (int j : group) {
+        for (int srv : block_homes(layout, key, j, server_count)) {
+            blocks[srv].push_back(j);
+        }
+    }
+
+    for (int s = 0; s < server_count; s++) {
+        ServerInfo *server = &servers[s];
+        if (blocks[s].empty() || server->down || server->no_dedup) continue;
+
+        string body;
+        for (int j : blocks[s]) {
+            body += job->hashes[j];
+        }
+        Request req;
+        req.kind = REQ_HAVE;
+        req.put = job;
+        req.get_chunks = blocks[s];
+        if (queue_request(server, req, OP_HAVE, 0, "", body) >= 0) {
+            job->have_pending++;
+        }
+    }
+
+    while (job->have_pending > 0 && engine_poll(servers, 1000) > 0) {
+    }
+}
+
+// Send block j to one replica: as a reference if that server
+// already has the data
+static void put_block(ServerInfo *server, PutJob *job, int j) {
+    auto stored = job->stored.find(j);
+    bool by_ref = stored != job->stored.end() && stored->second.count(server);
+    if (put_sender(server, job, j, by_ref) < 0) {
+        exit_status = EXIT_FAILURE;
+        LOG(LOG_WARN) << "[PUT] Failed to send chunk " << j << " of " << job->filename
+                      << " to server " << server->ip << ":" << server->port;
     }
+}
 
-    // Then send all the data
-    if (send_all(sockfd, data, data_len) < 0) {
-        perror("send data failed");
-        close(sockfd);
+// Read the data of block j of the file into job->chunks, leaving room
+// for its header; returns its size, -1 on a short read
+static long long read_block(ifstream &infile, PutJob *job, const BlockInfo &layout, int j) {
+    uint64_t offset, length;
+    block_extent(layout, j, offset, length);
+
+    vector<char> &block = job->chunks[j];
+    block.resize(BLOCK_INFO_SIZE + length);
+    if (!infile.read(block.data() + BLOCK_INFO_SIZE, length)) {
+        LOG(LOG_WARN) << "[PUT] Short read on " << job->filename;
+        exit_status = EXIT_FAILURE;
+        job->chunks.erase(j);
         return -1;
     }
+    return length;
+}
 
-    cout << "[PUT] Sent " << data_len << " bytes with header: " << header;
+// Compress block j if that pays, then checksum what will be stored
+// and put the header in front of it
+static void seal_block(PutJob *job, const BlockInfo &layout, int j) {
+    BlockInfo info = layout;
+    block_extent(layout, j, info.offset, info.length);
+    info.raw_length = info.length;
+
+    vector<char> &block = job->chunks[j];
+    const uint8_t *data = (const uint8_t *)block.data() + BLOCK_INFO_SIZE;
+    vector<char> packed;
+    if (client_config.codec != BLOCK_CODEC_NONE && codec_worth_trying(data, info.length) &&
+        codec_compress(client_config.codec, data, info.length, packed, BLOCK_INFO_SIZE)) {
+        info.codec = client_config.codec;
+        info.length = packed.size() - BLOCK_INFO_SIZE;
+        block.swap(packed);
+    }
+    info.crc = crc32c(0, block.data() + BLOCK_INFO_SIZE, info.length);
+    encode_block_info(info, block.data());
+}
 
-    close(sockfd);
-    return 0;
+// Read the k data blocks of stripe s and compute its m parity
+// blocks, adding all of them to group; returns the data size
+static long long read_stripe(ifstream &infile, PutJob *job, const BlockInfo &layout, int s,
+                             vector<int> &group) {
+    int k = layout.ec_data;
+    int width = stripe_width(layout);
+    vector<const uint8_t*> data;
+    vector<size_t> data_len;
+    vector<uint8_t*> parity;
+    long long total = 0;
+
+    for (int position = 0; position < width; position++) {
+        int j = s * width + position;
+        if (position < k) {
+            long long n = read_block(infile, job, layout, j);
+            if (n < 0) {
+                for (int p = 0; p < position; p++) job->chunks.erase(s * width + p);
+                return -1;
+            }
+            data.push_back((const uint8_t *)job->chunks[j].data() + BLOCK_INFO_SIZE);
+            data_len.push_back(n);
+            total += n;
+        } else {
+            uint64_t offset, length;
+            block_extent(layout, j, offset, length);
+            vector<char> &block = job->chunks[j];
+            block.resize(BLOCK_INFO_SIZE + length);
+            parity.push_back((uint8_t *)block.data() + BLOCK_INFO_SIZE);
+        }
+    }
+
+    gf_init();
+    ec_encode(k, layout.ec_parity, data.data(), data_len.data(), parity.data(),
+              job->chunks[s * width + k].size() - BLOCK_INFO_SIZE);
+    // Headers go on once parity no longer needs the raw data
+    for (int position = 0; position < width; position++) {
+        int j = s * width + position;
+        seal_block(job, layout, j);
+        group.push_back(j);
+    }
+    return total;
 }
 
 /* ----------------------------------------------------------
    PUT
+   Blocks are read one at a time and queued to both of their
+   servers; the engine writes them out concurrently while the next
+   ones are read. At most PUT_WINDOW_BYTES of block data is held
+   in memory, and a block is freed once both replicas answered.
+   An erasure-coded file goes a stripe at a time instead: its data
+   blocks are read, parity is computed, and each of the k+m blocks
+   is sent once, to its own server.
+   With dedup, blocks are read in groups of up to
+   HAVE_GROUP_BYTES: the group's hashes go to the servers in one
+   have-check, and a block a server already stores is sent to it
+   as a reference instead of the data.
 ---------------------------------------------------------- */
 void put(vector<ServerInfo> &servers, vector<string> &filenames) {
     int server_count = servers.size();
+    std::list<PutJob> jobs;
+
+    if (client_config.ec_data > 0 && client_config.ec_data + client_config.ec_parity > server_count) {
+        LOG(LOG_WARN) << "[PUT] erasure " << client_config.ec_data << "+" << client_config.ec_parity << " needs "
+                      << client_config.ec_data + client_config.ec_parity << " servers; replicating instead";
+    }
 
     for (const auto &filename : filenames) {
         // Extract base filename for hashing (strip path)
@@ -425,7 +2453,7 @@ void put(vector<ServerInfo> &servers, vector<string> &filenames) {
             base_filename = filename.substr(slash_pos + 1);
         }
 
-        int h = hash_file_to_index(base_filename.c_str(), server_count);
+        uint32_t key = hash_file_key(base_filename.c_str());
 
         ifstream infile(filename, ios::binary | ios::ate);
         if (!infile) {
@@ -433,45 +2461,86 @@ void put(vector<ServerInfo> &servers, vector<string> &filenames) {
             continue;
         }
 
-        streamsize filesize = infile.tellg();
+        uint64_t filesize = infile.tellg();
         infile.seekg(0, ios::beg);
 
-        // Use map to store chunks
-        map<int, vector<char>> chunks;
-        size_t base_chunk_size = filesize / server_count;
-        int remaining = filesize % server_count;
-        
-        for (int i = 0; i < server_count; i++) {
-            size_t this_chunk_size = base_chunk_size + (i < remaining ? 1 : 0);
-            chunks[i].resize(this_chunk_size);
-            infile.read(chunks[i].data(), this_chunk_size);
-        }
-        infile.close();
-
-        for (int j = 0; j < server_count; j++) {
-            cout << "[PUT] Sending chunk " << j << " of " << filename 
-                 << " (size " << chunks[j].size() << " bytes)" << endl;
-                 
-            int srv = (h + j) % server_count;
-            if (put_sender(&servers[srv], chunks[j].data(), chunks[j].size(), 
-                          filename.c_str(), j) < 0) {
-                cerr << "[PUT] Failed to send chunk " << j << " of " << filename 
-                     << " to server " << servers[srv].ip << ":" << servers[srv].port << endl;
+        jobs.push_back(PutJob());
+        PutJob *job = &jobs.back();
+        job->filename = filename;
+
+        BlockInfo layout = block_layout(filesize, server_count);
+        int width = stripe_width(layout);
+        bool short_read = false;
+        for (uint32_t j = 0; j < layout.nblocks && !short_read;) {
+            bool dedup = dedup_possible(servers);
+            vector<int> group;
+            size_t group_bytes = 0;
+            while (j < layout.nblocks && (group.empty() || (dedup && group.size() < HAVE_BATCH &&
+                                                            group_bytes < HAVE_GROUP_BYTES))) {
+                long long n;
+                if (width > 0) {
+                    n = read_stripe(infile, job, layout, j / width, group);
+                    j += width;
+                } else {
+                    n = read_block(infile, job, layout, j);
+                    if (n >= 0) {
+                        seal_block(job, layout, j);
+                        group.push_back(j);
+                    }
+                    j++;
+                }
+                if (n < 0) {
+                    short_read = true;
+                    break;
+                }
+                group_bytes += n;
+            }
+            if (dedup) {
+                for (int j : group) {
+                    job->hashes[j] = block_hash(job->chunks[j]);
+                }
+                if (!group.empty()) have_check(servers, job, group, layout, key);
             }
 
-            int second = (srv + 1) % server_count;
-            if (put_sender(&servers[second], chunks[j].data(), chunks[j].size(), 
-                          filename.c_str(), j) < 0) {
-                cerr << "Failed to send chunk " << j << " of " << filename 
-                     << " to server " << servers[second].ip << ":" << servers[second].port << endl;
+            for (int j : group) {
+                LOG(LOG_DEBUG) << "[PUT] Sending " << (is_parity(layout, j) ? "parity " : "") << "chunk " << j
+                               << " of " << filename << " (size " << job->chunks[j].size() - BLOCK_INFO_SIZE
+                               << " bytes)";
+
+                for (int srv : block_homes(layout, key, j, server_count)) {
+                    put_block(&servers[srv], job, j);
+                }
+
+                job->stored.erase(j);
+                if (job->refs[j] == 0) {
+                    job->chunks.erase(j);
+                    job->refs.erase(j);
+                    job->hashes.erase(j);
+                }
+
+                // Keep the amount of buffered file data bounded
+                put_window(servers, jobs, job);
             }
         }
+        infile.close();
     }
+
+    engine_drain(servers);
 }
 
 /* ----------------------------------------------------------
    MAIN
 ---------------------------------------------------------- */
+// A byte count with an optional K, M or G suffix; 0 if invalid
+static uint64_t parse_size(const char *value) {
+    char *end;
+    uint64_t size = strtoull(value, &end, 10);
+    if (*end == 'K' || *end == 'k') size <<= 10;
+    if (*end == 'M' || *end == 'm') size <<= 20;
+    if (*end == 'G' || *end == 'g') size <<= 30;
+    return size;
+}
+
 int main(int argc, char *argv[]) {
     if (argc < 2) {
         cerr << "usage: " << argv[0] << " <command> [files...]" << endl;
@@ -496,37 +2565,116 @@ int main(int argc, char *argv[]) {
     vector<ServerInfo> servers;
     string line;
 
-    while (getline(config, line) && servers.size() < 4) {
-        // Parse line: "server dfsX ip:port" or "ip:port"
-        size_t pos = line.find("server");
-        if (pos != string::npos) {
-            // Extract IP:port after "server dfsX"
-            pos = line.find_last_of(" \t");
-            if (pos != string::npos) {
-                line = line.substr(pos + 1);
+    while (getline(config, line)) {
+        char key[64], value[64];
+        if (sscanf(line.c_str(), "%63s %63s", key, value) == 2) {
+            if (strcmp(key, "log") == 0) {
+                if (!log_set_level(value)) {
+                    LOG(LOG_WARN) << "Ignoring invalid log setting " << value;
+                }
+                continue;
+            }
+            if (strcmp(key, "hedge") == 0) {
+                client_config.hedge_enabled = strcmp(value, "off") != 0;
+                if (client_config.hedge_enabled) client_config.hedge_ms = atof(value);
+                continue;
+            }
+            if (strcmp(key, "hedge_percentile") == 0) {
+                client_config.hedge_percentile = atof(value);
+                continue;
+            }
+            if (strcmp(key, "dedup") == 0) {
+                client_config.dedup = strcmp(value, "off") != 0;
+                continue;
+            }
+            if (strcmp(key, "erasure") == 0) {
+                int k = 0, m = 0;
+                if (strcmp(value, "off") == 0) {
+                    client_config.ec_data = 0;
+                } else if (sscanf(value, "%d+%d", &k, &m) == 2 && k >= 1 && m >= 1 && k + m <= 255) {
+                    client_config.ec_data = k;
+                    client_config.ec_parity = m;
+                } else {
+                    LOG(LOG_WARN) << "Ignoring invalid erasure setting " << value;
+                }
+                continue;
+            }
+            if (strcmp(key, "compression") == 0) {
+                if (strcmp(value, "off") == 0) {
+                    client_config.codec = BLOCK_CODEC_NONE;
+                } else if (strcmp(value, "lz4") == 0) {
+                    client_config.codec = BLOCK_CODEC_LZ4;
+                } else if (strcmp(value, "zstd") == 0) {
+                    client_config.codec = BLOCK_CODEC_ZSTD;
+                    if (!codec_supported(BLOCK_CODEC_ZSTD)) {
+                        LOG(LOG_WARN) << "Built without zstd; using lz4";
+                        client_config.codec = BLOCK_CODEC_LZ4;
+                    }
+                } else {
+                    LOG(LOG_WARN) << "Ignoring invalid compression setting " << value;
+                }
+                continue;
+            }
+            if (strcmp(key, "placement") == 0) {
+                if (strcmp(value, "ring") == 0 || strcmp(value, "modulo") == 0) {
+                    client_config.ring = strcmp(value, "ring") == 0;
+                } else {
+                    LOG(LOG_WARN) << "Ignoring invalid placement setting " << value;
+                }
+                continue;
+            }
+            if (strcmp(key, "vnodes") == 0) {
+                int n = atoi(value);
+                if (n > 0) client_config.vnodes = n;
+                continue;
+            }
+            if (strcmp(key, "block_size") == 0) {
+                uint64_t size = parse_size(value);
+                if (size > 0 && size <= UINT32_MAX) client_config.block_size = size;
+                continue;
+            }
+            if (strcmp(key, "cache") == 0) {
+                char dir[256], size[64];
+                int n = sscanf(line.c_str(), "%*s %255s %63s", dir, size);
+                if (strcmp(dir, "off") == 0) {
+                    client_config.cache_dir.clear();
+                } else {
+                    client_config.cache_dir = dir;
+                    if (n == 2 && parse_size(size) > 0) client_config.cache_size = parse_size(size);
+                }
+                continue;
             }
         }
 
-        // Parse ip:port
-        pos = line.find(':');
-        if (pos != string::npos) {
-            ServerInfo server;
-            server.ip = line.substr(0, pos);
-            server.port = stoi(line.substr(pos + 1));
+        // Parse line: "server dfsX ip:port [weight]" or "ip:port"
+        ServerInfo server;
+        if (parse_server_line(line, server)) {
             servers.push_back(server);
         }
     }
     config.close();
 
+    if (client_config.ring) {
+        build_ring(servers, client_config.vnodes);
+    }
+
     /* ------------------------------------------------------
-       HANDLE COMMAND (connections are opened per-request)
+       HANDLE COMMAND (one session per server, opened lazily)
     ------------------------------------------------------ */
-    cout << "Executing command: " << command << endl;
+    // Progress goes to stderr, so stdout is just what was asked for
+    log_info_fd = STDERR_FILENO;
+    log_start();
+    atexit(log_stop);
+    LOG(LOG_INFO) << "Executing command: " << command;
     
     if (command == "list") {
-        list(servers);
+        ::list(servers, files.empty() ? "" : files[0]);
+    } else if (command == "stats") {
+        stats(servers);
     } else if (command == "get") {
         get(servers, files);
+    } else if (command == "getrange") {
+        get_range(servers, files);
     } else if (command == "put") {
         put(servers, files);
     } else {
@@ -534,5 +2682,8 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
-    return 0;
+    for (auto &server : servers) {
+        close_session(&server);
+    }
+    return exit_status;
 }
\ No newline at end of file
@@ -2,25 +2,70 @@
 #include <fstream>
 #include <string>
 #include <map>
+#include <unordered_map>
+#include <set>
+#include <deque>
+#include <list>
+#include <vector>
+#include <memory>
+#include <thread>
 #include <cstring>
 #include <cstdlib>
 #include <cstdio>
 #include <cerrno>
+#include <climits>
+#include <cstdint>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <netdb.h>
+#include <atomic>
+#include <openssl/evp.h>
+#include "protocol.h"
+#include "checksum.h"
+#include "placement.h"
+#include "stats.h"
+#include "log.h"
 
 using namespace std;
 
-#define BUFSIZE 1024
+#define RECV_BUFSIZE 65536
+#define VERIFY_BUFSIZE (256 * 1024)
+#define GET_VERIFY_SAMPLE 64                        // verified blocks: recheck one GET in this many
+#define DEFAULT_MAX_CHUNK (4ULL * 1024 * 1024 * 1024)
+#define MAX_EVENTS 256
+#define OUTBUF_HIGH_WATER (4 * 1024 * 1024)
+#define GET_OPEN_FILES 4                            // chunk files a connection's GETs keep open
+#define GET_QUEUE_MAX 64                            // GETs a connection may have waiting
+#define BLOCKS_PER_DIR 4096
+#define DEFAULT_REPAIR_INTERVAL 60                  // seconds
+#define DEFAULT_REPAIR_RATE (16 * 1024 * 1024)      // bytes per second
+#define PEER_TIMEOUT_SEC 10
+#define PEER_MAX_REPLY (256 * 1024 * 1024)
+#define LIST_MAX_PAGE ((size_t)1 << 30)             // entries; a page size of 0 asks for all
+#define DEFAULT_HOT_CACHE (64 * 1024 * 1024)        // bytes
 
 // Global Variables
 string directory_path;
+int portno;
+unsigned long long max_chunk_size = DEFAULT_MAX_CHUNK;
+bool content_addressed = false;
+
+// Cluster membership (-r), for repair: where each chunk belongs
+vector<ServerAddress> cluster;
+int self_index = -1;
+int repair_interval = DEFAULT_REPAIR_INTERVAL;
+uint64_t repair_rate = DEFAULT_REPAIR_RATE;     // 0 = unlimited
+uint64_t hot_cache_budget = DEFAULT_HOT_CACHE;  // 0 = no hot cache
 
 void error(const char *msg) {
     perror(msg);
@@ -28,289 +73,3126 @@ void error(const char *msg) {
 }
 
 /* ------------------------------------------------------
-    SENDER
+    METRICS
+    Counters any reactor or background thread bumps with a
+    relaxed atomic add, so keeping them costs next to nothing;
+    OP_METRICS reads them all and reports them as text (see
+    handle_metrics). Each operation has a count, an error count
+    and a latency histogram (stats.h) of its service time: from
+    the request being parsed to its reply being queued (for a
+    PUT, until the body is stored). Disk time is spent in read
+    and write calls on chunk, pack and object files; sendfile()
+    is left out, as it is as much network as disk.
+------------------------------------------------------ */
+enum MetricOp { METRIC_LIST, METRIC_GET, METRIC_PUT, METRIC_STAT, METRIC_OPS };
+static const char *metric_op_names[METRIC_OPS] = {"list", "get", "put", "stat"};
+
+struct OpMetrics {
+    atomic<uint64_t> count;
+    atomic<uint64_t> errors;
+    atomic<uint64_t> latency[LAT_BUCKETS];     // microseconds
+};
+
+OpMetrics op_metrics[METRIC_OPS];
+atomic<uint64_t> bytes_in(0), bytes_out(0);
+atomic<uint64_t> disk_read_us(0), disk_write_us(0);
+atomic<uint64_t> connections_total(0);
+atomic<int64_t> connections_open(0);
+atomic<int64_t> queued_bytes(0);               // reply bytes waiting to be sent, all sessions
+atomic<int64_t> pinned_bytes(0);               // cached blocks held by queued frames, all sessions
+time_t started_at;
+
+static inline uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void record_op(MetricOp op, uint64_t start_us, bool ok) {
+    OpMetrics &m = op_metrics[op];
+    m.count.fetch_add(1, memory_order_relaxed);
+    if (!ok) m.errors.fetch_add(1, memory_order_relaxed);
+    m.latency[lat_bucket(now_us() - start_us)].fetch_add(1, memory_order_relaxed);
+}
+
+// Charge the time since start_us to disk reads or writes
+static inline void disk_time(atomic<uint64_t> &counter, uint64_t start_us) {
+    counter.fetch_add(now_us() - start_us, memory_order_relaxed);
+}
+
+/* ------------------------------------------------------
+    CONNECTION STATE
+    Each client socket is a long-lived session driven by a small
+    state machine. Requests are handled in order:
+    READ_HEADER -> (READ_BODY) -> READ_HEADER -> ...
+    Responses queue on outq independently of the input side.
+    Once the client hangs up the connection moves to DRAINING,
+    flushes what is left and closes.
+------------------------------------------------------ */
+// One response frame (e.g. a CHUNK header plus its data). Frames
+// that have not started sending can be dropped by a cancel; the
+// terminal frame of a request (END/ack) is always delivered.
+// Chunk data is not copied into the frame: file_fd/file_off/file_len
+// name a region of an open chunk file that follows the in-memory
+// bytes on the wire and is sent with sendfile(). A block served from
+// the hot cache is shared instead: the region is then of mem.
+struct OutFrame {
+    unsigned int req_id;
+    bool terminal;
+    string data;
+    int file_fd;        // owned by the frame, -1 if none
+    shared_ptr<const string> mem;
+    off_t file_off;
+    size_t file_len;
+
+    size_t size() const { return data.size() + file_len; }
+};
+
+enum ConnState {
+    CONN_READ_HEADER,
+    CONN_READ_BODY,
+    CONN_DRAINING,
+    CONN_CLOSED
+};
+
+struct GetStream;
+
+struct Connection {
+    int fd;
+    struct sockaddr_in addr;
+    ConnState state;
+    RecvBuffer inbuf;   // bytes received but not yet consumed (at most one recv buffer)
+    deque<OutFrame> outq;   // response frames waiting to be sent
+    size_t out_off;         // bytes of outq.front() already sent
+    size_t out_bytes;       // total unsent bytes in outq (see queue_bytes)
+    size_t mem_bytes;       // cached blocks held by frames in outq (see sender_memory)
+    int open_files;         // frames in outq holding an open chunk file
+    deque<GetStream *> gets;    // GETs not yet fully queued, oldest first
+
+    // PUT in progress: the body is streamed straight to put_fd
+    unsigned int req_id;
+    string put_filename;
+    int put_chunk;
+    size_t put_len;
+    size_t put_received;
+    int put_fd;
+    string put_path;    // file put_fd writes, removed if the upload fails
+    bool put_failed;    // keep reading the body, but discard it and reply ERR
+    uint32_t put_crc;   // CRC32C of the data so far, checked against put_info
+    // Content-addressed PUT: the BlockInfo is kept aside and only the
+    // data goes to put_path (a temp object), hashed on the way
+    BlockInfo put_info;
+    EVP_MD_CTX *put_md;
+    // A block small enough for a pack (-p) is gathered here instead
+    bool put_packed;
+    string put_buf;
+    uint64_t put_start_us;  // when the PUT header arrived
+
+    Connection() : fd(-1), state(CONN_READ_HEADER), out_off(0), out_bytes(0), mem_bytes(0), open_files(0), req_id(0), put_chunk(0),
+                   put_len(0), put_received(0), put_fd(-1), put_failed(false), put_crc(0),
+                   put_md(NULL), put_packed(false), put_start_us(0) {
+        memset(&addr, 0, sizeof(addr));
+    }
+};
+
+struct Reactor {
+    int id;
+    int listenfd;
+    int epfd;
+};
+
+/* ------------------------------------------------------
+    SENDER
+    begin_frame() opens a new response frame for a request and
+    sender() appends bytes to it; the reactor flushes frames once
+    the socket is writable.
+------------------------------------------------------ */
+// Account for reply bytes queued (or, negative, sent or dropped)
+static inline void queue_bytes(Connection *conn, int64_t delta) {
+    conn->out_bytes += delta;
+    queued_bytes.fetch_add(delta, memory_order_relaxed);
+}
+
+void begin_frame(Connection *conn, unsigned int req_id, bool terminal = false) {
+    OutFrame frame;
+    frame.req_id = req_id;
+    frame.terminal = terminal;
+    frame.file_fd = -1;
+    frame.file_off = 0;
+    frame.file_len = 0;
+    conn->outq.push_back(frame);
+}
+
+// Attach len bytes of fd (starting at off) to the current frame;
+// the frame takes ownership of fd
+void sender_file(Connection *conn, int fd, off_t off, size_t len) {
+    OutFrame &frame = conn->outq.back();
+    frame.file_fd = fd;
+    frame.file_off = off;
+    frame.file_len = len;
+    queue_bytes(conn, len);
+    conn->open_files++;
+}
+
+// Attach len bytes of a cached block (starting at off) to the
+// current frame; the frame keeps the block alive until it is sent,
+// and the whole block counts as pinned by the connection till then
+void sender_memory(Connection *conn, const shared_ptr<const string> &block, off_t off, size_t len) {
+    OutFrame &frame = conn->outq.back();
+    frame.mem = block;
+    frame.file_off = off;
+    frame.file_len = len;
+    queue_bytes(conn, len);
+    conn->mem_bytes += block->size();
+    pinned_bytes.fetch_add(block->size(), memory_order_relaxed);
+}
+
+static void release_frame(Connection *conn, OutFrame &frame) {
+    if (frame.file_fd >= 0) {
+        close(frame.file_fd);
+        frame.file_fd = -1;
+        conn->open_files--;
+    }
+    if (frame.mem) {
+        conn->mem_bytes -= frame.mem->size();
+        pinned_bytes.fetch_sub(frame.mem->size(), memory_order_relaxed);
+        frame.mem.reset();
+    }
+}
+
+int sender(Connection *conn, const char *buf, int buflen) {
+    conn->outq.back().data.append(buf, buflen);
+    queue_bytes(conn, buflen);
+    return buflen;
+}
+
+// Open a response frame and write its protocol header; the caller
+// then supplies body_len bytes of body
+static void begin_reply(Connection *conn, unsigned int req_id, uint8_t opcode, uint32_t arg,
+                        uint64_t body_len, bool terminal) {
+    begin_frame(conn, req_id, terminal);
+    string header = encode_frame(opcode, req_id, arg, "", body_len);
+    sender(conn, header.data(), header.size());
+}
+
+static void reply_error(Connection *conn, unsigned int req_id, const char *msg) {
+    begin_reply(conn, req_id, OP_ERROR, 0, strlen(msg), true);
+    sender(conn, msg, strlen(msg));
+}
+
+// Drop every frame of req_id that hasn't started going out yet
+void cancel_frames(Connection *conn, unsigned int req_id) {
+    for (auto it = conn->outq.begin(); it != conn->outq.end();) {
+        bool started = (it == conn->outq.begin() && conn->out_off > 0);
+        if (it->req_id == req_id && !it->terminal && !started) {
+            queue_bytes(conn, -(int64_t)it->size());
+            release_frame(conn, *it);
+            it = conn->outq.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+/* ------------------------------------------------------
+    BLOCK FILES
+    Block N of a file is stored as filename.N (BlockInfo header
+    followed by the data). The first BLOCKS_PER_DIR blocks of a
+    file sit directly in directory_path; later ones go to bucket
+    subdirectories b1, b2, ... of BLOCKS_PER_DIR blocks each, so
+    a file with millions of blocks never piles them all into one
+    directory. A bucket name has no ".N" suffix, so it can't be
+    mistaken for a block.
+    A block is written to a file in tmp/ and renamed over
+    filename.N once complete, so a GET opening the chunk sees
+    either the old block or the new one, never a torn one, and
+    needs no lock to do so. Temp files left by a crash are
+    cleared at startup.
+------------------------------------------------------ */
+static atomic<unsigned long> temp_counter(0);
+
+static string bucket_path(int chunk_index) {
+    int bucket = chunk_index / BLOCKS_PER_DIR;
+    if (bucket == 0) return directory_path;
+    return directory_path + "/b" + to_string(bucket);
+}
+
+static string chunk_path(const string &filename, int chunk_index) {
+    // Store with chunk index in filename: filename.chunk_index
+    return bucket_path(chunk_index) + "/" + filename + "." + to_string(chunk_index);
+}
+
+static string temp_path() {
+    return directory_path + "/tmp/" + to_string(getpid()) + "-" + to_string(++temp_counter);
+}
+
+// Create tmp/ and clear what a crash left in it
+static int init_temp_dir() {
+    string tmp = directory_path + "/tmp";
+    if (mkdir(tmp.c_str(), 0777) < 0 && errno != EEXIST) {
+        perror("mkdir failed");
+        return -1;
+    }
+    DIR *dir = opendir(tmp.c_str());
+    if (dir == NULL) {
+        perror("opendir failed");
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue;
+        unlink((tmp + "/" + entry->d_name).c_str());
+    }
+    closedir(dir);
+    return 0;
+}
+
+static bool is_bucket_name(const char *name) {
+    if (name[0] != 'b' || name[1] == '\0') return false;
+    for (const char *p = name + 1; *p; p++) {
+        if (!isdigit((unsigned char)*p)) return false;
+    }
+    return true;
+}
+
+/* ------------------------------------------------------
+    CHUNK INDEX
+    filename -> chunk index -> size/mtime/header for every chunk in
+    directory_path. Built once by scanning the directory at startup
+    and kept current by PUT, so GET and LIST never walk the
+    directory. The server assumes it owns the directory: chunks
+    added or removed behind its back are not seen until restart.
+    Files are kept sorted by name so LIST can hand them out a page
+    at a time. object_refs counts the chunks naming each stored
+    object (see OBJECT STORE); it is rebuilt by the same scan.
+    Chunks stored in pack files are added from the pack index (see
+    PACK FILES). All of it is shared by all reactors under
+    index_lock.
+------------------------------------------------------ */
+struct ChunkEntry {
+    off_t size;
+    time_t mtime;
+    string hash;    // object the chunk refers to, empty if stored inline
+    bool legacy;    // no block header
+    BlockInfo info; // the header otherwise
+    int pack;       // pack file holding the chunk, -1 if it has its own file
+    off_t pack_offset;
+    bool verified;  // data read back and matched info.crc since it was indexed
+
+    ChunkEntry() : size(0), mtime(0), legacy(false), pack(-1), pack_offset(0), verified(false) {}
+};
+
+map<string, map<int, ChunkEntry> > file_index;
+unordered_map<string, int> object_refs;
+pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static string object_path(const string &hash);
+static void pack_release_locked(const string &filename, int chunk_index, const ChunkEntry &old,
+                                bool drop);
+static bool flush_pack_records();
+static void drop_stale_blocks_locked(const string &filename, const BlockInfo &info);
+
+// Drop one reference to an object, deleting it with the last one.
+// Caller holds index_lock for writing.
+static void release_object_locked(const string &hash) {
+    auto it = object_refs.find(hash);
+    if (it == object_refs.end()) return;
+    if (--it->second == 0) {
+        object_refs.erase(it);
+        unlink(object_path(hash).c_str());
+    }
+}
+
+// Split "name.N" into name and N; false if the suffix isn't a chunk index
+static bool parse_chunk_name(const string &entry_name, string &filename, int &chunk_index) {
+    size_t dot = entry_name.rfind('.');
+    if (dot == string::npos || dot == 0 || dot + 1 == entry_name.length()) return false;
+    for (size_t i = dot + 1; i < entry_name.length(); i++) {
+        if (!isdigit((unsigned char)entry_name[i])) return false;
+    }
+    if (entry_name.length() - dot - 1 > 10) return false;
+    long long idx = atoll(entry_name.c_str() + dot + 1);
+    if (idx > INT_MAX) return false;
+    filename = entry_name.substr(0, dot);
+    chunk_index = (int)idx;
+    return true;
+}
+
+// info: the block's header, null for a legacy chunk. hash: object the
+// chunk now refers to, "" for an inline block. Any object the chunk
+// referred to before loses that reference.
+// pack: the pack file the chunk was appended to at pack_offset, -1
+// if it was written as filename.N. Whichever copy it replaces is
+// let go. Caller holds index_lock for writing.
+static void index_put_locked(const string &filename, int chunk_index, const struct stat &st,
+                             const BlockInfo *info, const string &hash, int pack = -1,
+                             off_t pack_offset = 0) {
+    ChunkEntry entry;
+    entry.size = st.st_size;
+    entry.mtime = st.st_mtime;
+    entry.hash = hash;
+    entry.legacy = (info == NULL);
+    if (info != NULL) entry.info = *info;
+    entry.pack = pack;
+    entry.pack_offset = pack_offset;
+    if (!hash.empty()) object_refs[hash]++;
+    map<int, ChunkEntry> &chunks = file_index[filename];
+    auto old = chunks.find(chunk_index);
+    if (old != chunks.end()) {
+        if (!old->second.hash.empty()) release_object_locked(old->second.hash);
+        if (old->second.pack >= 0) {
+            // The pack index must not bring it back over filename.N
+            pack_release_locked(filename, chunk_index, old->second, pack < 0);
+        } else if (pack >= 0) {
+            unlink(chunk_path(filename, chunk_index).c_str());
+        }
+    }
+    chunks[chunk_index] = entry;
+}
+
+static void index_put(const string &filename, int chunk_index, const struct stat &st,
+                      const BlockInfo *info, const string &hash = "") {
+    pthread_rwlock_wrlock(&index_lock);
+    index_put_locked(filename, chunk_index, st, info, hash);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// Whether the chunk stored is from a later generation than info.
+// Caller holds index_lock.
+static bool superseded_locked(const string &filename, int chunk_index, const BlockInfo &info) {
+    auto file = file_index.find(filename);
+    if (file == file_index.end()) return false;
+    auto chunk = file->second.find(chunk_index);
+    return chunk != file->second.end() && !chunk->second.legacy &&
+           chunk->second.info.generation > info.generation;
+}
+
+// Rename a finished temp file over filename.N and index it, unless
+// the chunk there is from a later generation: then the temp file is
+// dropped and stored is false. -1 if the rename failed.
+static int commit_chunk(const string &tmp, const string &filename, int chunk_index,
+                        const struct stat &st, const BlockInfo &info, const string &hash,
+                        bool &stored) {
+    int ret = 0;
+    stored = false;
+    pthread_rwlock_wrlock(&index_lock);
+    if (superseded_locked(filename, chunk_index, info)) {
+        unlink(tmp.c_str());
+        pthread_rwlock_unlock(&index_lock);
+        return 0;
+    }
+    if (rename(tmp.c_str(), chunk_path(filename, chunk_index).c_str()) < 0) {
+        perror("rename failed");
+        unlink(tmp.c_str());
+        ret = -1;
+    } else {
+        index_put_locked(filename, chunk_index, st, &info, hash);
+        drop_stale_blocks_locked(filename, info);
+        stored = true;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    flush_pack_records();
+    return ret;
+}
+
+// drop: a packed chunk is gone for good, not just hidden until
+// restart. Caller holds index_lock for writing.
+static void index_remove_locked(const string &filename, int chunk_index, bool drop) {
+    auto it = file_index.find(filename);
+    if (it != file_index.end()) {
+        auto chunk = it->second.find(chunk_index);
+        if (chunk != it->second.end()) {
+            if (!chunk->second.hash.empty()) release_object_locked(chunk->second.hash);
+            if (chunk->second.pack >= 0) pack_release_locked(filename, chunk_index, chunk->second, drop);
+            it->second.erase(chunk);
+        }
+        if (it->second.empty()) file_index.erase(it);
+    }
+}
+
+// A block of a new upload was stored: this server's blocks of the
+// file past its last one are left over from an earlier upload with
+// more blocks (or another layout), and nothing reads them again.
+// Caller holds index_lock for writing.
+static void drop_stale_blocks_locked(const string &filename, const BlockInfo &info) {
+    auto file = file_index.find(filename);
+    if (file == file_index.end()) return;
+    vector<pair<int, bool> > stale;     // chunk index, stored as filename.N
+    for (auto it = file->second.lower_bound((int)info.nblocks); it != file->second.end(); ++it) {
+        if (it->second.legacy || it->second.info.generation < info.generation) {
+            stale.push_back(make_pair(it->first, it->second.pack < 0));
+        }
+    }
+    for (const auto &chunk : stale) {
+        if (chunk.second) unlink(chunk_path(filename, chunk.first).c_str());
+        index_remove_locked(filename, chunk.first, true);
+    }
+    if (!stale.empty()) {
+        LOG(LOG_DEBUG) << "Dropped " << stale.size() << " blocks of " << filename << " left from an earlier upload";
+    }
+}
+
+// Take a chunk that failed its checksum out of the index, unless it
+// was replaced since info was read from it
+static void index_remove_corrupt(const string &filename, int chunk_index, const BlockInfo &info) {
+    pthread_rwlock_wrlock(&index_lock);
+    auto file = file_index.find(filename);
+    if (file != file_index.end()) {
+        auto chunk = file->second.find(chunk_index);
+        if (chunk != file->second.end() && !chunk->second.legacy && chunk->second.info.crc == info.crc &&
+            chunk->second.info.generation == info.generation) {
+            index_remove_locked(filename, chunk_index, false);
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// Remember that a chunk's data matched its CRC, unless it was
+// replaced since info was read from it
+static void index_mark_verified(const string &filename, int chunk_index, const BlockInfo &info) {
+    pthread_rwlock_wrlock(&index_lock);
+    auto file = file_index.find(filename);
+    if (file != file_index.end()) {
+        auto chunk = file->second.find(chunk_index);
+        if (chunk != file->second.end() && !chunk->second.legacy && chunk->second.info.crc == info.crc &&
+            chunk->second.info.generation == info.generation) {
+            chunk->second.verified = true;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// Read a chunk's header from base in fd; hash is set if it refers to
+// an object. False if the chunk doesn't start with a block header.
+static bool read_block_header(int fd, BlockInfo &info, string &hash, off_t base = 0) {
+    char buf[BLOCK_INFO_SIZE + BLOCK_HASH_SIZE];
+    uint64_t start = now_us();
+    ssize_t n = pread(fd, buf, sizeof(buf), base);
+    disk_time(disk_read_us, start);
+    if (n < BLOCK_INFO_SIZE || !decode_block_info(buf, info)) return false;
+    hash.clear();
+    if (info.flags & BLOCK_REF) {
+        if (n != (ssize_t)sizeof(buf)) return false;
+        hash.assign(buf + BLOCK_INFO_SIZE, BLOCK_HASH_SIZE);
+    }
+    return true;
+}
+
+// Index the block files of one directory, descending into buckets
+// from the top level; returns the number indexed, -1 if unreadable
+static long index_directory(const string &path, bool top_level) {
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL) {
+        perror("opendir failed");
+        return -1;
+    }
+
+    long count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue; // skip . and .. files
+
+        struct stat st;
+        string entry_path = path + "/" + entry->d_name;
+        if (stat(entry_path.c_str(), &st) < 0) continue;
+
+        if (S_ISDIR(st.st_mode)) {
+            if (top_level && is_bucket_name(entry->d_name)) {
+                long n = index_directory(entry_path, false);
+                if (n > 0) count += n;
+            }
+            continue;
+        }
+
+        string filename;
+        int chunk_index;
+        if (!S_ISREG(st.st_mode) || !parse_chunk_name(entry->d_name, filename, chunk_index)) continue;
+
+        string hash;
+        BlockInfo info;
+        bool has_header = false;
+        int fd = open(entry_path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            has_header = read_block_header(fd, info, hash);
+            close(fd);
+        }
+        index_put(filename, chunk_index, st, has_header ? &info : NULL, hash);
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+static int build_chunk_index() {
+    long count = index_directory(directory_path, true);
+    if (count < 0) {
+        return -1;
+    }
+    LOG(LOG_INFO) << "Indexed " << count << " chunks in " << directory_path;
+    return 0;
+}
+
+/* ------------------------------------------------------
+    OBJECT STORE
+    With -c, block data is stored once per distinct content:
+    objects/xx/<sha256 hex> holds the data and filename.N holds
+    only its BlockInfo (flagged BLOCK_REF) and the hash. The same
+    bytes uploaded under another name, or to another index, then
+    cost one more small reference file. An object lives as long
+    as some chunk refers to it (object_refs); like blocks, new
+    objects and reference files are written in tmp/ and renamed
+    into place.
+------------------------------------------------------ */
+static string hex_hash(const string &hash) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (unsigned char c : hash) {
+        hex += digits[c >> 4];
+        hex += digits[c & 0xf];
+    }
+    return hex;
+}
+
+static string object_path(const string &hash) {
+    string hex = hex_hash(hash);
+    return directory_path + "/objects/" + hex.substr(0, 2) + "/" + hex;
+}
+
+static int init_object_store() {
+    string objects = directory_path + "/objects";
+    if (mkdir(objects.c_str(), 0777) < 0 && errno != EEXIST) {
+        perror("mkdir failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Take a reference on hash if it is stored, so it can't be deleted
+// while a chunk is being pointed at it
+static bool pin_object(const string &hash) {
+    pthread_rwlock_wrlock(&index_lock);
+    auto it = object_refs.find(hash);
+    bool found = (it != object_refs.end());
+    if (found) it->second++;
+    pthread_rwlock_unlock(&index_lock);
+    return found;
+}
+
+static void unpin_object(const string &hash) {
+    pthread_rwlock_wrlock(&index_lock);
+    release_object_locked(hash);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// Move a freshly written temp file into the store as hash (or drop
+// it if that content is already there) and pin the object
+static int store_object(const string &tmp, const string &hash) {
+    int ret = 0;
+    pthread_rwlock_wrlock(&index_lock);
+    auto it = object_refs.find(hash);
+    if (it != object_refs.end()) {
+        unlink(tmp.c_str());
+        it->second++;
+    } else {
+        string path = object_path(hash);
+        string subdir = path.substr(0, path.rfind('/'));
+        if (mkdir(subdir.c_str(), 0777) < 0 && errno != EEXIST) {
+            perror("mkdir failed");
+        }
+        if (rename(tmp.c_str(), path.c_str()) < 0) {
+            perror("rename failed");
+            unlink(tmp.c_str());
+            ret = -1;
+        } else {
+            object_refs[hash] = 1;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return ret;
+}
+
+// Write filename.N as a reference to a pinned object and index it
+// (see commit_chunk)
+static int write_ref(const string &filename, int chunk_index, BlockInfo info,
+                     const string &hash, bool &stored) {
+    struct stat st;
+    char buf[BLOCK_INFO_SIZE + BLOCK_HASH_SIZE];
+    info.flags |= BLOCK_REF;
+    encode_block_info(info, buf);
+    memcpy(buf + BLOCK_INFO_SIZE, hash.data(), BLOCK_HASH_SIZE);
+
+    string tmp = temp_path();
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        perror("open failed");
+        return -1;
+    }
+    bool ok = write(fd, buf, sizeof(buf)) == (ssize_t)sizeof(buf) && fstat(fd, &st) == 0;
+    close(fd);
+
+    if (chunk_index >= BLOCKS_PER_DIR && mkdir(bucket_path(chunk_index).c_str(), 0777) < 0 &&
+        errno != EEXIST) {
+        perror("mkdir failed");
+    }
+    if (!ok) {
+        perror("write_ref failed");
+        unlink(tmp.c_str());
+        return -1;
+    }
+    info.flags &= ~BLOCK_REF;
+    return commit_chunk(tmp, filename, chunk_index, st, info, hash, stored);
+}
+
+/* ------------------------------------------------------
+    PACK FILES
+    With -p, a block of at most pack_max_bytes (header + data)
+    gets no file of its own: it is appended to the open pack,
+    packs/pack-N, and where it went is appended to packs/index.
+    A million small blocks then cost a few large files rather
+    than a million inodes with a disk block each, and startup
+    reads one index instead of walking the directory. Records of
+    the index, big-endian:
+        kind      u8    PACK_PUT or PACK_DROP
+        name_len  u16
+        chunk     u32
+        pack      u32   which pack-N (PACK_PUT)
+        offset    u64   where the block starts in it
+        length    u64   of header + data
+        crc32c    u32   of the data, as in the block's header
+        name
+    Replaying it at startup, the last record of a chunk wins and
+    a drop removes it; a chunk that is also found as filename.N
+    goes with whichever copy has the later generation.
+    Packs are only appended to, so an overwritten or removed block
+    leaves dead bytes behind. Every PACK_COMPACT_INTERVAL seconds
+    the compactor copies the live blocks of full packs that are
+    mostly dead into the open pack, deletes the old packs and
+    rewrites the index with only the live records. A GET reads a
+    packed block through a dup of its pack's descriptor, so a pack
+    deleted meanwhile stays readable until the block is sent.
+    The state below is under pack_lock, which is taken after
+    index_lock when both are held. Block bytes are appended to a
+    pack under pack_lock alone; index_lock is only taken to
+    index them. A record is queued under both, with the change
+    to the chunk index it describes, so packs/index replays in
+    the order the changes were made, and is written out once
+    index_lock is let go.
+------------------------------------------------------ */
+#define PACK_PUT 1
+#define PACK_DROP 2
+#define PACK_RECORD_FIXED 31
+#define PACK_FULL_SIZE (64 * 1024 * 1024)   // start a new pack past this
+#define PACK_COMPACT_INTERVAL 30            // seconds
+#define PACK_MIN_LIVE 0.5                   // compact full packs with less live data
+
+struct Pack {
+    int fd;
+    off_t size;
+    off_t live;         // bytes of blocks the index still points at
+};
+
+map<int, Pack> packs;
+int open_pack = -1;             // the pack being appended to
+int pack_index_fd = -1;
+long pack_index_records = 0;    // records in packs/index
+long pack_index_dead = 0;       // ...of which are superseded
+unsigned long long pack_max_bytes = 0;  // -p, 0 = every block gets a file
+pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+string pack_pending;            // records not yet written to packs/index
+bool pack_rewriting = false;    // rewrite_pack_index has taken its snapshot...
+string pack_tail;               // ...and these records come after it
+long pack_tail_records = 0;
+
+static string pack_dir() {
+    return directory_path + "/packs";
+}
+
+static string pack_path(int pack) {
+    return pack_dir() + "/pack-" + to_string(pack);
+}
+
+static string encode_pack_record(uint8_t kind, const string &filename, int chunk_index, int pack,
+                                 off_t offset, off_t length, uint32_t crc) {
+    unsigned char fixed[PACK_RECORD_FIXED];
+    fixed[0] = kind;
+    put_u16(fixed + 1, (uint16_t)filename.size());
+    put_u32(fixed + 3, chunk_index);
+    put_u32(fixed + 7, pack);
+    put_u64(fixed + 11, offset);
+    put_u64(fixed + 19, length);
+    put_u32(fixed + 27, crc);
+    return string((const char *)fixed, PACK_RECORD_FIXED) + filename;
+}
+
+static bool write_all(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        uint64_t start = now_us();
+        ssize_t n = (offset < 0) ? write(fd, buf, len) : pwrite(fd, buf, len, offset);
+        disk_time(disk_write_us, start);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
+        if (offset >= 0) offset += n;
+    }
+    return true;
+}
+
+// Caller holds pack_lock
+static void queue_pack_record(const string &record) {
+    pack_pending += record;
+    pack_index_records++;
+    if (pack_rewriting) {
+        pack_tail += record;
+        pack_tail_records++;
+    }
+}
+
+// Write the queued records to packs/index; false if that failed
+static bool flush_pack_records() {
+    bool ok = true;
+    pthread_mutex_lock(&pack_lock);
+    if (!pack_pending.empty()) {
+        ok = write_all(pack_index_fd, pack_pending.data(), pack_pending.size(), -1);
+        if (!ok) perror("pack index write failed");
+        pack_pending.clear();
+    }
+    pthread_mutex_unlock(&pack_lock);
+    return ok;
+}
+
+// len bytes of the pack are no longer pointed at. Caller holds
+// pack_lock.
+static void pack_dead_locked(int pack, off_t len) {
+    auto p = packs.find(pack);
+    if (p != packs.end()) p->second.live -= len;
+}
+
+// A packed chunk is being replaced or removed: its bytes are dead,
+// and with drop the index is told it is gone. Caller holds
+// index_lock for writing.
+static void pack_release_locked(const string &filename, int chunk_index, const ChunkEntry &old,
+                                bool drop) {
+    pthread_mutex_lock(&pack_lock);
+    pack_dead_locked(old.pack, old.size);
+    pack_index_dead++;
+    if (drop) {
+        queue_pack_record(encode_pack_record(PACK_DROP, filename, chunk_index, 0, 0, 0, 0));
+        pack_index_dead++;
+    }
+    pthread_mutex_unlock(&pack_lock);
+}
+
+// Append len bytes to the open pack, starting a new one when it is
+// full; false if that failed. Caller holds pack_lock.
+static bool pack_append_locked(const char *buf, size_t len, int &pack, off_t &offset) {
+    auto current = packs.find(open_pack);
+    if (current == packs.end() || current->second.size >= PACK_FULL_SIZE) {
+        int next = packs.empty() ? 1 : packs.rbegin()->first + 1;
+        int fd = open(pack_path(next).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("open pack failed");
+            return false;
+        }
+        current = packs.insert(make_pair(next, Pack{fd, 0, 0})).first;
+        open_pack = next;
+    }
+    Pack &p = current->second;
+    if (!write_all(p.fd, buf, len, p.size)) {
+        perror("pack write failed");
+        return false;
+    }
+    pack = open_pack;
+    offset = p.size;
+    p.size += len;
+    p.live += len;
+    return true;
+}
+
+// Store a received block (header + data) in the open pack, unless a
+// later generation of the chunk is stored already (stored = false)
+static int commit_packed(const string &filename, int chunk_index, const BlockInfo &info,
+                         const string &block, bool &stored) {
+    stored = false;
+    pthread_rwlock_rdlock(&index_lock);
+    bool superseded = superseded_locked(filename, chunk_index, info);
+    pthread_rwlock_unlock(&index_lock);
+    if (superseded) return 0;
+
+    int pack;
+    off_t offset;
+    pthread_mutex_lock(&pack_lock);
+    bool ok = pack_append_locked(block.data(), block.size(), pack, offset);
+    pthread_mutex_unlock(&pack_lock);
+    if (!ok) return -1;
+
+    // A later generation may have come in while the block was
+    // written; then the bytes just written are dead
+    pthread_rwlock_wrlock(&index_lock);
+    if (superseded_locked(filename, chunk_index, info)) {
+        pthread_mutex_lock(&pack_lock);
+        pack_dead_locked(pack, block.size());
+        pthread_mutex_unlock(&pack_lock);
+    } else {
+        pthread_mutex_lock(&pack_lock);
+        queue_pack_record(encode_pack_record(PACK_PUT, filename, chunk_index, pack, offset, block.size(),
+                                             info.crc));
+        pthread_mutex_unlock(&pack_lock);
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        st.st_size = block.size();
+        st.st_mtime = time(NULL);
+        index_put_locked(filename, chunk_index, st, &info, "", pack, offset);
+        drop_stale_blocks_locked(filename, info);
+        stored = true;
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return flush_pack_records() ? 0 : -1;
+}
+
+// Open a chunk for reading: its own file, or (packed) a dup of its
+// pack's descriptor. base is where the chunk starts in the returned
+// fd and size its length; -1 if it can't be opened.
+static int open_chunk(const string &filename, int chunk_index, off_t &base, off_t &size) {
+    pthread_rwlock_rdlock(&index_lock);
+    auto file = file_index.find(filename);
+    if (file != file_index.end()) {
+        auto chunk = file->second.find(chunk_index);
+        if (chunk != file->second.end() && chunk->second.pack >= 0) {
+            pthread_mutex_lock(&pack_lock);
+            auto pack = packs.find(chunk->second.pack);
+            int fd = (pack != packs.end()) ? dup(pack->second.fd) : -1;
+            pthread_mutex_unlock(&pack_lock);
+            base = chunk->second.pack_offset;
+            size = chunk->second.size;
+            pthread_rwlock_unlock(&index_lock);
+            return fd;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    int fd = open(chunk_path(filename, chunk_index).c_str(), O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    base = 0;
+    size = (fd >= 0) ? st.st_size : 0;
+    return fd;
+}
+
+// Rewrite packs/index with one record per live packed chunk. The
+// records are gathered under index_lock and written without it;
+// records queued meanwhile follow them into the new index.
+static int rewrite_pack_index() {
+    string tmp = temp_path();
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        perror("open failed");
+        return -1;
+    }
+    string buf;
+    long records = 0;
+    pthread_rwlock_rdlock(&index_lock);
+    pthread_mutex_lock(&pack_lock);
+    pack_rewriting = true;
+    long dead = pack_index_dead;
+    pthread_mutex_unlock(&pack_lock);
+    for (const auto &file : file_index) {
+        for (const auto &chunk : file.second) {
+            const ChunkEntry &entry = chunk.second;
+            if (entry.pack < 0) continue;
+            buf += encode_pack_record(PACK_PUT, file.first, chunk.first, entry.pack, entry.pack_offset,
+                                      entry.size, entry.info.crc);
+            records++;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    bool ok = write_all(fd, buf.data(), buf.size(), -1);
+
+    int ret = 0;
+    pthread_mutex_lock(&pack_lock);
+    ok = ok && write_all(fd, pack_tail.data(), pack_tail.size(), -1);
+    close(fd);
+    string path = pack_dir() + "/index";
+    int index_fd = -1;
+    if (!ok || rename(tmp.c_str(), path.c_str()) < 0) {
+        perror("pack index rewrite failed");
+        unlink(tmp.c_str());
+        ret = -1;
+    } else if ((index_fd = open(path.c_str(), O_WRONLY | O_APPEND)) < 0) {
+        perror("open pack index failed");
+        ret = -1;
+    } else {
+        // Whatever is still queued is in the snapshot or the tail
+        close(pack_index_fd);
+        pack_index_fd = index_fd;
+        pack_pending.clear();
+        pack_index_records = records + pack_tail_records;
+        pack_index_dead -= dead;
+    }
+    pack_rewriting = false;
+    pack_tail.clear();
+    pack_tail_records = 0;
+    pthread_mutex_unlock(&pack_lock);
+    return ret;
+}
+
+struct PackRecord {
+    int pack;
+    off_t offset;
+    off_t length;
+};
+
+// Open the packs and replay their index into the chunk index, after
+// the loose chunks are in
+static int load_packs() {
+    if (mkdir(pack_dir().c_str(), 0777) < 0 && errno != EEXIST) {
+        perror("mkdir failed");
+        return -1;
+    }
+    DIR *dir = opendir(pack_dir().c_str());
+    if (dir == NULL) {
+        perror("opendir failed");
+        return -1;
+    }
+    struct dirent *dent;
+    while ((dent = readdir(dir)) != NULL) {
+        int id;
+        char extra;
+        if (sscanf(dent->d_name, "pack-%d%c", &id, &extra) != 1 || id <= 0) continue;
+        int fd = open(pack_path(id).c_str(), O_RDWR);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror("open pack failed");
+            if (fd >= 0) close(fd);
+            continue;
+        }
+        packs[id] = Pack{fd, st.st_size, 0};
+        open_pack = max(open_pack, id);
+    }
+    closedir(dir);
+
+    string path = pack_dir() + "/index";
+    pack_index_fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (pack_index_fd < 0) {
+        perror("open pack index failed");
+        return -1;
+    }
+    string log;
+    char buf[RECV_BUFSIZE];
+    ssize_t n;
+    while ((n = read(pack_index_fd, buf, sizeof(buf))) > 0) log.append(buf, n);
+
+    map<pair<string, int>, PackRecord> latest;
+    const unsigned char *p = (const unsigned char *)log.data();
+    size_t off = 0;
+    while (log.size() - off >= PACK_RECORD_FIXED) {
+        size_t name_len = get_u16(p + off + 1);
+        if (log.size() - off < PACK_RECORD_FIXED + name_len) break;
+        pair<string, int> key(log.substr(off + PACK_RECORD_FIXED, name_len), (int)get_u32(p + off + 3));
+        PackRecord rec = {(int)get_u32(p + off + 7), (off_t)get_u64(p + off + 11),
+                          (off_t)get_u64(p + off + 19)};
+        if (p[off] == PACK_PUT) {
+            latest[key] = rec;
+        } else {
+            latest.erase(key);
+        }
+        pack_index_records++;
+        off += PACK_RECORD_FIXED + name_len;
+    }
+    if (off < log.size() && ftruncate(pack_index_fd, off) < 0) {
+        // A record torn by a crash; the next one would follow it
+        perror("ftruncate failed");
+    }
+
+    long count = 0;
+    for (const auto &l : latest) {
+        const PackRecord &rec = l.second;
+        auto pack = packs.find(rec.pack);
+        BlockInfo info;
+        string hash;
+        if (pack == packs.end() || rec.offset + rec.length > pack->second.size ||
+            !read_block_header(pack->second.fd, info, hash, rec.offset)) {
+            LOG(LOG_WARN) << "Pack record of " << l.first.first << "." << l.first.second << " is unusable";
+            continue;
+        }
+        // A copy that also exists as filename.N: keep the later one
+        map<int, ChunkEntry> &chunks = file_index[l.first.first];
+        auto loose = chunks.find(l.first.second);
+        if (loose != chunks.end()) {
+            if (!loose->second.legacy && loose->second.info.generation > info.generation) continue;
+            if (!loose->second.hash.empty()) release_object_locked(loose->second.hash);
+            unlink(chunk_path(l.first.first, l.first.second).c_str());
+        }
+        ChunkEntry &entry = chunks[l.first.second];
+        entry = ChunkEntry();
+        entry.size = rec.length;
+        entry.mtime = time(NULL);
+        entry.info = info;
+        entry.pack = rec.pack;
+        entry.pack_offset = rec.offset;
+        pack->second.live += rec.length;
+        count++;
+    }
+    pack_index_dead = pack_index_records - count;
+    LOG(LOG_INFO) << "Loaded " << count << " packed chunks from " << packs.size() << " packs";
+    return 0;
+}
+
+// Move the live blocks of one full pack to the open pack, block by
+// block so GET and PUT only wait for one copy at a time
+static void compact_pack(int id) {
+    struct Move {
+        string filename;
+        int chunk_index;
+        off_t offset;
+        off_t size;
+    };
+    vector<Move> moves;
+    pthread_mutex_lock(&pack_lock);
+    auto from = packs.find(id);
+    if (from == packs.end()) {
+        pthread_mutex_unlock(&pack_lock);
+        return;
+    }
+    int fd = dup(from->second.fd);
+    off_t dead = from->second.size - from->second.live;
+    pthread_mutex_unlock(&pack_lock);
+    pthread_rwlock_rdlock(&index_lock);
+    for (const auto &file : file_index) {
+        for (const auto &chunk : file.second) {
+            if (chunk.second.pack == id) {
+                moves.push_back(Move{file.first, chunk.first, chunk.second.pack_offset, chunk.second.size});
+            }
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    string block;
+    for (const Move &m : moves) {
+        block.resize(m.size);
+        if (pread(fd, &block[0], m.size, m.offset) != (ssize_t)m.size) {
+            perror("pack read failed");
+            break;
+        }
+        int pack;
+        off_t offset;
+        pthread_mutex_lock(&pack_lock);
+        bool ok = pack_append_locked(block.data(), block.size(), pack, offset);
+        pthread_mutex_unlock(&pack_lock);
+        if (!ok) break;
+
+        pthread_rwlock_wrlock(&index_lock);
+        ChunkEntry *entry = NULL;
+        auto file = file_index.find(m.filename);
+        if (file != file_index.end()) {
+            auto chunk = file->second.find(m.chunk_index);
+            if (chunk != file->second.end()) entry = &chunk->second;
+        }
+        pthread_mutex_lock(&pack_lock);
+        if (entry != NULL && entry->pack == id && entry->pack_offset == m.offset) {
+            queue_pack_record(encode_pack_record(PACK_PUT, m.filename, m.chunk_index, pack, offset, m.size,
+                                                 entry->info.crc));
+            pack_dead_locked(id, m.size);
+            pack_index_dead++;
+            entry->pack = pack;
+            entry->pack_offset = offset;
+            entry->verified = false;    // the copy has not been read back
+        } else {
+            // Replaced while it was copied: the copy is dead
+            pack_dead_locked(pack, m.size);
+        }
+        pthread_mutex_unlock(&pack_lock);
+        pthread_rwlock_unlock(&index_lock);
+    }
+    close(fd);
+    // The index must point past the pack before it goes
+    if (!flush_pack_records()) return;
+
+    pthread_mutex_lock(&pack_lock);
+    from = packs.find(id);
+    if (from != packs.end() && from->second.live == 0) {
+        close(from->second.fd);
+        packs.erase(from);
+        unlink(pack_path(id).c_str());
+        LOG(LOG_INFO) << "[PACK] Compacted pack " << id << ": " << moves.size() << " blocks moved, " << dead
+                      << " bytes freed";
+    }
+    pthread_mutex_unlock(&pack_lock);
+}
+
+static void compact_loop() {
+    while (true) {
+        sleep(PACK_COMPACT_INTERVAL);
+        vector<int> sparse;
+        pthread_mutex_lock(&pack_lock);
+        for (const auto &pack : packs) {
+            const Pack &p = pack.second;
+            if (pack.first != open_pack && p.live < p.size * PACK_MIN_LIVE) sparse.push_back(pack.first);
+        }
+        pthread_mutex_unlock(&pack_lock);
+
+        for (int id : sparse) {
+            compact_pack(id);
+        }
+        // The index keeps every record ever appended; once most are
+        // stale, start it over from the live ones
+        pthread_mutex_lock(&pack_lock);
+        bool rewrite = !sparse.empty() || pack_index_dead > pack_index_records / 2;
+        pthread_mutex_unlock(&pack_lock);
+        if (rewrite) rewrite_pack_index();
+    }
+}
+
+/* ------------------------------------------------------
+    SUMMARIES
+    With a cluster configuration (-r) the server knows which
+    servers each of its chunks belongs on, its homes (see
+    placement.h). To compare notes with a peer it summarizes the
+    chunks they should both hold: each falls in one of
+    SUMMARY_BUCKETS buckets by name, and a bucket's digest is the
+    XOR of its entries' hashes over name, index, generation, CRC
+    and length.
+    Servers holding the same copies get the same digests, so only
+    the entries of buckets that differ need comparing. Legacy
+    chunks have no layout and are left out.
+------------------------------------------------------ */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+#define SUMMARY_ENTRY_FIXED 26      // u16 name length, u32 index, u32 crc, u64 length, u64 generation
+
+struct SummaryEntry {
+    string filename;
+    int chunk_index;
+    uint32_t crc;
+    uint64_t length;
+    uint64_t generation;
+};
+
+// A chunk held here and the servers it belongs on
+struct LocalChunk {
+    SummaryEntry entry;
+    vector<int> homes;
+};
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static uint64_t entry_name_hash(const SummaryEntry &e) {
+    unsigned char idx[4];
+    put_u32(idx, e.chunk_index);
+    return fnv1a(fnv1a(FNV_OFFSET, e.filename.data(), e.filename.size()), idx, sizeof(idx));
+}
+
+static int summary_bucket(const SummaryEntry &e) {
+    return (int)(entry_name_hash(e) % SUMMARY_BUCKETS);
+}
+
+static uint64_t summary_digest(const SummaryEntry &e) {
+    unsigned char version[20];
+    put_u32(version, e.crc);
+    put_u64(version + 4, e.length);
+    put_u64(version + 12, e.generation);
+    return fnv1a(entry_name_hash(e), version, sizeof(version));
+}
+
+static bool holds_home(const vector<int> &homes, int server) {
+    return find(homes.begin(), homes.end(), server) != homes.end();
+}
+
+// Whether a chunk held here goes in the summary for peer: it
+// belongs here and, unless peer is SUMMARY_ANY, there too
+static bool shared_with(const LocalChunk &chunk, uint32_t peer) {
+    if (!holds_home(chunk.homes, self_index)) return false;
+    return peer == SUMMARY_ANY || holds_home(chunk.homes, (int)peer);
+}
+
+// Every chunk with a header, and its homes
+static vector<LocalChunk> snapshot_chunks() {
+    vector<LocalChunk> chunks;
+    pthread_rwlock_rdlock(&index_lock);
+    for (const auto &file : file_index) {
+        uint32_t key = hash_file_key(file.first.c_str());
+        for (const auto &chunk : file.second) {
+            const ChunkEntry &entry = chunk.second;
+            if (entry.legacy) continue;
+            LocalChunk local;
+            local.entry.filename = file.first;
+            local.entry.chunk_index = chunk.first;
+            local.entry.crc = entry.info.crc;
+            local.entry.length = entry.info.length;
+            local.entry.generation = entry.info.generation;
+            local.homes = block_homes(entry.info, key, chunk.first, cluster.size());
+            chunks.push_back(local);
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    return chunks;
+}
+
+static void encode_summary_entry(const SummaryEntry &e, string &out) {
+    unsigned char fixed[SUMMARY_ENTRY_FIXED];
+    put_u16(fixed, (uint16_t)e.filename.size());
+    put_u32(fixed + 2, e.chunk_index);
+    put_u32(fixed + 6, e.crc);
+    put_u64(fixed + 10, e.length);
+    put_u64(fixed + 18, e.generation);
+    out.append((const char *)fixed, 2);
+    out += e.filename;
+    out.append((const char *)fixed + 2, SUMMARY_ENTRY_FIXED - 2);
+}
+
+// Parse a list of entries; false if it is malformed
+static bool decode_summary_entries(const string &body, vector<SummaryEntry> &entries) {
+    const unsigned char *p = (const unsigned char *)body.data();
+    size_t off = 0;
+    while (off < body.size()) {
+        if (body.size() - off < SUMMARY_ENTRY_FIXED) return false;
+        size_t name_len = get_u16(p + off);
+        if (body.size() - off < SUMMARY_ENTRY_FIXED + name_len) return false;
+        SummaryEntry e;
+        e.filename.assign(body.data() + off + 2, name_len);
+        const unsigned char *q = p + off + 2 + name_len;
+        e.chunk_index = (int)get_u32(q);
+        e.crc = get_u32(q + 4);
+        e.length = get_u64(q + 8);
+        e.generation = get_u64(q + 16);
+        entries.push_back(e);
+        off += SUMMARY_ENTRY_FIXED + name_len;
+    }
+    return true;
+}
+
+/* ------------------------------------------------------
+    COMMAND HANDLERS
+------------------------------------------------------ */
+// List chunks of files whose name starts with prefix, in order, from
+// the one after (after_name, after_chunk) on (after_chunk -1: from
+// the start of after_name); page = most entries to send, 0 for all
+int handle_list(Connection *conn, unsigned int req_id, const string &prefix, const string &after_name,
+                long long after_chunk, size_t page) {
+    string response = "";
+    size_t count = 0;
+    bool more = false;
+    if (page == 0 || page > LIST_MAX_PAGE) page = LIST_MAX_PAGE;
+
+    pthread_rwlock_rdlock(&index_lock);
+    for (auto file = file_index.lower_bound(max(prefix, after_name));
+         file != file_index.end() && file->first.compare(0, prefix.size(), prefix) == 0 && !more; ++file) {
+        auto chunk = file->second.begin();
+        if (file->first == after_name) chunk = file->second.upper_bound((int)after_chunk);
+        for (; chunk != file->second.end(); ++chunk) {
+            if (count == page) {
+                more = true;
+                break;
+            }
+            response += file->first;
+            response += ".";
+            response += to_string(chunk->first);
+            const ChunkEntry &entry = chunk->second;
+            if (!entry.legacy) {
+                response += " " + to_string(entry.info.generation) + " " + to_string(entry.info.nblocks) +
+                            " " + to_string(entry.info.flags) + " " + to_string(entry.info.ec_data) + " " +
+                            to_string(entry.info.ec_parity);
+            }
+            response += "\n";
+            count++;
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    if (!response.empty()) {
+        response.pop_back(); // Remove trailing newline
+    }
+
+    // LISTING frame whose body is the listing
+    begin_reply(conn, req_id, OP_LISTING, more ? LIST_MORE : 0, response.length(), true);
+    sender(conn, response.c_str(), response.length());
+    return 0;
+}
+
+/* ------------------------------------------------------
+    PUT is streamed: handle_put_begin() opens a temp file when
+    the header arrives, handle_put_data() writes body bytes as they
+    come off the socket, handle_put_end() renames it over the chunk
+    and acks. Memory use per upload is one recv buffer regardless
+    of size, except that a block going into a pack (at most
+    pack_max_bytes) is gathered in memory and appended whole.
+    A block older than the one stored (by generation) is
+    acked but dropped: a later upload has already replaced it.
+------------------------------------------------------ */
+int handle_put_begin(Connection *conn) {
+    conn->put_received = 0;
+    conn->put_fd = -1;
+    conn->put_failed = false;
+    conn->put_crc = 0;
+
+    if (!content_addressed && pack_max_bytes > 0 && conn->put_len <= pack_max_bytes) {
+        conn->put_packed = true;
+        conn->put_buf.clear();
+        conn->put_buf.reserve(conn->put_len);
+        return 0;
+    }
+
+    if (content_addressed) {
+        // The data goes to a temp object; the chunk keeps its old
+        // contents until the new reference replaces it
+        conn->put_path = temp_path();
+        conn->put_md = EVP_MD_CTX_new();
+        if (conn->put_md == NULL || EVP_DigestInit_ex(conn->put_md, EVP_sha256(), NULL) != 1) {
+            LOG(LOG_ERROR) << "Cannot start block hash";
+            conn->put_failed = true;
+            return -1;
+        }
+        conn->put_fd = open(conn->put_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (conn->put_fd < 0) {
+            perror("open failed");
+            conn->put_failed = true;
+            return -1;
+        }
+        return 0;
+    }
+
+    // The chunk keeps its old contents until the temp file replaces it
+    conn->put_path = temp_path();
+    LOG(LOG_DEBUG) << "Writing chunk " << conn->put_chunk << " of " << conn->put_filename << " to "
+                   << conn->put_path;
+
+    if (conn->put_chunk >= BLOCKS_PER_DIR && mkdir(bucket_path(conn->put_chunk).c_str(), 0777) < 0 &&
+        errno != EEXIST) {
+        perror("mkdir failed");
+    }
+
+    conn->put_fd = open(conn->put_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (conn->put_fd < 0) {
+        perror("open failed");
+        conn->put_failed = true;
+        return -1;
+    }
+    return 0;
+}
+
+int handle_put_data(Connection *conn, const char *buf, size_t len) {
+    if (conn->put_failed) return -1;
+
+    // Body bytes past the BlockInfo are the data
+    size_t skip = 0;
+    if (conn->put_received < BLOCK_INFO_SIZE) {
+        skip = min(len, (size_t)BLOCK_INFO_SIZE - conn->put_received);
+    }
+    conn->put_crc = crc32c(conn->put_crc, buf + skip, len - skip);
+
+    if (conn->put_packed) {
+        conn->put_buf.append(buf, len);
+        return 0;
+    }
+
+    if (conn->put_md != NULL) {
+        // An object is the data alone: the BlockInfo was kept in put_info
+        buf += skip;
+        len -= skip;
+        EVP_DigestUpdate(conn->put_md, buf, len);
+    }
+
+    while (len > 0) {
+        uint64_t start = now_us();
+        ssize_t n = write(conn->put_fd, buf, len);
+        disk_time(disk_write_us, start);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("write failed");
+            close(conn->put_fd);
+            conn->put_fd = -1;
+            unlink(conn->put_path.c_str());
+            conn->put_failed = true;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void log_superseded(const string &filename, int chunk_index) {
+    LOG(LOG_INFO) << "[PUT] Chunk " << chunk_index << " of " << filename
+                  << " is older than the stored one, keeping that";
+}
+
+// Turn a finished temp object into the chunk: store it under its
+// hash and point filename.N at it
+static int commit_object(Connection *conn) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    if (EVP_DigestFinal_ex(conn->put_md, digest, &digest_len) != 1 || digest_len != BLOCK_HASH_SIZE) {
+        unlink(conn->put_path.c_str());
+        return -1;
+    }
+    string hash((const char *)digest, digest_len);
+    if (store_object(conn->put_path, hash) < 0) {
+        return -1;
+    }
+
+    bool stored;
+    int ret = write_ref(conn->put_filename, conn->put_chunk, conn->put_info, hash, stored);
+    if (ret == 0 && stored) {
+        LOG(LOG_DEBUG) << "Stored chunk " << conn->put_chunk << " of " << conn->put_filename
+                       << " as object " << hex_hash(hash);
+    } else if (ret == 0) {
+        log_superseded(conn->put_filename, conn->put_chunk);
+    }
+    unpin_object(hash);
+    return ret;
+}
+
+int handle_put_end(Connection *conn) {
+    const char *failure = "Cannot store chunk";
+    if ((conn->put_fd >= 0 || conn->put_packed) && !conn->put_failed &&
+        conn->put_crc != conn->put_info.crc) {
+        LOG(LOG_WARN) << "[PUT] Chunk " << conn->put_chunk << " of " << conn->put_filename
+                      << " failed its checksum, discarding it";
+        if (conn->put_fd >= 0) {
+            close(conn->put_fd);
+            conn->put_fd = -1;
+            unlink(conn->put_path.c_str());
+        }
+        conn->put_failed = true;
+        failure = "Checksum mismatch";
+    }
+
+    if (conn->put_packed) {
+        bool stored = false;
+        if (!conn->put_failed && commit_packed(conn->put_filename, conn->put_chunk, conn->put_info,
+                                               conn->put_buf, stored) < 0) {
+            conn->put_failed = true;
+        } else if (!conn->put_failed && !stored) {
+            log_superseded(conn->put_filename, conn->put_chunk);
+        }
+        conn->put_packed = false;
+        string().swap(conn->put_buf);
+    } else if (conn->put_fd >= 0) {
+        struct stat st;
+        if (conn->put_md != NULL) {
+            close(conn->put_fd);
+            conn->put_fd = -1;
+            if (!conn->put_failed && commit_object(conn) < 0) {
+                conn->put_failed = true;
+            }
+        } else {
+            bool ok = !conn->put_failed && fstat(conn->put_fd, &st) == 0;
+            close(conn->put_fd);
+            conn->put_fd = -1;
+            bool stored = false;
+            if (!ok) {
+                unlink(conn->put_path.c_str());
+                conn->put_failed = true;
+            } else if (commit_chunk(conn->put_path, conn->put_filename, conn->put_chunk, st,
+                                    conn->put_info, "", stored) < 0) {
+                conn->put_failed = true;
+            } else if (!stored) {
+                log_superseded(conn->put_filename, conn->put_chunk);
+            }
+        }
+    }
+    if (conn->put_md != NULL) {
+        EVP_MD_CTX_free(conn->put_md);
+        conn->put_md = NULL;
+    }
+
+    LOG(LOG_DEBUG) << "[PUT] Received " << conn->put_received << " bytes total";
+
+    if (conn->put_failed) {
+        reply_error(conn, conn->req_id, failure);
+    } else {
+        begin_reply(conn, conn->req_id, OP_OK, 0, 0, true);
+    }
+    record_op(METRIC_PUT, conn->put_start_us, !conn->put_failed);
+    return conn->put_failed ? -1 : 0;
+}
+
+// Point filename.N at an object the client believes we already store
+int handle_put_ref(Connection *conn, unsigned int req_id, const string &filename, int chunk_index,
+                   const BlockInfo &info, const string &hash) {
+    if (!content_addressed) {
+        reply_error(conn, req_id, "Not content-addressed");
+        return -1;
+    }
+    if (!pin_object(hash)) {
+        // Gone since the client asked; it will send the data instead
+        begin_reply(conn, req_id, OP_NOT_FOUND, 0, 0, true);
+        return -1;
+    }
+
+    struct stat st;
+    bool stored = false;
+    int ret = -1;
+    if (stat(object_path(hash).c_str(), &st) == 0 && (uint64_t)st.st_size == info.length) {
+        ret = write_ref(filename, chunk_index, info, hash, stored);
+    }
+    if (ret == 0) {
+        if (stored) {
+            LOG(LOG_DEBUG) << "[PUT] Chunk " << chunk_index << " of " << filename << " refers to object "
+                           << hex_hash(hash);
+        } else {
+            log_superseded(filename, chunk_index);
+        }
+        begin_reply(conn, req_id, OP_OK, 0, 0, true);
+    } else {
+        reply_error(conn, req_id, "Cannot store chunk");
+    }
+    unpin_object(hash);
+    return ret;
+}
+
+// Answer which of a list of hashes are stored, one byte each
+int handle_have(Connection *conn, unsigned int req_id, const char *hashes, size_t count) {
+    if (!content_addressed) {
+        reply_error(conn, req_id, "Not content-addressed");
+        return -1;
+    }
+    string have(count, '\0');
+    pthread_rwlock_rdlock(&index_lock);
+    for (size_t i = 0; i < count; i++) {
+        string hash(hashes + i * BLOCK_HASH_SIZE, BLOCK_HASH_SIZE);
+        if (object_refs.count(hash)) have[i] = 1;
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    begin_reply(conn, req_id, OP_HAVE_LIST, 0, have.size(), true);
+    sender(conn, have.data(), have.size());
+    return 0;
+}
+
+// Headers of filename's blocks from index first on, as many as fit
+// in a control body; clients check their cached copies against them
+int handle_stat(Connection *conn, unsigned int req_id, const string &filename, uint32_t first) {
+    string reply;
+    bool more = false;
+    char buf[STAT_ENTRY];
+
+    pthread_rwlock_rdlock(&index_lock);
+    auto file = file_index.find(filename);
+    if (file != file_index.end()) {
+        for (auto chunk = file->second.lower_bound((int)min<uint32_t>(first, INT_MAX));
+             chunk != file->second.end(); ++chunk) {
+            if (chunk->second.legacy) continue;
+            if (reply.size() + STAT_ENTRY > PROTO_MAX_CONTROL) {
+                more = true;
+                break;
+            }
+            BlockInfo info = chunk->second.info;
+            info.flags &= ~BLOCK_REF;
+            put_u32((unsigned char *)buf, chunk->first);
+            encode_block_info(info, buf + 4);
+            reply.append(buf, STAT_ENTRY);
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    begin_reply(conn, req_id, OP_STAT_LIST, more ? LIST_MORE : 0, reply.size(), true);
+    sender(conn, reply.data(), reply.size());
+    return 0;
+}
+
+// Summarize the chunks shared with peer: bucket digests, or the
+// entries of the buckets listed
+int handle_summary(Connection *conn, unsigned int req_id, uint32_t peer,
+                   const vector<int> &buckets) {
+    if (self_index < 0) {
+        reply_error(conn, req_id, "No cluster configuration");
+        return -1;
+    }
+    vector<bool> wanted(SUMMARY_BUCKETS, false);
+    for (int b : buckets) wanted[b] = true;
+
+    vector<uint64_t> digests(SUMMARY_BUCKETS, 0);
+    string reply;
+    for (const LocalChunk &chunk : snapshot_chunks()) {
+        if (!shared_with(chunk, peer)) continue;
+        int b = summary_bucket(chunk.entry);
+        if (buckets.empty()) {
+            digests[b] ^= summary_digest(chunk.entry);
+        } else if (wanted[b]) {
+            encode_summary_entry(chunk.entry, reply);
+        }
+    }
+    if (buckets.empty()) {
+        reply.resize(SUMMARY_BUCKETS * 8);
+        for (int b = 0; b < SUMMARY_BUCKETS; b++) {
+            put_u64((unsigned char *)&reply[b * 8], digests[b]);
+        }
+    }
+
+    begin_reply(conn, req_id, OP_SUMMARY_LIST, 0, reply.size(), true);
+    sender(conn, reply.data(), reply.size());
+    return 0;
+}
+
+// Part of a block's data to send; the default is all of it
+struct ByteRange {
+    uint64_t offset;
+    uint64_t length;
+
+    ByteRange() : offset(0), length(UINT64_MAX) {}
+};
+
+// Read a block's data back; slice_crc gets the CRC32C of the len
+// bytes at skip, which is what goes out. With check the whole block
+// is read and compared with the CRC in its header, otherwise just
+// the slice. False if it can't be read or doesn't match; corrupt
+// tells which.
+static bool verify_block(int fd, off_t data_start, const BlockInfo &info, bool check,
+                         uint64_t skip, uint64_t len, uint32_t &slice_crc, bool &corrupt) {
+    static thread_local char buf[VERIFY_BUFSIZE];
+    uint32_t crc = 0;
+    slice_crc = 0;
+    corrupt = false;
+    uint64_t pos = check ? 0 : skip;
+    uint64_t end = check ? info.length : skip + len;
+    while (pos < end) {
+        size_t want = (size_t)min((uint64_t)sizeof(buf), end - pos);
+        uint64_t start = now_us();
+        ssize_t n = pread(fd, buf, want, data_start + pos);
+        disk_time(disk_read_us, start);
+        if (n <= 0) {
+            perror("pread failed");
+            return false;
+        }
+        crc = crc32c(crc, buf, n);
+        uint64_t lo = max(pos, skip), hi = min(pos + n, skip + len);
+        if (lo < hi) slice_crc = crc32c(slice_crc, buf + (lo - pos), hi - lo);
+        pos += n;
+    }
+    corrupt = check && crc != info.crc;
+    return !corrupt;
+}
+
+// GETs of blocks already verified, for sampling which to recheck
+static atomic<uint64_t> verified_gets(0);
+
+/* ------------------------------------------------------
+    HOT CACHE
+    A GET otherwise opens the chunk, reads its header and sends
+    the block with sendfile(). Blocks asked for again are kept in
+    memory, as the bytes that go on the wire (BlockInfo, then
+    data), up to hot_cache_budget bytes (-C) shared by every
+    reactor; a hit is sent straight from there without touching
+    the disk. A miss is only read into memory the second time
+    its key is seen (see hot_admit); the first time it goes out
+    by sendfile() like any other block.
+    Frames hold a reference, so evicting a block being sent is
+    safe, but the block then lives on outside the budget. So the
+    frames of all connections together may hold at most
+    hot_cache_budget bytes of blocks, and those of one connection
+    HOT_CONN_BLOCKS of the largest cacheable ones; past that a
+    block is sent from its file, hit or not.
+    Eviction is S3-FIFO, which a one-off scan of a large file
+    can't flush: new blocks enter a small FIFO holding
+    HOT_SMALL_PERCENT of the budget and only move on to the main
+    FIFO if they were hit while there. The rest are dropped but
+    their keys are remembered in a ghost FIFO, and a block coming
+    back while still remembered goes straight to main. Main is a
+    CLOCK: a block at its tail that was hit since it got there is
+    reinserted with its count lowered rather than dropped.
+    An entry is only used while the index still names the same
+    version of the chunk (generation and CRC), so an overwritten
+    block is never served; the stale copy ages out.
+------------------------------------------------------ */
+#define HOT_SMALL_PERCENT 10
+#define HOT_MAX_FREQ 3
+#define HOT_MAX_BLOCK_SHARE 8           // a block may fill at most 1/8 of the budget
+#define HOT_CONN_BLOCKS 2               // largest blocks one connection's frames may hold
+
+struct HotBlock {
+    string key;
+    shared_ptr<const string> bytes;     // BlockInfo + data, as sent whole
+    BlockInfo info;
+    int freq;                           // hits since it entered its FIFO, up to HOT_MAX_FREQ
+    bool main;                          // in the main FIFO rather than the small one
+};
+
+struct HotCache {
+    std::list<HotBlock> small, main;    // newest at the front
+    unordered_map<string, std::list<HotBlock>::iterator> entries;
+    std::list<string> ghost;            // keys recently dropped from small
+    unordered_map<string, std::list<string>::iterator> ghost_index;
+    std::list<string> seen;             // keys missed once, not yet admitted
+    unordered_map<string, std::list<string>::iterator> seen_index;
+    uint64_t small_bytes, main_bytes;
+
+    HotCache() : small_bytes(0), main_bytes(0) {}
+};
+
+HotCache hot_cache;
+pthread_mutex_t hot_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+atomic<uint64_t> hot_hits(0), hot_misses(0), hot_evictions(0);
+
+static string hot_key(const string &filename, int chunk_index) {
+    return filename + '\0' + to_string(chunk_index);
+}
+
+static bool hot_cacheable(uint64_t length) {
+    return hot_cache_budget > 0 && BLOCK_INFO_SIZE + length <= hot_cache_budget / HOT_MAX_BLOCK_SHARE;
+}
+
+// May conn queue another frame holding size bytes of a cached block?
+static bool hot_pin_ok(const Connection *conn, uint64_t size) {
+    uint64_t conn_limit = HOT_CONN_BLOCKS * (hot_cache_budget / HOT_MAX_BLOCK_SHARE);
+    return conn->mem_bytes + size <= conn_limit &&
+           pinned_bytes.load(memory_order_relaxed) + (int64_t)size <= (int64_t)hot_cache_budget;
+}
+
+static void hot_remember_locked(std::list<string> &keys, unordered_map<string, std::list<string>::iterator> &index,
+                                const string &key) {
+    keys.push_front(key);
+    index[key] = keys.begin();
+    // Remember about as many keys as there are blocks cached
+    size_t limit = max<size_t>(hot_cache.entries.size(), 64);
+    while (keys.size() > limit) {
+        index.erase(keys.back());
+        keys.pop_back();
+    }
+}
+
+static void hot_evict_locked() {
+    uint64_t small_limit = hot_cache_budget * HOT_SMALL_PERCENT / 100;
+    while (hot_cache.small_bytes + hot_cache.main_bytes > hot_cache_budget) {
+        if (!hot_cache.small.empty() && (hot_cache.small_bytes > small_limit || hot_cache.main.empty())) {
+            auto it = prev(hot_cache.small.end());
+            size_t size = it->bytes->size();
+            hot_cache.small_bytes -= size;
+            if (it->freq > 0) {
+                it->freq = 0;
+                it->main = true;
+                hot_cache.main.splice(hot_cache.main.begin(), hot_cache.small, it);
+                hot_cache.main_bytes += size;
+            } else {
+                hot_remember_locked(hot_cache.ghost, hot_cache.ghost_index, it->key);
+                hot_cache.entries.erase(it->key);
+                hot_cache.small.erase(it);
+                hot_evictions++;
+            }
+            continue;
+        }
+        auto it = prev(hot_cache.main.end());
+        if (it->freq > 0) {
+            it->freq--;
+            hot_cache.main.splice(hot_cache.main.begin(), hot_cache.main, it);
+            continue;
+        }
+        hot_cache.main_bytes -= it->bytes->size();
+        hot_cache.entries.erase(it->key);
+        hot_cache.main.erase(it);
+        hot_evictions++;
+    }
+}
+
+// The cached block if it is the version of the chunk the index
+// names (stored is the index entry's header)
+static shared_ptr<const string> hot_find(const string &filename, int chunk_index, const BlockInfo &stored,
+                                         BlockInfo &info) {
+    shared_ptr<const string> block;
+    pthread_mutex_lock(&hot_cache_lock);
+    auto found = hot_cache.entries.find(hot_key(filename, chunk_index));
+    if (found != hot_cache.entries.end()) {
+        HotBlock &entry = *found->second;
+        if (entry.info.generation == stored.generation && entry.info.crc == stored.crc) {
+            entry.freq = min(entry.freq + 1, HOT_MAX_FREQ);
+            block = entry.bytes;
+            info = entry.info;
+        }
+    }
+    pthread_mutex_unlock(&hot_cache_lock);
+    if (block) {
+        hot_hits++;
+    } else {
+        hot_misses++;
+    }
+    return block;
+}
+
+// Should a block that missed be read into memory? Only once it is
+// asked for again while its key is remembered: seen once before,
+// dropped from small (a ghost) or cached in an older version
+static bool hot_admit(const string &filename, int chunk_index) {
+    string key = hot_key(filename, chunk_index);
+    bool admit = true;
+    pthread_mutex_lock(&hot_cache_lock);
+    auto seen = hot_cache.seen_index.find(key);
+    if (seen != hot_cache.seen_index.end()) {
+        hot_cache.seen.erase(seen->second);
+        hot_cache.seen_index.erase(seen);
+    } else if (!hot_cache.ghost_index.count(key) && !hot_cache.entries.count(key)) {
+        hot_remember_locked(hot_cache.seen, hot_cache.seen_index, key);
+        admit = false;
+    }
+    pthread_mutex_unlock(&hot_cache_lock);
+    return admit;
+}
+
+static void hot_insert(const string &filename, int chunk_index, const BlockInfo &info,
+                       const shared_ptr<const string> &block) {
+    string key = hot_key(filename, chunk_index);
+    pthread_mutex_lock(&hot_cache_lock);
+    auto found = hot_cache.entries.find(key);
+    if (found != hot_cache.entries.end()) {
+        // A newer version of the block replaces the stale one in place
+        HotBlock &entry = *found->second;
+        uint64_t &bytes = entry.main ? hot_cache.main_bytes : hot_cache.small_bytes;
+        bytes += block->size() - entry.bytes->size();
+        entry.bytes = block;
+        entry.info = info;
+        entry.freq = 0;
+    } else {
+        HotBlock entry;
+        entry.key = key;
+        entry.bytes = block;
+        entry.info = info;
+        entry.freq = 0;
+        auto ghost = hot_cache.ghost_index.find(key);
+        entry.main = ghost != hot_cache.ghost_index.end();
+        if (entry.main) {
+            hot_cache.ghost.erase(ghost->second);
+            hot_cache.ghost_index.erase(ghost);
+            hot_cache.main.push_front(entry);
+            hot_cache.entries[key] = hot_cache.main.begin();
+            hot_cache.main_bytes += block->size();
+        } else {
+            hot_cache.small.push_front(entry);
+            hot_cache.entries[key] = hot_cache.small.begin();
+            hot_cache.small_bytes += block->size();
+        }
+    }
+    hot_evict_locked();
+    pthread_mutex_unlock(&hot_cache_lock);
+}
+
+// Read a whole block into memory as it goes on the wire and check
+// its CRC; null if it can't be read or doesn't match (corrupt)
+static shared_ptr<const string> load_block(int fd, off_t data_start, const BlockInfo &info,
+                                           bool &corrupt) {
+    corrupt = false;
+    shared_ptr<string> block = make_shared<string>(BLOCK_INFO_SIZE + info.length, '\0');
+    encode_block_info(info, &(*block)[0]);
+    uint64_t pos = 0;
+    uint64_t start = now_us();
+    while (pos < info.length) {
+        ssize_t n = pread(fd, &(*block)[BLOCK_INFO_SIZE + pos], info.length - pos, data_start + pos);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            perror("pread failed");
+            return nullptr;
+        }
+        pos += n;
+    }
+    disk_time(disk_read_us, start);
+    corrupt = crc32c(0, block->data() + BLOCK_INFO_SIZE, info.length) != info.crc;
+    if (corrupt) return nullptr;
+    return block;
+}
+
+// Queue a CHUNK for a block held in memory, cut to range like one
+// sent from its file
+static void send_memory_block(Connection *conn, unsigned int req_id, int chunk_index, BlockInfo info,
+                              const shared_ptr<const string> &block, const map<int, ByteRange> &wanted) {
+    ByteRange range;
+    auto w = wanted.find(chunk_index);
+    if (w != wanted.end() && info.codec == BLOCK_CODEC_NONE) range = w->second;
+    uint64_t skip = min(range.offset, info.length);
+    uint64_t len = min(range.length, info.length - skip);
+
+    begin_reply(conn, req_id, OP_CHUNK, chunk_index, BLOCK_INFO_SIZE + len, false);
+    if (skip == 0 && len == info.length) {
+        sender_memory(conn, block, 0, block->size());
+        return;
+    }
+    const char *data = block->data() + BLOCK_INFO_SIZE + skip;
+    char info_buf[BLOCK_INFO_SIZE];
+    info.offset += skip;
+    info.length = len;
+    info.crc = crc32c(0, data, len);
+    encode_block_info(info, info_buf);
+    sender(conn, info_buf, BLOCK_INFO_SIZE);
+    sender_memory(conn, block, BLOCK_INFO_SIZE + skip, len);
+}
+
+// A GET being answered. Its chunks are opened and queued a few at a
+// time as the ones before them go out (see pump_get), so a request
+// for hundreds of blocks holds no more than GET_OPEN_FILES of them
+// open and queued on its connection.
+struct GetStream {
+    unsigned int req_id;
+    string filename;
+    map<int, ByteRange> wanted;     // chunks (and the part of each) to send, empty = every chunk held
+    vector<pair<int, ChunkEntry> > chunks;  // snapshot of the index, taken when it starts
+    bool started;
+    size_t next;                    // first chunk of chunks not queued yet
+    bool found_any;
+    bool cancelled;                 // queue no more chunks, just the END
+    uint64_t start_us;              // when the request was parsed
+
+    GetStream() : req_id(0), started(false), next(0), found_any(false), cancelled(false), start_us(0) {}
+};
+
+// Snapshot a GET's chunks so no lock is held across open()
+static void get_snapshot(GetStream &get) {
+    pthread_rwlock_rdlock(&index_lock);
+    auto it = file_index.find(get.filename);
+    if (it != file_index.end() && get.wanted.empty()) {
+        for (const auto &chunk : it->second) {
+            get.chunks.push_back(chunk);
+        }
+    } else if (it != file_index.end()) {
+        for (const auto &w : get.wanted) {
+            auto chunk = it->second.find(w.first);
+            if (chunk != it->second.end()) get.chunks.push_back(*chunk);
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+    get.started = true;
+}
+
+// Queue one CHUNK of a GET; false if the chunk can't be sent
+static bool get_chunk(Connection *conn, const GetStream &get, const pair<int, ChunkEntry> &snapshot) {
+    int chunk_index = snapshot.first;
+    BlockInfo info;
+    const BlockInfo &stored = snapshot.second.info;
+    if (!snapshot.second.legacy && hot_cacheable(stored.length) &&
+        hot_pin_ok(conn, BLOCK_INFO_SIZE + stored.length)) {
+        shared_ptr<const string> block = hot_find(get.filename, chunk_index, stored, info);
+        if (block) {
+            LOG(LOG_DEBUG) << "Sending chunk " << chunk_index << " of " << get.filename << " from memory";
+            send_memory_block(conn, get.req_id, chunk_index, info, block, get.wanted);
+            return true;
+        }
+    }
+
+    string filepath = chunk_path(get.filename, chunk_index);
+
+    LOG(LOG_DEBUG) << "Opening file " << filepath << " for reading (chunk " << chunk_index << ")";
+
+    // The open fd pins this version of the chunk until it is sent;
+    // a packed chunk is the part of its pack from base on
+    off_t base, filesize;
+    int fd = open_chunk(get.filename, chunk_index, base, filesize);
+    if (fd < 0) {
+        perror("open failed");
+        return false;
+    }
+
+    // A block file already starts with its BlockInfo; a chunk from
+    // before striping gets one made up for it
+    char info_buf[BLOCK_INFO_SIZE];
+    string hash;
+    off_t data_start = base + BLOCK_INFO_SIZE;
+    bool legacy = !read_block_header(fd, info, hash, base);
+    if (legacy) {
+        info = BlockInfo();
+        info.flags = BLOCK_LEGACY;
+        info.length = filesize;
+        data_start = base;
+    } else if (!hash.empty()) {
+        // A reference: the data comes from the object store
+        struct stat st;
+        close(fd);
+        fd = open(object_path(hash).c_str(), O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            perror("open object failed");
+            if (fd >= 0) close(fd);
+            return false;
+        }
+        filesize = st.st_size;
+        info.flags &= ~BLOCK_REF;
+        base = data_start = 0;
+    }
+    if (!legacy && info.length != (uint64_t)(base + filesize - data_start)) {
+        LOG(LOG_WARN) << "Block " << filepath << " is truncated, skipping";
+        close(fd);
+        return false;
+    }
+
+    // Small enough to keep and asked for before: read it in once,
+    // check it and send it from memory from now on
+    if (!legacy && hot_cacheable(info.length) && hot_pin_ok(conn, BLOCK_INFO_SIZE + info.length) &&
+        hot_admit(get.filename, chunk_index)) {
+        bool corrupt;
+        shared_ptr<const string> block = load_block(fd, data_start, info, corrupt);
+        close(fd);
+        if (!block) {
+            LOG(LOG_WARN) << "Block " << filepath
+                          << (corrupt ? " failed its checksum" : " could not be read") << ", skipping";
+            if (corrupt) index_remove_corrupt(get.filename, chunk_index, info);
+            return false;
+        }
+        hot_insert(get.filename, chunk_index, info, block);
+        LOG(LOG_DEBUG) << "Sending chunk " << chunk_index << " of " << get.filename
+                       << " (" << info.length << " bytes)";
+        send_memory_block(conn, get.req_id, chunk_index, info, block, get.wanted);
+        return true;
+    }
+
+    // Cut the data down to the requested range, if any; compressed
+    // data only goes out whole
+    ByteRange range;
+    auto w = get.wanted.find(chunk_index);
+    if (w != get.wanted.end() && info.codec == BLOCK_CODEC_NONE) range = w->second;
+    uint64_t skip = min(range.offset, info.length);
+    uint64_t len = min(range.length, info.length - skip);
+    bool whole = (skip == 0 && len == info.length);
+    // A block is read back in full and checked the first time it
+    // is sent; after that only one GET in GET_VERIFY_SAMPLE does
+    // so again, and the rest read no more than a partial range
+    bool verified = !legacy && snapshot.second.verified && info.generation == stored.generation &&
+                    info.crc == stored.crc;
+    bool check = !legacy && (!verified || verified_gets++ % GET_VERIFY_SAMPLE == 0);
+    uint32_t slice_crc = info.crc;
+    bool corrupt;
+    if ((check || !whole || legacy) &&
+        !verify_block(fd, data_start, info, check, skip, len, slice_crc, corrupt)) {
+        // A bad copy is dropped so the client goes to another
+        // replica; a failed read may just be this once
+        LOG(LOG_WARN) << "Block " << filepath << (corrupt ? " failed its checksum" : " could not be read")
+                      << ", skipping";
+        if (corrupt) index_remove_corrupt(get.filename, chunk_index, info);
+        close(fd);
+        return false;
+    }
+    if (check && !verified) index_mark_verified(get.filename, chunk_index, info);
+    info.offset += skip;
+    info.length = len;
+    info.crc = slice_crc;
+
+    LOG(LOG_DEBUG) << "Sending chunk " << chunk_index << " of " << get.filename
+                   << " (" << len << " bytes)";
+
+    // CHUNK frame carrying the chunk index; the body comes from the file,
+    // stored header included when the whole block goes out
+    begin_reply(conn, get.req_id, OP_CHUNK, chunk_index, BLOCK_INFO_SIZE + len, false);
+    if (data_start == base || !whole) {
+        encode_block_info(info, info_buf);
+        sender(conn, info_buf, BLOCK_INFO_SIZE);
+        sender_file(conn, fd, data_start + skip, len);
+    } else {
+        sender_file(conn, fd, base, filesize);
+    }
+    return true;
+}
+
+// Queue more of the connection's GETs, oldest first, while it has
+// fewer than GET_OPEN_FILES chunk files open and less than
+// OUTBUF_HIGH_WATER bytes waiting; called again as frames go out.
+// A finished GET gets its END (or NOT_FOUND if nothing was found).
+static void pump_get(Connection *conn) {
+    while (!conn->gets.empty()) {
+        GetStream *get = conn->gets.front();
+        if (!get->started) get_snapshot(*get);
+        while (!get->cancelled && get->next < get->chunks.size()) {
+            if (conn->open_files >= GET_OPEN_FILES || conn->out_bytes >= OUTBUF_HIGH_WATER) return;
+            if (get_chunk(conn, *get, get->chunks[get->next++])) get->found_any = true;
+        }
+
+        if (!get->found_any && !get->cancelled) {
+            begin_reply(conn, get->req_id, OP_NOT_FOUND, 0, 0, true);
+            LOG(LOG_DEBUG) << "No chunks found for " << get->filename;
+        } else {
+            begin_reply(conn, get->req_id, OP_END, 0, 0, true);
+        }
+        record_op(METRIC_GET, get->start_us, get->found_any || get->cancelled);
+        conn->gets.pop_front();
+        delete get;
+    }
+}
+
+/* ------------------------------------------------------
+    METRICS REPORT
+    One "name value" line per counter, e.g.
+        uptime_s 3600
+        get.count 1200
+        get.latency_us 9:4 10:31 ...
+    where a latency line lists the non-empty histogram buckets
+    as bucket:count (see stats.h). Counters only grow; gauges
+    (connections_open, queued_bytes, hot_cache_bytes) are as of
+    now. dfc stats adds up the reports of every server.
+------------------------------------------------------ */
+int handle_metrics(Connection *conn, unsigned int req_id) {
+    string report;
+    auto line = [&report](const string &name, uint64_t value) {
+        report += name + " " + to_string(value) + "\n";
+    };
+    line("uptime_s", time(NULL) - started_at);
+    line("connections_open", max<int64_t>(connections_open.load(), 0));
+    line("connections_total", connections_total);
+    line("queued_bytes", max<int64_t>(queued_bytes.load(), 0));
+    line("bytes_in", bytes_in);
+    line("bytes_out", bytes_out);
+    line("disk_read_us", disk_read_us);
+    line("disk_write_us", disk_write_us);
+    line("hot_cache_hits", hot_hits);
+    line("hot_cache_misses", hot_misses);
+    line("hot_cache_evictions", hot_evictions);
+    pthread_mutex_lock(&hot_cache_lock);
+    line("hot_cache_bytes", hot_cache.small_bytes + hot_cache.main_bytes);
+    pthread_mutex_unlock(&hot_cache_lock);
+
+    for (int op = 0; op < METRIC_OPS; op++) {
+        const OpMetrics &m = op_metrics[op];
+        string name = metric_op_names[op];
+        line(name + ".count", m.count);
+        line(name + ".errors", m.errors);
+        report += name + ".latency_us";
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            uint64_t n = m.latency[b].load(memory_order_relaxed);
+            if (n > 0) report += " " + to_string(b) + ":" + to_string(n);
+        }
+        report += "\n";
+    }
+
+    begin_reply(conn, req_id, OP_METRICS_REPORT, 0, report.size(), true);
+    sender(conn, report.data(), report.size());
+    return 0;
+}
+
+/* ------------------------------------------------------
+    ROUTER
+    Requests are binary frames (see protocol.h). Every request
+    carries a client-chosen id that is echoed back in the
+    response so the client can match replies on a long-lived
+    session. frame_ready() says when a whole request is buffered:
+    for PUT that is the header, name and the body's BlockInfo,
+    since the rest is streamed to disk in CONN_READ_BODY; every
+    other request is buffered whole. LIST queues its full
+    response immediately; a GET queues its chunks as the
+    connection drains (see pump_get), and later requests with a
+    reply of their own wait until it is done, so replies still
+    go out in order. CANCEL has no reply of its own: it drops the
+    unsent chunks of an earlier get, whose END is still delivered.
 ------------------------------------------------------ */
-int sender(struct sockaddr_in *clientaddr, int sockfd, const char *buf, int buflen) {
-    ssize_t bytes_sent = send(sockfd, buf, buflen, 0);
-    if (bytes_sent < 0) {
-        perror("ERROR in sendto");
+// 1 = a whole request is buffered, 0 = need more bytes,
+// -1 = not a frame we accept
+static int frame_ready(const RecvBuffer &in, FrameHeader &hdr) {
+    if (in.size() < FRAME_HEADER_SIZE) return 0;
+    if (!decode_frame_header(in.data(), hdr)) {
+        LOG(LOG_WARN) << "Invalid frame header";
+        return -1;
+    }
+    if (hdr.name_len > PROTO_MAX_NAME) {
+        LOG(LOG_WARN) << "File name too long (" << hdr.name_len << " bytes)";
+        return -1;
+    }
+
+    size_t need = FRAME_HEADER_SIZE + hdr.name_len;
+    if (hdr.opcode == OP_PUT) {
+        // The BlockInfo at the front of the body is checked before streaming
+        if (hdr.body_len < BLOCK_INFO_SIZE) {
+            LOG(LOG_WARN) << "PUT body too short (" << hdr.body_len << " bytes)";
+            return -1;
+        }
+        need += BLOCK_INFO_SIZE;
+    } else {
+        if (hdr.body_len > PROTO_MAX_CONTROL) {
+            LOG(LOG_WARN) << "Request body too long (" << hdr.body_len << " bytes)";
+            return -1;
+        }
+        need += hdr.body_len;
+    }
+    return in.size() >= need ? 1 : 0;
+}
+
+static bool valid_chunk_target(const string &filename, int chunk_index) {
+    return !filename.empty() && filename.find('/') == string::npos && filename != ".." &&
+           filename.find('\0') == string::npos && chunk_index >= 0;
+}
+
+// Returns -1 only for malformed requests, after which the session is dropped
+int router(Connection *conn, const FrameHeader &hdr) {
+    const char *name_buf = conn->inbuf.data() + FRAME_HEADER_SIZE;
+    string filename(name_buf, hdr.name_len);
+    const char *body = name_buf + hdr.name_len;
+    unsigned int req_id = hdr.req_id;
+    uint64_t start = now_us();
+
+    LOG(LOG_DEBUG) << "Receiver message: " << opcode_name(hdr.opcode) << " " << req_id
+                   << (filename.empty() ? "" : " ") << filename;
+
+    if (hdr.opcode == OP_LIST) {
+        string after_name;
+        long long after_chunk = -1;
+        if (hdr.body_len >= 4) {
+            after_chunk = get_u32((const unsigned char *)body);
+            after_name.assign(body + 4, hdr.body_len - 4);
+        }
+        conn->inbuf.consume(FRAME_HEADER_SIZE + hdr.name_len + hdr.body_len);
+        handle_list(conn, req_id, filename, after_name, after_chunk, hdr.arg);
+        record_op(METRIC_LIST, start, true);
+        return 0;
+    }
+    else if (hdr.opcode == OP_PUT) {
+        BlockInfo info;
+        bool valid_info = decode_block_info(body, info) && info.length == hdr.body_len - BLOCK_INFO_SIZE;
+
+        // The body, BlockInfo included, is stored verbatim
+        conn->inbuf.consume(FRAME_HEADER_SIZE + hdr.name_len);
+        int chunk_index = (int)hdr.arg;
+
+        if (!valid_info) {
+            LOG(LOG_WARN) << "Invalid block header in PUT of " << filename;
+            return -1;
+        }
+
+        if (!valid_chunk_target(filename, chunk_index)) {
+            LOG(LOG_WARN) << "Invalid PUT target: " << filename;
+            return -1;
+        }
+
+        // Refuse oversized bodies up front rather than read them
+        if (hdr.body_len > max_chunk_size) {
+            LOG(LOG_WARN) << "[PUT] Rejecting " << hdr.body_len << " byte chunk (limit "
+                          << max_chunk_size << ")";
+            reply_error(conn, req_id, "Chunk too large");
+            record_op(METRIC_PUT, start, false);
+            return -1;
+        }
+
+        LOG(LOG_DEBUG) << "[PUT] Receiving " << hdr.body_len << " bytes for " << filename
+                       << " (chunk " << chunk_index << ")";
+
+        conn->req_id = req_id;
+        conn->put_filename = filename;
+        conn->put_chunk = chunk_index;
+        conn->put_len = hdr.body_len;
+        conn->put_info = info;
+        conn->put_start_us = start;
+        handle_put_begin(conn);
+        conn->state = CONN_READ_BODY;
+        return 0;
+    }
+    else if (hdr.opcode == OP_GET) {
+        const unsigned char *p = (const unsigned char *)body;
+        size_t entry = (hdr.arg == GET_RANGES) ? GET_RANGE_ENTRY : 4;
+        if (hdr.body_len % entry != 0) {
+            LOG(LOG_WARN) << "Invalid GET chunk list";
+            return -1;
+        }
+        map<int, ByteRange> wanted;
+        for (size_t off = 0; off < hdr.body_len; off += entry) {
+            ByteRange &range = wanted[(int)get_u32(p + off)];
+            if (hdr.arg == GET_RANGES) {
+                range.offset = get_u64(p + off + 4);
+                range.length = get_u64(p + off + 12);
+            }
+        }
+        conn->inbuf.consume(FRAME_HEADER_SIZE + hdr.name_len + hdr.body_len);
+        GetStream *get = new GetStream();
+        get->req_id = req_id;
+        get->filename = filename;
+        get->wanted.swap(wanted);
+        get->start_us = start;
+        conn->gets.push_back(get);
+        pump_get(conn);
+        return 0;
+    }
+    else if (hdr.opcode == OP_PUT_REF) {
+        BlockInfo info;
+        int chunk_index = (int)hdr.arg;
+        if (hdr.body_len != BLOCK_INFO_SIZE + BLOCK_HASH_SIZE || !decode_block_info(body, info) ||
+            !valid_chunk_target(filename, chunk_index)) {
+            LOG(LOG_WARN) << "Invalid PUT_REF of " << filename;
+            return -1;
+        }
+        string hash(body + BLOCK_INFO_SIZE, BLOCK_HASH_SIZE);
+        info.flags &= ~BLOCK_REF;
+        conn->inbuf.consume(FRAME_HEADER_SIZE + hdr.name_len + hdr.body_len);
+        int ret = handle_put_ref(conn, req_id, filename, chunk_index, info, hash);
+        record_op(METRIC_PUT, start, ret == 0);
+        return 0;
+    }
+    else if (hdr.opcode == OP_HAVE) {
+        if (hdr.body_len % BLOCK_HASH_SIZE != 0) {
+            LOG(LOG_WARN) << "Invalid HAVE hash list";
+            return -1;
+        }
+        string hashes(body, hdr.body_len);
+        conn->inbuf.consume(FRAME_HEADER_SIZE + hdr.name_len + hdr.body_len);
+        handle_have(conn, req_id, hashes.data(), hashes.size() / BLOCK_HASH_SIZE);
+        return 0;
+    }
+    else if (hdr.opcode == OP_SUMMARY) {
+        if (hdr.body_len % 2 != 0) {
+            LOG(LOG_WARN) << "Invalid SUMMARY bucket list";
+            return -1;
+        }
+        vector<int> buckets;
+        for (size_t off = 0; off < hdr.body_len; off += 2) {
+            int b = get_u16((const unsigned char *)body + off);
+            if (b < SUMMARY_BUCKETS) buckets.push_back(b);
+        }
+        conn->inbuf.consume(FRAME_HEADER_SIZE + hdr.name_len + hdr.body_len);
+        handle_summary(conn, req_id, hdr.arg, buckets);
+        return 0;
+    }
+    else if (hdr.opcode == OP_STAT) {
+        conn->inbuf.consume(FRAME_HEADER_SIZE + hdr.name_len + hdr.body_len);
+        handle_stat(conn, req_id, filename, hdr.arg);
+        record_op(METRIC_STAT, start, true);
+        return 0;
+    }
+    else if (hdr.opcode == OP_METRICS) {
+        conn->inbuf.consume(FRAME_HEADER_SIZE + hdr.name_len + hdr.body_len);
+        handle_metrics(conn, req_id);
+        return 0;
+    }
+    else if (hdr.opcode == OP_CANCEL) {
+        conn->inbuf.consume(FRAME_HEADER_SIZE + hdr.name_len + hdr.body_len);
+        for (GetStream *get : conn->gets) {
+            if (get->req_id == hdr.arg) get->cancelled = true;
+        }
+        cancel_frames(conn, hdr.arg);
+        pump_get(conn);
+        return 0;
+    }
+    else {
+        LOG(LOG_WARN) << "Unknown opcode: " << (int)hdr.opcode;
         return -1;
     }
-    return bytes_sent;
 }
 
 /* ------------------------------------------------------
-    COMMAND HANDLERS
+    REACTOR
 ------------------------------------------------------ */
-int handle_list(struct sockaddr_in *clientaddr, int sockfd) {
-    DIR *dir = opendir(directory_path.c_str());
-    if (dir == NULL) {
-        perror("opendir failed");
-        return -1;
+// Each reactor binds its own listening socket; SO_REUSEPORT lets the
+// kernel spread incoming connections across them.
+static int create_listener(int port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) {
+        error("ERROR opening socket");
     }
 
-    struct dirent *entry;
-    string response = "";
-    
-    while ((entry = readdir(dir)) != NULL) {
-        if (entry->d_name[0] == '.') continue; // skip . and .. files
-        response += entry->d_name;
-        response += "\n";
+    int optval = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
+               (const void *)&optval, sizeof(int));
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+               (const void *)&optval, sizeof(int));
+
+    struct sockaddr_in serveraddr;
+    bzero((char *)&serveraddr, sizeof(serveraddr));
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.sin_port = htons((unsigned short)port);
+
+    if (::bind(sockfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
+        error("ERROR on binding");
     }
 
-    closedir(dir);
-    
-    if (!response.empty()) {
-        response.pop_back(); // Remove trailing comma
+    if (listen(sockfd, SOMAXCONN) < 0) {
+        error("ERROR on listen");
     }
-    
-    sender(clientaddr, sockfd, response.c_str(), response.length());
-    return 0;
+    return sockfd;
 }
 
-int handle_put(struct sockaddr_in *clientaddr, int sockfd, const string &filename,
-               int chunk_index, const char *filecontents, int contentlen) {
-    // Store with chunk index in filename: filename.chunk_index
-    string filepath = directory_path + "/" + filename + "." + to_string(chunk_index);
+static bool output_pending(Connection *conn) {
+    return !conn->outq.empty() || !conn->gets.empty();
+}
 
-    cout << "Opening file " << filepath << " for writing" << endl;
+// Stop reading new requests while a slow reader has a large backlog,
+// and hold a request with a reply of its own behind unfinished GETs
+static bool input_paused(Connection *conn) {
+    if (conn->out_bytes > OUTBUF_HIGH_WATER || conn->gets.size() >= GET_QUEUE_MAX) return true;
+    FrameHeader hdr;
+    return !conn->gets.empty() && conn->state == CONN_READ_HEADER && frame_ready(conn->inbuf, hdr) > 0 &&
+           hdr.opcode != OP_GET && hdr.opcode != OP_CANCEL;
+}
 
-    // Open for write (overwrite if exists)
-    FILE *fp = fopen(filepath.c_str(), "wb");
-    if (fp == NULL) {
-        perror("fopen failed");
-        return -1;
+static void update_events(Reactor *r, Connection *conn) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    if ((conn->state == CONN_READ_HEADER || conn->state == CONN_READ_BODY) && !input_paused(conn)) {
+        ev.events |= EPOLLIN;
+    }
+    if (output_pending(conn)) {
+        ev.events |= EPOLLOUT;
     }
+    ev.data.ptr = conn;
+    epoll_ctl(r->epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
 
-    size_t written = fwrite(filecontents, 1, contentlen, fp);
-    if (written < (size_t)contentlen) {
-        perror("fwrite failed");
-        fclose(fp);
-        return -1;
+static void close_connection(Reactor *r, Connection *conn) {
+    for (auto &frame : conn->outq) {
+        release_frame(conn, frame);
     }
-    fclose(fp);
+    queue_bytes(conn, -(int64_t)conn->out_bytes);
+    for (GetStream *get : conn->gets) {
+        delete get;
+    }
+    connections_open.fetch_sub(1, memory_order_relaxed);
+    if (conn->put_fd >= 0) {
+        // Upload cut short: drop its temp file
+        close(conn->put_fd);
+        unlink(conn->put_path.c_str());
+    }
+    if (conn->put_md != NULL) {
+        EVP_MD_CTX_free(conn->put_md);
+    }
+    epoll_ctl(r->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    delete conn;
+}
 
-    return 0;
+static void accept_connections(Reactor *r) {
+    while (1) {
+        struct sockaddr_in clientaddr;
+        socklen_t clientlen = sizeof(clientaddr);
+        int clientfd = accept4(r->listenfd, (struct sockaddr *)&clientaddr,
+                               &clientlen, SOCK_NONBLOCK);
+        if (clientfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("ERROR on accept");
+            return;
+        }
+
+        Connection *conn = new Connection();
+        conn->fd = clientfd;
+        conn->addr = clientaddr;
+        connections_open.fetch_add(1, memory_order_relaxed);
+        connections_total.fetch_add(1, memory_order_relaxed);
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, clientfd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(clientfd);
+            connections_open.fetch_sub(1, memory_order_relaxed);
+            delete conn;
+        }
+    }
 }
 
-int handle_get(struct sockaddr_in *clientaddr, int sockfd, const string &filename) {
-    // Find all chunks for this file (filename.0, filename.1, etc.)
-    DIR *dir = opendir(directory_path.c_str());
-    if (dir == NULL) {
-        perror("opendir failed");
-        const char *error_msg = "ERROR: Cannot open directory\n";
-        sender(clientaddr, sockfd, error_msg, strlen(error_msg));
-        return -1;
+// Hand body bytes of an in-flight PUT to the chunk file; returns how
+// many of them belonged to the body
+static size_t feed_body(Connection *conn, const char *buf, size_t len) {
+    size_t want = conn->put_len - conn->put_received;
+    size_t take = (len < want) ? len : want;
+    handle_put_data(conn, buf, take);
+    conn->put_received += take;
+
+    if (conn->put_received == conn->put_len) {
+        handle_put_end(conn);
+        conn->state = CONN_READ_HEADER;
     }
+    return take;
+}
 
-    bool found_any = false;
-    struct dirent *entry;
+// Consume buffered body bytes for an in-flight PUT
+static void consume_body(Connection *conn) {
+    size_t take = feed_body(conn, conn->inbuf.data(), conn->inbuf.size());
+    conn->inbuf.consume(take);
+}
 
-    while ((entry = readdir(dir)) != NULL) {
-        string entry_name = entry->d_name;
-
-        // Check if this file starts with our filename and has a chunk suffix
-        // Format: filename.N where N is the chunk index
-        if (entry_name.length() > filename.length() + 1 &&
-            entry_name.substr(0, filename.length()) == filename &&
-            entry_name[filename.length()] == '.') {
-
-            string suffix = entry_name.substr(filename.length() + 1);
-            // Check if suffix is a number (chunk index)
-            bool is_chunk = !suffix.empty();
-            for (char c : suffix) {
-                if (!isdigit(c)) {
-                    is_chunk = false;
-                    break;
-                }
+// Run every complete request sitting in inbuf
+static void process_input(Connection *conn) {
+    while (!input_paused(conn)) {
+        if (conn->state == CONN_READ_HEADER) {
+            FrameHeader hdr;
+            int ready = frame_ready(conn->inbuf, hdr);
+            if (ready == 0) return;
+            if (ready < 0 || router(conn, hdr) < 0) {
+                // Unparseable request: the stream can't be resynchronised
+                conn->state = CONN_DRAINING;
+                return;
             }
+        } else if (conn->state == CONN_READ_BODY) {
+            if (conn->inbuf.empty() && conn->put_received < conn->put_len) return;
+            consume_body(conn);
+        } else {
+            return;
+        }
+    }
+}
 
-            if (!is_chunk) continue;
+// Copy a file region through user space when sendfile() can't be
+// used on this file system
+static ssize_t send_file_fallback(Connection *conn, OutFrame &frame, size_t len) {
+    char buf[RECV_BUFSIZE];
+    size_t want = (len < sizeof(buf)) ? len : sizeof(buf);
+    ssize_t r = pread(frame.file_fd, buf, want, frame.file_off);
+    if (r <= 0) {
+        errno = (r == 0) ? EIO : errno;
+        return -1;
+    }
+    ssize_t n = send(conn->fd, buf, r, MSG_NOSIGNAL);
+    if (n > 0) frame.file_off += n;
+    return n;
+}
 
-            int chunk_index = stoi(suffix);
-            string filepath = directory_path + "/" + entry_name;
+/* ------------------------------------------------------
+    Flush queued frames. Headers go out with MSG_MORE (a per-call
+    TCP_CORK) so they share a segment with the data behind them;
+    chunk data moves file -> socket with sendfile(), never
+    touching user space.
+------------------------------------------------------ */
+static void on_writable(Connection *conn) {
+    static thread_local bool sendfile_broken = false;
 
-            cout << "Opening file " << filepath << " for reading (chunk " << chunk_index << ")" << endl;
+    while (!conn->outq.empty()) {
+        OutFrame &frame = conn->outq.front();
+        ssize_t n;
 
-            FILE *fp = fopen(filepath.c_str(), "rb");
-            if (fp == NULL) {
-                perror("fopen failed");
-                continue;
+        if (conn->out_off < frame.data.size()) {
+            bool more = frame.file_len > 0 || conn->outq.size() > 1;
+            n = send(conn->fd, frame.data.data() + conn->out_off,
+                     frame.data.size() - conn->out_off, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        } else if (frame.mem) {
+            n = send(conn->fd, frame.mem->data() + frame.file_off, frame.size() - conn->out_off,
+                     MSG_NOSIGNAL | (conn->outq.size() > 1 ? MSG_MORE : 0));
+            if (n > 0) frame.file_off += n;
+        } else {
+            size_t left = frame.size() - conn->out_off;
+            if (!sendfile_broken) {
+                n = sendfile(conn->fd, frame.file_fd, &frame.file_off, left);
+                if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    sendfile_broken = true;
+                    continue;
+                }
+            } else {
+                n = send_file_fallback(conn, frame, left);
+            }
+            if (n == 0) {
+                // Chunk file shrank under us; the stream can't be repaired
+                LOG(LOG_ERROR) << "Chunk file truncated while sending";
+                conn->state = CONN_CLOSED;
+                return;
             }
+        }
 
-            fseek(fp, 0, SEEK_END);
-            long filesize = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            perror("ERROR in send");
+            conn->state = CONN_CLOSED;
+            return;
+        }
+        conn->out_off += n;
+        queue_bytes(conn, -n);
+        bytes_out.fetch_add(n, memory_order_relaxed);
+        if (conn->out_off == frame.size()) {
+            release_frame(conn, frame);
+            conn->outq.pop_front();
+            conn->out_off = 0;
+            pump_get(conn);
+        }
+    }
+}
 
-            char *filebuf = (char*)malloc(filesize);
-            if (!filebuf) {
-                perror("malloc failed");
-                fclose(fp);
-                continue;
+static void on_readable(Connection *conn) {
+    char buf[RECV_BUFSIZE];
+    while ((conn->state == CONN_READ_HEADER || conn->state == CONN_READ_BODY) && !input_paused(conn)) {
+        ssize_t n = recv(conn->fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            perror("ERROR in recv");
+            conn->state = CONN_CLOSED;
+            return;
+        }
+        if (n == 0) {
+            if (conn->state == CONN_READ_BODY) {
+                LOG(LOG_WARN) << "Connection closed while receiving data";
             }
+            conn->state = CONN_DRAINING;
+            return;
+        }
 
-            size_t read_bytes = fread(filebuf, 1, filesize, fp);
-            fclose(fp);
+        LOG(LOG_DEBUG) << "server " << portno << " received " << n << " bytes";
+        bytes_in.fetch_add(n, memory_order_relaxed);
 
-            if (read_bytes < (size_t)filesize) {
-                perror("fread failed");
-                free(filebuf);
-                continue;
-            }
+        // Body bytes go straight from the recv buffer to disk
+        size_t used = 0;
+        if (conn->state == CONN_READ_BODY && conn->inbuf.empty()) {
+            used = feed_body(conn, buf, n);
+        }
+        conn->inbuf.append(buf + used, n - used);
+        process_input(conn);
+    }
+}
 
-            // Send header: CHUNK <chunk_index> <size>\n
-            char header[64];
-            int header_len = snprintf(header, sizeof(header), "CHUNK %d %ld\n", chunk_index, filesize);
+static void reactor_loop(Reactor *r) {
+    struct epoll_event events[MAX_EVENTS];
 
-            cout << "Sending chunk " << chunk_index << " of " << filename
-                 << " (" << filesize << " bytes)" << endl;
+    while (1) {
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return;
+        }
 
-            if (sender(clientaddr, sockfd, header, header_len) < 0) {
-                free(filebuf);
-                closedir(dir);
-                return -1;
+        for (int i = 0; i < n; i++) {
+            Connection *conn = (Connection*)events[i].data.ptr;
+            if (conn == NULL) {
+                accept_connections(r);
+                continue;
             }
 
-            // Send chunk data
-            char *p = filebuf;
-            long remaining = filesize;
-            while (remaining > 0) {
-                size_t to_send = (remaining > BUFSIZE) ? BUFSIZE : remaining;
-                ssize_t bytes_sent = sender(clientaddr, sockfd, p, to_send);
-                if (bytes_sent < 0) {
-                    free(filebuf);
-                    closedir(dir);
-                    return -1;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                if (conn->state == CONN_READ_HEADER || conn->state == CONN_READ_BODY) {
+                    on_readable(conn);
+                } else if (events[i].events & EPOLLERR) {
+                    conn->state = CONN_CLOSED;
+                }
+            }
+            if (conn->state != CONN_CLOSED && output_pending(conn)) {
+                on_writable(conn);
+                // Draining the backlog may let a paused session read again
+                if (conn->state == CONN_READ_HEADER || conn->state == CONN_READ_BODY) {
+                    process_input(conn);
                 }
-                p += to_send;
-                remaining -= to_send;
+            }
+            if (conn->state == CONN_DRAINING && !output_pending(conn)) {
+                conn->state = CONN_CLOSED;
             }
 
-            free(filebuf);
-            found_any = true;
+            if (conn->state == CONN_CLOSED) {
+                close_connection(r, conn);
+            } else {
+                update_events(r, conn);
+            }
         }
     }
+}
 
-    closedir(dir);
+static void start_reactor(Reactor *r) {
+    r->listenfd = create_listener(portno);
+    r->epfd = epoll_create1(0);
+    if (r->epfd < 0) {
+        error("ERROR on epoll_create");
+    }
 
-    if (!found_any) {
-        const char *error_msg = "FILE_NOT_FOUND\n";
-        sender(clientaddr, sockfd, error_msg, strlen(error_msg));
-        cout << "No chunks found for " << filename << endl;
-        return -1;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listenfd, &ev) < 0) {
+        error("ERROR on epoll_ctl");
     }
+}
 
-    // Send end marker
-    const char *end_msg = "END\n";
-    sender(clientaddr, sockfd, end_msg, strlen(end_msg));
+/* ------------------------------------------------------
+    REPAIR
+    With -r a background thread reconciles this server's chunks
+    with every peer each repair_interval seconds:
+    - Chunks both should hold: bucket digests are compared (see
+      SUMMARIES); for buckets that differ the peer's entries are
+      fetched, and it is sent each chunk it lacks or holds an
+      older copy of (by generation, then CRC). The peer's own
+      round repairs the other direction.
+    - Chunks that no longer belong here (the cluster changed):
+      each goes to its homes that lack it and is deleted here
+      once all of them hold a copy at least as new.
+    Chunks travel as ordinary PUTs (a reference is sent with its
+    object's data), so the peer checks their CRC as usual. They
+    are paced to repair_rate bytes per second to leave the
+    network to clients. A lost erasure-coded block is not
+    rebuilt: that takes k other blocks of its stripe.
+------------------------------------------------------ */
+struct PeerLink {
+    int fd;
+    unsigned int next_req_id;
+    const ServerAddress *peer;
 
-    return 0;
+    PeerLink() : fd(-1), next_req_id(1), peer(NULL) {}
+    ~PeerLink() { if (fd >= 0) close(fd); }
+};
+
+// Spreads repair traffic out to repair_rate bytes per second
+struct Throttle {
+    struct timespec start;
+    uint64_t sent;
+
+    Throttle() : sent(0) { clock_gettime(CLOCK_MONOTONIC, &start); }
+
+    void spend(size_t n) {
+        sent += n;
+        if (repair_rate == 0) return;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+        double ahead = (double)sent / repair_rate - elapsed;
+        if (ahead > 0) usleep((useconds_t)(ahead * 1e6));
+    }
+};
+
+static bool peer_connect(PeerLink &link, const ServerAddress &peer) {
+    link.peer = &peer;
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(peer.ip.c_str(), to_string(peer.port).c_str(), &hints, &res) != 0) {
+        LOG(LOG_WARN) << "[REPAIR] Cannot resolve " << peer.ip;
+        return false;
+    }
+    link.fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct timeval tv = {PEER_TIMEOUT_SEC, 0};
+    if (link.fd >= 0) {
+        setsockopt(link.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(link.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    bool ok = link.fd >= 0 && connect(link.fd, res->ai_addr, res->ai_addrlen) == 0;
+    freeaddrinfo(res);
+    if (!ok) {
+        LOG(LOG_INFO) << "[REPAIR] " << peer.name << " is unreachable, skipping it this round";
+    }
+    return ok;
 }
 
-int router(char *buf, int buflen, struct sockaddr_in *clientaddr, int sockfd) {
-    if (buflen < 1) {
-        cerr << "Empty command received" << endl;
-        return -1;
+static bool send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
     }
+    return true;
+}
 
-    if (strncmp(buf, "list", 4) == 0) {
-        return handle_list(clientaddr, sockfd);
+static bool recv_all(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        len -= n;
     }
-    else if (strncmp(buf, "put ", 4) == 0) {
-        // Parse: put <filename> <chunk_index> <data_length>\n
-        char filename[256];
-        int chunk_index;
-        size_t data_len;
+    return true;
+}
 
-        int parsed = sscanf(buf, "put %s %d %zu", filename, &chunk_index, &data_len);
-        if (parsed != 3) {
-            cerr << "Invalid PUT command format: " << buf << endl;
-            return -1;
+// Wait for the reply to the last request; false if the link broke
+static bool peer_reply(PeerLink &link, FrameHeader &hdr, string &body) {
+    char buf[FRAME_HEADER_SIZE];
+    if (!recv_all(link.fd, buf, sizeof(buf)) || !decode_frame_header(buf, hdr) ||
+        hdr.body_len > PEER_MAX_REPLY) {
+        return false;
+    }
+    body.resize(hdr.name_len + hdr.body_len);
+    if (!recv_all(link.fd, &body[0], body.size())) return false;
+    body.erase(0, hdr.name_len);
+    return true;
+}
+
+static bool peer_call(PeerLink &link, uint8_t opcode, uint32_t arg, const string &body,
+                      FrameHeader &hdr, string &reply) {
+    string frame = encode_frame(opcode, link.next_req_id++, arg, "", body.size()) + body;
+    return send_all(link.fd, frame.data(), frame.size()) && peer_reply(link, hdr, reply);
+}
+
+// The peer's entries in the given buckets of its summary for scope
+// (our number, or SUMMARY_ANY); false if it can't say
+static bool peer_entries(PeerLink &link, uint32_t scope, const set<int> &buckets,
+                         map<pair<string, int>, SummaryEntry> &entries) {
+    string body;
+    for (int b : buckets) {
+        unsigned char buf[2];
+        put_u16(buf, b);
+        body.append((const char *)buf, 2);
+    }
+    FrameHeader hdr;
+    string reply;
+    vector<SummaryEntry> list;
+    if (!peer_call(link, OP_SUMMARY, scope, body, hdr, reply) || hdr.opcode != OP_SUMMARY_LIST ||
+        !decode_summary_entries(reply, list)) {
+        return false;
+    }
+    for (const SummaryEntry &e : list) {
+        entries[make_pair(e.filename, e.chunk_index)] = e;
+    }
+    return true;
+}
+
+static bool newer(const SummaryEntry &a, const SummaryEntry &b) {
+    return a.generation > b.generation || (a.generation == b.generation && a.crc > b.crc);
+}
+
+// Whether the peer's copy (if any) is as good as ours
+static bool peer_has(const map<pair<string, int>, SummaryEntry> &theirs, const SummaryEntry &e) {
+    auto it = theirs.find(make_pair(e.filename, e.chunk_index));
+    if (it == theirs.end()) return false;
+    return summary_digest(it->second) == summary_digest(e) || !newer(e, it->second);
+}
+
+// PUT a chunk to the peer. False if the link broke; stored says
+// whether the peer took it.
+static bool push_chunk(PeerLink &link, Throttle &throttle, const SummaryEntry &e, bool &stored) {
+    stored = false;
+    off_t base, size;
+    int fd = open_chunk(e.filename, e.chunk_index, base, size);
+    if (fd < 0) return true;     // gone since the snapshot
+    BlockInfo info;
+    string hash;
+    off_t data_start = base + BLOCK_INFO_SIZE;
+    if (!read_block_header(fd, info, hash, base)) {
+        close(fd);
+        return true;
+    }
+    if (!hash.empty()) {
+        close(fd);
+        fd = open(object_path(hash).c_str(), O_RDONLY);
+        if (fd < 0) return true;
+        info.flags &= ~BLOCK_REF;
+        data_start = 0;
+    }
+
+    char header[BLOCK_INFO_SIZE];
+    encode_block_info(info, header);
+    string frame = encode_frame(OP_PUT, link.next_req_id++, e.chunk_index, e.filename,
+                                BLOCK_INFO_SIZE + info.length);
+    frame.append(header, BLOCK_INFO_SIZE);
+    bool ok = send_all(link.fd, frame.data(), frame.size());
+
+    char buf[RECV_BUFSIZE];
+    uint64_t pos = 0;
+    while (ok && pos < info.length) {
+        size_t want = (size_t)min((uint64_t)sizeof(buf), info.length - pos);
+        ssize_t n = pread(fd, buf, want, data_start + pos);
+        // A short file leaves the frame unfinished: drop the link
+        ok = n > 0 && send_all(link.fd, buf, n);
+        if (ok) {
+            throttle.spend(n);
+            pos += n;
         }
+    }
+    close(fd);
+
+    FrameHeader hdr;
+    string reply;
+    if (!ok || !peer_reply(link, hdr, reply)) return false;
+    stored = (hdr.opcode == OP_OK);
+    LOG(LOG_INFO) << "[REPAIR] " << (stored ? "Sent" : "Failed to send") << " chunk " << e.chunk_index
+                  << " of " << e.filename << " to " << link.peer->name;
+    return true;
+}
 
-        cout << "[PUT] Receiving " << data_len << " bytes for " << filename
-             << " (chunk " << chunk_index << ")" << endl;
+// Bring a peer's copies of the chunks we both should hold up to date
+static void repair_peer(int p, const vector<LocalChunk> &chunks, Throttle &throttle) {
+    PeerLink link;
+    if (!peer_connect(link, cluster[p])) return;
 
-        // Find where the header ends (after the newline)
-        char *data_start = strchr(buf, '\n');
-        if (!data_start) {
-            cerr << "Invalid PUT format: no newline in header" << endl;
-            return -1;
+    vector<uint64_t> digests(SUMMARY_BUCKETS, 0);
+    for (const LocalChunk &chunk : chunks) {
+        if (shared_with(chunk, p)) digests[summary_bucket(chunk.entry)] ^= summary_digest(chunk.entry);
+    }
+
+    FrameHeader hdr;
+    string reply;
+    if (!peer_call(link, OP_SUMMARY, self_index, "", hdr, reply) || hdr.opcode != OP_SUMMARY_LIST ||
+        reply.size() != SUMMARY_BUCKETS * 8) {
+        LOG(LOG_WARN) << "[REPAIR] No summary from " << cluster[p].name;
+        return;
+    }
+    set<int> differ;
+    for (int b = 0; b < SUMMARY_BUCKETS; b++) {
+        if (get_u64((const unsigned char *)reply.data() + b * 8) != digests[b]) differ.insert(b);
+    }
+    if (differ.empty()) return;
+
+    map<pair<string, int>, SummaryEntry> theirs;
+    if (!peer_entries(link, self_index, differ, theirs)) {
+        LOG(LOG_WARN) << "[REPAIR] No entries from " << cluster[p].name;
+        return;
+    }
+    for (const LocalChunk &chunk : chunks) {
+        if (!shared_with(chunk, p) || !differ.count(summary_bucket(chunk.entry)) ||
+            peer_has(theirs, chunk.entry)) {
+            continue;
         }
-        data_start++; // Move past the newline
+        bool stored;
+        if (!push_chunk(link, throttle, chunk.entry, stored)) return;
+    }
+}
 
-        // Calculate how much data was already received with the header
-        size_t header_len = data_start - buf;
-        size_t already_received = buflen - header_len;
+// Delete a chunk that was moved to its homes, unless it changed since
+static void drop_moved_chunk(const SummaryEntry &e) {
+    pthread_rwlock_wrlock(&index_lock);
+    auto file = file_index.find(e.filename);
+    bool same = false;
+    if (file != file_index.end()) {
+        auto chunk = file->second.find(e.chunk_index);
+        same = chunk != file->second.end() && chunk->second.info.crc == e.crc &&
+               chunk->second.info.generation == e.generation;
+        if (same && chunk->second.pack < 0) unlink(chunk_path(e.filename, e.chunk_index).c_str());
+    }
+    if (same) index_remove_locked(e.filename, e.chunk_index, true);
+    pthread_rwlock_unlock(&index_lock);
+    flush_pack_records();
+    if (same) {
+        LOG(LOG_INFO) << "[REPAIR] Moved chunk " << e.chunk_index << " of " << e.filename
+                      << " to its home servers";
+    }
+}
 
-        // Allocate buffer for file data
-        char *filecontents = (char*)malloc(data_len);
-        if (!filecontents) {
-            perror("malloc failed");
-            return -1;
+// Hand chunks that no longer belong here to the servers they belong on
+static void rebalance(const vector<LocalChunk> &chunks, Throttle &throttle) {
+    map<int, vector<const LocalChunk *> > by_home;
+    for (const LocalChunk &chunk : chunks) {
+        if (chunk.homes.empty() || holds_home(chunk.homes, self_index)) continue;
+        for (int h : chunk.homes) by_home[h].push_back(&chunk);
+    }
+
+    map<const LocalChunk *, size_t> placed;
+    for (auto &home : by_home) {
+        PeerLink link;
+        if (!peer_connect(link, cluster[home.first])) continue;
+        set<int> buckets;
+        for (const LocalChunk *chunk : home.second) buckets.insert(summary_bucket(chunk->entry));
+        map<pair<string, int>, SummaryEntry> theirs;
+        if (!peer_entries(link, SUMMARY_ANY, buckets, theirs)) continue;
+
+        for (const LocalChunk *chunk : home.second) {
+            bool stored = peer_has(theirs, chunk->entry);
+            if (!stored && !push_chunk(link, throttle, chunk->entry, stored)) break;
+            if (stored) placed[chunk]++;
         }
+    }
+    for (auto &p : placed) {
+        if (p.second == p.first->homes.size()) drop_moved_chunk(p.first->entry);
+    }
+}
 
-        // Copy data that came with the header
-        size_t total_received = 0;
-        if (already_received > 0) {
-            size_t to_copy = (already_received > data_len) ? data_len : already_received;
-            memcpy(filecontents, data_start, to_copy);
-            total_received = to_copy;
+static void repair_loop() {
+    while (true) {
+        sleep(repair_interval);
+        vector<LocalChunk> chunks = snapshot_chunks();
+        Throttle throttle;
+        for (int p = 0; p < (int)cluster.size(); p++) {
+            if (p != self_index) repair_peer(p, chunks, throttle);
         }
+        rebalance(chunks, throttle);
+    }
+}
 
-        // Read remaining data
-        while (total_received < data_len) {
-            ssize_t n = recv(sockfd, filecontents + total_received, data_len - total_received, 0);
-            if (n <= 0) {
-                if (n == 0) {
-                    cerr << "Connection closed while receiving data" << endl;
-                } else {
-                    perror("recv failed");
-                }
-                free(filecontents);
-                return -1;
+// Read the cluster from a dfc.conf-style file and find ourselves in
+// it: by name (the directory's base name), else by port
+static int load_cluster(const char *path) {
+    ifstream conf(path);
+    if (!conf) {
+        perror("cluster configuration");
+        return -1;
+    }
+    bool use_ring = false;
+    int vnodes = DEFAULT_VNODES;
+    string line;
+    while (getline(conf, line)) {
+        char key[64], value[64];
+        if (sscanf(line.c_str(), "%63s %63s", key, value) == 2) {
+            if (strcmp(key, "placement") == 0) {
+                use_ring = strcmp(value, "ring") == 0;
+                continue;
+            }
+            if (strcmp(key, "vnodes") == 0) {
+                if (atoi(value) > 0) vnodes = atoi(value);
+                continue;
             }
-            total_received += n;
         }
+        ServerAddress server;
+        if (parse_server_line(line, server)) {
+            cluster.push_back(server);
+        }
+    }
 
-        cout << "[PUT] Received " << total_received << " bytes total" << endl;
-
-        int result = handle_put(clientaddr, sockfd, filename, chunk_index, filecontents, data_len);
-        free(filecontents);
-        return result;
+    string base = directory_path;
+    while (base.size() > 1 && base[base.size() - 1] == '/') base.erase(base.size() - 1);
+    base = base.substr(base.rfind('/') + 1);
+    for (size_t i = 0; i < cluster.size() && self_index < 0; i++) {
+        if (cluster[i].name == base) self_index = i;
     }
-    else if (strncmp(buf, "get ", 4) == 0) {
-        string filename = buf + 4;
-        // Remove trailing newline if present
-        size_t newline_pos = filename.find('\n');
-        if (newline_pos != string::npos) {
-            filename = filename.substr(0, newline_pos);
-        }
-        return handle_get(clientaddr, sockfd, filename);
+    for (size_t i = 0; i < cluster.size() && self_index < 0; i++) {
+        if (cluster[i].port == portno) self_index = i;
     }
-    else {
-        cerr << "Unknown command: " << buf << endl;
-        cerr << "Receiver message: " << buf << endl;
+    if (self_index < 0) {
+        LOG(LOG_ERROR) << "This server (" << base << ", port " << portno << ") is not in " << path;
         return -1;
     }
+    if (use_ring) build_ring(cluster, vnodes);
+    return 0;
+}
+
+// SIGUSR1 logs one level more, SIGUSR2 one level less
+static void on_log_signal(int sig) {
+    int level = log_level.load(std::memory_order_relaxed) + (sig == SIGUSR1 ? 1 : -1);
+    if (level >= LOG_ERROR && level <= LOG_DEBUG) {
+        log_level.store(level, std::memory_order_relaxed);
+    }
 }
 
 /* ------------------------------------------------------
     MAIN
 ------------------------------------------------------ */
 int main(int argc, char *argv[]) {
-    int sockfd, portno, n;
-    struct sockaddr_in serveraddr;
-    struct sockaddr_in clientaddr;
-    int optval;
+    int workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    const char *usage = " <directory> <port> [-w workers] [-m max_chunk_bytes] [-c] [-p max_packed_bytes]"
+                        " [-C hot_cache_bytes] [-l error|warn|info|debug]"
+                        " [-r cluster.conf [-i repair_seconds] [-b repair_KB_per_sec]]";
+    const char *cluster_conf = NULL;
 
-    if (argc < 3) {
-        cerr << "usage: " << argv[0] << " <directory> <port>" << endl;
+    while ((opt = getopt(argc, argv, "w:m:cp:C:l:r:i:b:")) != -1) {
+        switch (opt) {
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'm':
+            max_chunk_size = strtoull(optarg, NULL, 10);
+            break;
+        case 'c':
+            content_addressed = true;
+            break;
+        case 'p':
+            pack_max_bytes = strtoull(optarg, NULL, 10);
+            break;
+        case 'C':
+            hot_cache_budget = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            if (!log_set_level(optarg)) {
+                cerr << "usage: " << argv[0] << usage << endl;
+                exit(0);
+            }
+            break;
+        case 'r':
+            cluster_conf = optarg;
+            break;
+        case 'i':
+            repair_interval = max(1, atoi(optarg));
+            break;
+        case 'b':
+            repair_rate = strtoull(optarg, NULL, 10) * 1024;
+            break;
+        default:
+            cerr << "usage: " << argv[0] << usage << endl;
+            exit(0);
+        }
+    }
+
+    if (argc - optind < 2) {
+        cerr << "usage: " << argv[0] << usage << endl;
         exit(0);
     }
+    if (workers < 1) workers = 1;
+
+    directory_path = argv[optind];
+    log_start();
+    atexit(log_stop);
 
-    directory_path = argv[1];
-    
     // Check if directory exists, create if not
     DIR *dir = opendir(directory_path.c_str());
     if (dir == NULL) {
@@ -322,74 +3204,61 @@ int main(int argc, char *argv[]) {
         closedir(dir);
     }
 
-    portno = atoi(argv[2]);
-    
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        error("ERROR opening socket");
+    if (init_temp_dir() < 0 || (content_addressed && init_object_store() < 0)) {
+        exit(1);
     }
-    
-    optval = 1;
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, 
-               (const void *)&optval, sizeof(int));
-    
-    bzero((char *)&serveraddr, sizeof(serveraddr));
-    serveraddr.sin_family = AF_INET;
-    serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serveraddr.sin_port = htons((unsigned short)portno);
-    
-    if (::bind(sockfd, (struct sockaddr *)&serveraddr, sizeof(serveraddr)) < 0) {
-        error("ERROR on binding");
+
+    if (build_chunk_index() < 0) {
+        exit(1);
+    }
+    if (content_addressed && pack_max_bytes > 0) {
+        LOG(LOG_WARN) << "Packing (-p) does not apply to a content-addressed store (-c); ignoring it";
+        pack_max_bytes = 0;
+    }
+    // Packs written under -p stay readable without it
+    if ((pack_max_bytes > 0 || access(pack_dir().c_str(), F_OK) == 0) && load_packs() < 0) {
+        exit(1);
     }
 
-    if (listen(sockfd, 5) < 0) {
-        error("ERROR on listen");
+    portno = atoi(argv[optind + 1]);
+    started_at = time(NULL);
+
+    if (cluster_conf != NULL && load_cluster(cluster_conf) < 0) {
+        exit(1);
     }
 
-    cout << "DFS Server listening on port " << portno 
-         << ", serving directory: " << directory_path << endl;
+    // A peer closing mid-response must not take the whole server down
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, on_log_signal);
+    signal(SIGUSR2, on_log_signal);
 
-    while (1) {
-        int clientlen = sizeof(clientaddr);
-        char buf[BUFSIZE];
-        
-        cout << "Waiting for new connection..." << endl;
-        
-        int clientfd = accept(sockfd, (struct sockaddr *)&clientaddr, 
-                             (socklen_t *)&clientlen);
-        if (clientfd < 0) {
-            error("ERROR on accept");
-        }
-        
-        bzero(buf, BUFSIZE);
-        n = recv(clientfd, buf, BUFSIZE, 0);
-        
-        if (n < 0) {
-            error("ERROR in recvfrom");
-        }
-        
-        cout << "server " << portno << " received " << n << " bytes" << endl;
-        cerr << "Receiver message: " << buf << endl;
+    // Bind every listener up front so port errors surface before we serve
+    vector<Reactor> reactors(workers);
+    for (int i = 0; i < workers; i++) {
+        reactors[i].id = i;
+        start_reactor(&reactors[i]);
+    }
 
-        // Fork to handle request
-        pid_t process_id = fork();
-        if (process_id < 0) {
-            perror("Fork failed");
-            close(clientfd);
-            continue;
-        }
-        
-        if (process_id == 0) {
-            // Child process
-            close(sockfd); // Close the listening socket in child
-            router(buf, n, &clientaddr, clientfd);
-            close(clientfd); // Close client socket
-            exit(0); // Terminate child process
-        } else {
-            // Parent process
-            close(clientfd); // Close client socket in parent
-            cout << "Forked process " << process_id << " to handle request" << endl;
-        }
+    LOG(LOG_INFO) << "DFS Server listening on port " << portno
+                  << ", serving directory: " << directory_path
+                  << " (" << workers << " reactors)";
+
+    vector<thread> threads;
+    for (int i = 1; i < workers; i++) {
+        threads.push_back(thread(reactor_loop, &reactors[i]));
+    }
+    if (self_index >= 0) {
+        LOG(LOG_INFO) << "Repairing with " << cluster.size() - 1 << " peers every " << repair_interval
+                      << "s as " << cluster[self_index].name;
+        thread(repair_loop).detach();
     }
+    if (pack_index_fd >= 0) {
+        thread(compact_loop).detach();
+    }
+    reactor_loop(&reactors[0]);
 
+    for (auto &t : threads) {
+        t.join();
+    }
     return 0;
 }
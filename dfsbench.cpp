@@ -0,0 +1,623 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <ctime>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <ftw.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "stats.h"
+
+using namespace std;
+
+/* ------------------------------------------------------
+    DFSBENCH
+    Load generator for a dfs cluster. It starts N local dfs
+    instances (or targets running ones) and has a number of
+    workers run the real dfc binary against them, each in a
+    directory of its own, picking list, put or get per the
+    configured mix. Every operation is timed end to end, dfc
+    start-up included, so changes to either dfc or dfs show up.
+    Results are printed as JSON on stdout, progress and errors
+    on stderr.
+
+    A get picks a file some earlier put stored and checks the
+    size of what comes back. Once max_files names exist, puts
+    overwrite one of them with new contents of the same size,
+    so a get never races a put into a size mismatch.
+------------------------------------------------------ */
+#define DEFAULT_SERVERS 4
+#define DEFAULT_PORT 13001
+#define DEFAULT_WORKERS 4
+#define DEFAULT_SECONDS 10
+#define DEFAULT_PRELOAD 8
+#define DEFAULT_MAX_FILES 64
+#define SERVER_START_MS 5000
+#define FILL_BUFFER (1 << 20)
+
+enum BenchOp { BENCH_LIST, BENCH_PUT, BENCH_GET, BENCH_OPS };
+static const char *bench_op_names[BENCH_OPS] = {"list", "put", "get"};
+
+struct SizeClass {
+    uint64_t low, high;         // uniform in [low, high]
+    double weight;
+};
+
+struct BenchConfig {
+    int servers;                // local servers to start (0 = use targets)
+    string dfs_path;
+    string dfs_args;
+    int base_port;
+    vector<pair<string, int> > targets;
+    string dfc_path;
+    vector<string> conf_lines;  // extra dfc.conf lines
+    int workers;
+    double seconds;
+    uint64_t max_ops;           // 0 = run for seconds
+    string size_spec;
+    vector<SizeClass> sizes;
+    double read_ratio;          // gets among gets and puts
+    double list_ratio;          // lists among all operations
+    int preload;
+    int max_files;
+    string work_dir;
+    bool keep;
+
+    BenchConfig() : servers(DEFAULT_SERVERS), dfs_path("./dfs"), base_port(DEFAULT_PORT),
+                    dfc_path("./dfc"), workers(DEFAULT_WORKERS), seconds(DEFAULT_SECONDS),
+                    max_ops(0), size_spec("1M"), read_ratio(0.5), list_ratio(0.05),
+                    preload(DEFAULT_PRELOAD), max_files(DEFAULT_MAX_FILES), keep(false) {}
+};
+
+static BenchConfig bench;
+
+struct OpStats {
+    uint64_t count, errors, bytes;
+    uint64_t total_us, max_us;
+    uint64_t latency[LAT_BUCKETS];
+
+    OpStats() : count(0), errors(0), bytes(0), total_us(0), max_us(0) {
+        memset(latency, 0, sizeof(latency));
+    }
+};
+
+struct Worker {
+    int id;
+    string dir;
+    mt19937_64 rng;
+    uint64_t seq;
+    OpStats stats[BENCH_OPS];
+};
+
+struct StoredFile {
+    string name;
+    uint64_t size;
+};
+
+// Files some put has stored, and the sizes a get should see
+static vector<StoredFile> catalog;
+static mutex catalog_lock;
+static atomic<uint64_t> ops_started(0);
+static atomic<bool> stopping(false);
+static vector<pid_t> server_pids;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void on_stop_signal(int) {
+    stopping.store(true);
+}
+
+/* ------------------------------------------------------
+    OPTIONS
+------------------------------------------------------ */
+static uint64_t parse_size(const char *value, const char **rest) {
+    char *end;
+    uint64_t size = strtoull(value, &end, 10);
+    if (*end == 'K' || *end == 'k') size <<= 10, end++;
+    else if (*end == 'M' || *end == 'm') size <<= 20, end++;
+    else if (*end == 'G' || *end == 'g') size <<= 30, end++;
+    if (rest != NULL) *rest = end;
+    return size;
+}
+
+// "1M" (fixed), "4K-64M" (uniform) or "4K:50,1M:40,64M-256M:10"
+// (weighted classes, each fixed or uniform)
+static bool parse_sizes(const string &spec, vector<SizeClass> &sizes) {
+    sizes.clear();
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t comma = spec.find(',', start);
+        if (comma == string::npos) comma = spec.size();
+        string part = spec.substr(start, comma - start);
+        const char *p = part.c_str();
+        SizeClass c;
+        c.low = c.high = parse_size(p, &p);
+        if (*p == '-') c.high = parse_size(p + 1, &p);
+        c.weight = 1;
+        if (*p == ':') c.weight = strtod(p + 1, (char **)&p);
+        if (*p != '\0' || c.low == 0 || c.high < c.low || c.weight <= 0) return false;
+        sizes.push_back(c);
+        start = comma + 1;
+    }
+    return !sizes.empty();
+}
+
+static bool parse_targets(const string &spec, vector<pair<string, int> > &targets) {
+    size_t start = 0;
+    while (start <= spec.size()) {
+        size_t comma = spec.find(',', start);
+        if (comma == string::npos) comma = spec.size();
+        string part = spec.substr(start, comma - start);
+        size_t colon = part.rfind(':');
+        if (colon == string::npos || atoi(part.c_str() + colon + 1) <= 0) return false;
+        targets.push_back(make_pair(part.substr(0, colon), atoi(part.c_str() + colon + 1)));
+        start = comma + 1;
+    }
+    return !targets.empty();
+}
+
+static uint64_t pick_size(Worker *w) {
+    double total = 0;
+    for (const auto &c : bench.sizes) total += c.weight;
+    double x = uniform_real_distribution<double>(0, total)(w->rng);
+    const SizeClass *chosen = &bench.sizes.back();
+    for (const auto &c : bench.sizes) {
+        if (x < c.weight) {
+            chosen = &c;
+            break;
+        }
+        x -= c.weight;
+    }
+    return uniform_int_distribution<uint64_t>(chosen->low, chosen->high)(w->rng);
+}
+
+/* ------------------------------------------------------
+    PROCESSES
+------------------------------------------------------ */
+// Start args in dir with its output going to log (or nowhere)
+static pid_t spawn(const vector<string> &args, const string &dir, const string &log) {
+    vector<char *> argv;
+    for (const auto &a : args) argv.push_back((char *)a.c_str());
+    argv.push_back(NULL);
+    const char *out = log.empty() ? "/dev/null" : log.c_str();
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open(out, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (chdir(dir.c_str()) < 0 || fd < 0) _exit(127);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        close(fd);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+// Exit status of args run in dir, or -1 if it could not run
+static int run(const vector<string> &args, const string &dir) {
+    pid_t pid = spawn(args, dir, "");
+    if (pid < 0) return -1;
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool make_absolute(string &path) {
+    char resolved[PATH_MAX];
+    if (realpath(path.c_str(), resolved) == NULL) {
+        perror(path.c_str());
+        return false;
+    }
+    path = resolved;
+    return true;
+}
+
+static bool port_open(const string &host, int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    bool ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return ok;
+}
+
+static void stop_servers() {
+    for (pid_t pid : server_pids) kill(pid, SIGTERM);
+    for (pid_t pid : server_pids) waitpid(pid, NULL, 0);
+    server_pids.clear();
+}
+
+static int start_servers() {
+    for (int i = 0; i < bench.servers; i++) {
+        int port = bench.base_port + i;
+        string dir = bench.work_dir + "/dfs" + to_string(i + 1);
+        vector<string> args = {bench.dfs_path, dir, to_string(port)};
+        char word[256];
+        const char *p = bench.dfs_args.c_str();
+        int n;
+        while (sscanf(p, "%255s%n", word, &n) == 1) {
+            args.push_back(word);
+            p += n;
+        }
+        pid_t pid = spawn(args, ".", bench.work_dir + "/dfs" + to_string(i + 1) + ".log");
+        if (pid < 0) {
+            perror("fork");
+            return -1;
+        }
+        server_pids.push_back(pid);
+        bench.targets.push_back(make_pair(string("127.0.0.1"), port));
+    }
+    for (const auto &t : bench.targets) {
+        uint64_t deadline = now_us() + SERVER_START_MS * 1000;
+        while (!port_open(t.first, t.second)) {
+            if (now_us() > deadline) {
+                cerr << "dfs on port " << t.second << " did not come up; see " << bench.work_dir << endl;
+                return -1;
+            }
+            usleep(10000);
+        }
+    }
+    return 0;
+}
+
+static int write_client_conf(const string &dir) {
+    string path = dir + "/dfc.conf";
+    FILE *f = fopen(path.c_str(), "w");
+    if (f == NULL) {
+        perror(path.c_str());
+        return -1;
+    }
+    for (size_t i = 0; i < bench.targets.size(); i++) {
+        fprintf(f, "server dfs%zu %s:%d\n", i + 1, bench.targets[i].first.c_str(), bench.targets[i].second);
+    }
+    fprintf(f, "log warn\n");
+    for (const auto &line : bench.conf_lines) fprintf(f, "%s\n", line.c_str());
+    fclose(f);
+    return 0;
+}
+
+static int remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+    remove(path);
+    return 0;
+}
+
+/* ------------------------------------------------------
+    WORKLOAD
+------------------------------------------------------ */
+// Contents no earlier put has used, so dedup cannot skip the upload
+static bool write_file(Worker *w, const string &path, uint64_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    vector<uint64_t> buf(FILL_BUFFER / sizeof(uint64_t));
+    uint64_t x = w->rng() | 1;
+    while (size > 0) {
+        for (auto &word : buf) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            word = x;
+        }
+        size_t len = min(size, (uint64_t)FILL_BUFFER);
+        if (write(fd, buf.data(), len) != (ssize_t)len) {
+            close(fd);
+            return false;
+        }
+        size -= len;
+    }
+    close(fd);
+    return true;
+}
+
+static void record(Worker *w, int op, uint64_t start_us, bool ok, uint64_t bytes) {
+    uint64_t us = now_us() - start_us;
+    OpStats &s = w->stats[op];
+    s.count++;
+    s.total_us += us;
+    s.max_us = max(s.max_us, us);
+    s.latency[lat_bucket(us)]++;
+    if (ok) {
+        s.bytes += bytes;
+    } else {
+        s.errors++;
+    }
+}
+
+static void do_put(Worker *w, bool measured) {
+    StoredFile file;
+    bool overwrite = false;
+    {
+        lock_guard<mutex> hold(catalog_lock);
+        if ((int)catalog.size() >= bench.max_files) {
+            file = catalog[w->rng() % catalog.size()];
+            overwrite = true;
+        }
+    }
+    if (!overwrite) {
+        file.name = "bench-" + to_string(w->id) + "-" + to_string(w->seq++);
+        file.size = pick_size(w);
+    }
+    string path = w->dir + "/" + file.name;
+    if (!write_file(w, path, file.size)) {
+        perror(path.c_str());
+        stopping.store(true);
+        return;
+    }
+
+    uint64_t start = now_us();
+    bool ok = run({bench.dfc_path, "put", file.name}, w->dir) == 0;
+    if (measured) record(w, BENCH_PUT, start, ok, file.size);
+    unlink(path.c_str());
+    if (ok && !overwrite) {
+        lock_guard<mutex> hold(catalog_lock);
+        catalog.push_back(file);
+    }
+}
+
+static void do_get(Worker *w) {
+    StoredFile file;
+    {
+        lock_guard<mutex> hold(catalog_lock);
+        if (catalog.empty()) return;
+        file = catalog[w->rng() % catalog.size()];
+    }
+    string path = w->dir + "/" + file.name;
+    unlink(path.c_str());
+
+    uint64_t start = now_us();
+    bool ok = run({bench.dfc_path, "get", file.name}, w->dir) == 0;
+    struct stat st;
+    ok = ok && stat(path.c_str(), &st) == 0 && (uint64_t)st.st_size == file.size;
+    record(w, BENCH_GET, start, ok, file.size);
+    unlink(path.c_str());
+}
+
+static void do_list(Worker *w) {
+    uint64_t start = now_us();
+    bool ok = run({bench.dfc_path, "list"}, w->dir) == 0;
+    record(w, BENCH_LIST, start, ok, 0);
+}
+
+static void worker_loop(Worker *w, uint64_t end_us) {
+    uniform_real_distribution<double> coin(0, 1);
+    while (!stopping.load() && now_us() < end_us) {
+        if (bench.max_ops > 0 && ops_started.fetch_add(1) >= bench.max_ops) break;
+        if (coin(w->rng) < bench.list_ratio) {
+            do_list(w);
+        } else if (coin(w->rng) < bench.read_ratio) {
+            do_get(w);
+        } else {
+            do_put(w, true);
+        }
+    }
+}
+
+/* ------------------------------------------------------
+    REPORT
+------------------------------------------------------ */
+// A bucket's upper bound can overshoot the largest value seen
+static unsigned long long percentile(const OpStats &s, double p) {
+    return min(lat_percentile(s.latency, p), s.max_us);
+}
+
+static void print_op(const char *name, const OpStats &s, double seconds, bool last) {
+    printf("    \"%s\": {\"count\": %llu, \"errors\": %llu, \"bytes\": %llu, "
+           "\"ops_per_sec\": %.2f, \"mb_per_sec\": %.2f,\n", name, (unsigned long long)s.count,
+           (unsigned long long)s.errors, (unsigned long long)s.bytes, s.count / seconds,
+           s.bytes / seconds / (1 << 20));
+    printf("      \"latency_us\": {\"mean\": %.0f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, "
+           "\"p999\": %llu, \"max\": %llu}}%s\n", s.count ? (double)s.total_us / s.count : 0.0,
+           percentile(s, 0.50), percentile(s, 0.90), percentile(s, 0.99), percentile(s, 0.999),
+           (unsigned long long)s.max_us, last ? "" : ",");
+}
+
+static void report(const vector<Worker> &workers, double seconds) {
+    OpStats ops[BENCH_OPS], total;
+    for (const auto &w : workers) {
+        for (int op = 0; op < BENCH_OPS; op++) {
+            const OpStats &s = w.stats[op];
+            for (OpStats *into : {&ops[op], &total}) {
+                into->count += s.count;
+                into->errors += s.errors;
+                into->bytes += s.bytes;
+                into->total_us += s.total_us;
+                into->max_us = max(into->max_us, s.max_us);
+                for (int b = 0; b < LAT_BUCKETS; b++) into->latency[b] += s.latency[b];
+            }
+        }
+    }
+
+    printf("{\n");
+    printf("  \"servers\": %zu,\n  \"local_servers\": %s,\n  \"workers\": %d,\n", bench.targets.size(),
+           bench.servers > 0 ? "true" : "false", bench.workers);
+    printf("  \"sizes\": \"%s\",\n  \"read_ratio\": %.3f,\n  \"list_ratio\": %.3f,\n", bench.size_spec.c_str(),
+           bench.read_ratio, bench.list_ratio);
+    printf("  \"files\": %zu,\n  \"seconds\": %.3f,\n", catalog.size(), seconds);
+    printf("  \"ops\": {\n");
+    for (int op = 0; op < BENCH_OPS; op++) {
+        print_op(bench_op_names[op], ops[op], seconds, false);
+    }
+    print_op("total", total, seconds, true);
+    printf("  }\n}\n");
+}
+
+/* ------------------------------------------------------
+    MAIN
+------------------------------------------------------ */
+int main(int argc, char *argv[]) {
+    const char *usage = " [-s local_servers] [-S dfs_path] [-a dfs_args] [-P base_port] [-t host:port,...]"
+                        " [-c dfc_path] [-e dfc.conf_line]... [-j workers] [-d seconds] [-n ops]"
+                        " [-f sizes] [-r read_ratio] [-l list_ratio] [-k preload_files] [-m max_files]"
+                        " [-w work_dir] [-K]";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:S:a:P:t:c:e:j:d:n:f:r:l:k:m:w:K")) != -1) {
+        switch (opt) {
+        case 's':
+            bench.servers = atoi(optarg);
+            break;
+        case 'S':
+            bench.dfs_path = optarg;
+            break;
+        case 'a':
+            bench.dfs_args = optarg;
+            break;
+        case 'P':
+            bench.base_port = atoi(optarg);
+            break;
+        case 't':
+            if (!parse_targets(optarg, bench.targets)) {
+                cerr << "Invalid targets " << optarg << endl;
+                exit(1);
+            }
+            bench.servers = 0;
+            break;
+        case 'c':
+            bench.dfc_path = optarg;
+            break;
+        case 'e':
+            bench.conf_lines.push_back(optarg);
+            break;
+        case 'j':
+            bench.workers = max(1, atoi(optarg));
+            break;
+        case 'd':
+            bench.seconds = atof(optarg);
+            break;
+        case 'n':
+            bench.max_ops = strtoull(optarg, NULL, 10);
+            break;
+        case 'f':
+            bench.size_spec = optarg;
+            break;
+        case 'r':
+            bench.read_ratio = atof(optarg);
+            break;
+        case 'l':
+            bench.list_ratio = atof(optarg);
+            break;
+        case 'k':
+            bench.preload = max(0, atoi(optarg));
+            break;
+        case 'm':
+            bench.max_files = max(1, atoi(optarg));
+            break;
+        case 'w':
+            bench.work_dir = optarg;
+            break;
+        case 'K':
+            bench.keep = true;
+            break;
+        default:
+            cerr << "usage: " << argv[0] << usage << endl;
+            exit(0);
+        }
+    }
+    if (!parse_sizes(bench.size_spec, bench.sizes)) {
+        cerr << "Invalid sizes " << bench.size_spec << endl;
+        exit(1);
+    }
+    if (bench.servers <= 0 && bench.targets.empty()) {
+        cerr << "usage: " << argv[0] << usage << endl;
+        exit(0);
+    }
+
+    // Children are run by absolute path from their own directories
+    if (!make_absolute(bench.dfc_path) || (bench.servers > 0 && !make_absolute(bench.dfs_path))) {
+        exit(1);
+    }
+
+    bool made_dir = bench.work_dir.empty();
+    if (made_dir) {
+        char tmpl[] = "/tmp/dfsbench.XXXXXX";
+        if (mkdtemp(tmpl) == NULL) {
+            perror("mkdtemp");
+            exit(1);
+        }
+        bench.work_dir = tmpl;
+    } else if (mkdir(bench.work_dir.c_str(), 0777) < 0 && errno != EEXIST) {
+        perror(bench.work_dir.c_str());
+        exit(1);
+    }
+
+    signal(SIGINT, on_stop_signal);
+    signal(SIGTERM, on_stop_signal);
+
+    int ret = 0;
+    vector<Worker> workers(bench.workers);
+    if (bench.servers > 0 && start_servers() < 0) {
+        ret = 1;
+    }
+    random_device seed;
+    for (int i = 0; ret == 0 && i < bench.workers; i++) {
+        Worker &w = workers[i];
+        w.id = i;
+        w.dir = bench.work_dir + "/client" + to_string(i);
+        w.rng.seed(((uint64_t)seed() << 32) ^ seed());
+        w.seq = 0;
+        if ((mkdir(w.dir.c_str(), 0777) < 0 && errno != EEXIST) || write_client_conf(w.dir) < 0) {
+            ret = 1;
+        }
+    }
+
+    if (ret == 0) {
+        cerr << "Preloading " << bench.preload << " files on " << bench.targets.size() << " servers" << endl;
+        for (int i = 0; i < bench.preload && !stopping.load(); i++) {
+            do_put(&workers[i % bench.workers], false);
+        }
+        if (catalog.empty() && bench.read_ratio > 0) {
+            cerr << "Warning: no file could be stored; gets will be skipped" << endl;
+        }
+
+        cerr << "Running " << bench.workers << " workers for ";
+        if (bench.max_ops > 0) {
+            cerr << bench.max_ops << " ops" << endl;
+        } else {
+            cerr << bench.seconds << "s" << endl;
+        }
+        uint64_t start = now_us();
+        uint64_t end = bench.max_ops > 0 ? UINT64_MAX : start + (uint64_t)(bench.seconds * 1e6);
+        vector<thread> threads;
+        for (auto &w : workers) {
+            threads.push_back(thread(worker_loop, &w, end));
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        report(workers, (now_us() - start) / 1e6);
+    }
+
+    stop_servers();
+    if (made_dir && !bench.keep) {
+        nftw(bench.work_dir.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    } else {
+        cerr << "Left work files in " << bench.work_dir << endl;
+    }
+    return ret;
+}
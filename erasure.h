@@ -0,0 +1,223 @@
+#ifndef DFS_ERASURE_H
+#define DFS_ERASURE_H
+
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GF_X86 1
+#endif
+
+/* ------------------------------------------------------
+    GF(256) ARITHMETIC
+    Field of bytes modulo x^8 + x^4 + x^3 + x^2 + 1 (0x11d).
+    Addition is XOR; multiplication goes through log/exp
+    tables, plus a full 256x256 product table for the scalar
+    region kernel. gf_init() fills them once.
+------------------------------------------------------ */
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_table[256][256];
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+/* ------------------------------------------------------
+    REGION KERNELS
+    gf_mul_add_region(dst, src, c, len): dst ^= c * src, byte by
+    byte. This is the whole cost of encoding and decoding, so the
+    x86 versions multiply 16 or 32 bytes per step: c * x is
+    c * (x & 0xf) ^ c * (x & 0xf0), and both halves are lookups
+    in a 16-entry table, i.e. one PSHUFB each. The best kernel
+    the CPU supports is picked at gf_init(); other builds use the
+    scalar table walk.
+------------------------------------------------------ */
+typedef void (*gf_region_fn)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len);
+
+static void gf_mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    const uint8_t *row = gf_mul_table[c];
+    for (size_t i = 0; i < len; i++) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#ifdef GF_X86
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul_table[c][x];
+        hi[x] = gf_mul_table[c][x << 4];
+    }
+    const __m128i tlo = _mm_loadu_si128((const __m128i *)lo);
+    const __m128i thi = _mm_loadu_si128((const __m128i *)hi);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i pl = _mm_shuffle_epi8(tlo, _mm_and_si128(v, mask));
+        __m128i ph = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(d, _mm_xor_si128(pl, ph)));
+    }
+    gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    uint8_t lo[16], hi[16];
+    for (int x = 0; x < 16; x++) {
+        lo[x] = gf_mul_table[c][x];
+        hi[x] = gf_mul_table[c][x << 4];
+    }
+    const __m256i tlo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lo));
+    const __m256i thi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)hi));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i pl = _mm256_shuffle_epi8(tlo, _mm256_and_si256(v, mask));
+        __m256i ph = _mm256_shuffle_epi8(thi, _mm256_and_si256(_mm256_srli_epi64(v, 4), mask));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(pl, ph)));
+    }
+    gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+#endif
+
+static gf_region_fn gf_region_kernel = gf_mul_add_scalar;
+
+static inline void gf_mul_add_region(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c == 0) return;
+    if (c == 1) {
+        for (size_t i = 0; i < len; i++) dst[i] ^= src[i];
+        return;
+    }
+    gf_region_kernel(dst, src, c, len);
+}
+
+static inline void gf_init() {
+    static bool ready = false;
+    if (ready) return;
+    ready = true;
+
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11d;
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            gf_mul_table[a][b] = gf_mul(a, b);
+        }
+    }
+
+#ifdef GF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        gf_region_kernel = gf_mul_add_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        gf_region_kernel = gf_mul_add_ssse3;
+    }
+#endif
+}
+
+/* ------------------------------------------------------
+    REED-SOLOMON (systematic, Cauchy)
+    A stripe is k data shards and m parity shards. Shard r is
+    row r of the (k+m) x k encoding matrix times the data: the
+    top k rows are the identity (data is stored as is) and parity
+    row j is the Cauchy row 1 / ((k + j) ^ i). Every k x k
+    submatrix of a Cauchy-extended identity is invertible, so any
+    k shards rebuild the stripe. Requires k + m <= 256.
+------------------------------------------------------ */
+static inline uint8_t ec_coef(int k, int row, int col) {
+    if (row < k) return row == col ? 1 : 0;
+    return gf_inv((uint8_t)(row ^ col));
+}
+
+// parity[j] = sum over i of coef(k + j, i) * data[i]. Data shards may
+// be shorter than len (zero-padded); parity shards are len bytes.
+static inline void ec_encode(int k, int m, const uint8_t *const *data, const size_t *data_len,
+                             uint8_t **parity, size_t len) {
+    for (int j = 0; j < m; j++) {
+        memset(parity[j], 0, len);
+        for (int i = 0; i < k; i++) {
+            gf_mul_add_region(parity[j], data[i], ec_coef(k, k + j, i), data_len[i]);
+        }
+    }
+}
+
+// Invert the n x n matrix a in place; false if it is singular
+static inline bool gf_invert_matrix(std::vector<uint8_t> &a, int n) {
+    std::vector<uint8_t> inv(n * n, 0);
+    for (int i = 0; i < n; i++) inv[i * n + i] = 1;
+
+    for (int col = 0; col < n; col++) {
+        int pivot = col;
+        while (pivot < n && a[pivot * n + col] == 0) pivot++;
+        if (pivot == n) return false;
+        if (pivot != col) {
+            for (int c = 0; c < n; c++) {
+                std::swap(a[pivot * n + c], a[col * n + c]);
+                std::swap(inv[pivot * n + c], inv[col * n + c]);
+            }
+        }
+        uint8_t scale = gf_inv(a[col * n + col]);
+        for (int c = 0; c < n; c++) {
+            a[col * n + c] = gf_mul(a[col * n + c], scale);
+            inv[col * n + c] = gf_mul(inv[col * n + c], scale);
+        }
+        for (int r = 0; r < n; r++) {
+            uint8_t f = a[r * n + col];
+            if (r == col || f == 0) continue;
+            for (int c = 0; c < n; c++) {
+                a[r * n + c] ^= gf_mul(f, a[col * n + c]);
+                inv[r * n + c] ^= gf_mul(f, inv[col * n + c]);
+            }
+        }
+    }
+    a.swap(inv);
+    return true;
+}
+
+// Rebuild the data shards listed in targets from k surviving shards:
+// rows[i] is which shard shards[i] is (0..k+m-1), shard_len[i] its
+// length (shorter ones are zero-padded). out[t] gets len bytes.
+static inline bool ec_decode(int k, const int *rows, const uint8_t *const *shards,
+                             const size_t *shard_len, const std::vector<int> &targets,
+                             uint8_t **out, size_t len) {
+    std::vector<uint8_t> a(k * k);
+    for (int i = 0; i < k; i++) {
+        for (int c = 0; c < k; c++) {
+            a[i * k + c] = ec_coef(k, rows[i], c);
+        }
+    }
+    if (!gf_invert_matrix(a, k)) return false;
+
+    // data = a * shards, so data shard t is row t of a times them
+    for (size_t t = 0; t < targets.size(); t++) {
+        memset(out[t], 0, len);
+        for (int i = 0; i < k; i++) {
+            gf_mul_add_region(out[t], shards[i], a[targets[t] * k + i], shard_len[i]);
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef DFS_LOG_H
+#define DFS_LOG_H
+
+#include <string>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <stdint.h>
+#include <unistd.h>
+
+/* ------------------------------------------------------
+    LOGGING (shared by dfc and dfs)
+        LOG(LOG_DEBUG) << "Sending chunk " << i;
+    formats a line only if its level is enabled (otherwise the
+    cost is one relaxed load) and puts it on a bounded lock-free
+    ring of LOG_SLOTS lines instead of writing it. A writer
+    thread started by log_start() drains the ring in batches, one
+    write() per batch: error and warning lines to stderr, the
+    rest to log_info_fd (stdout unless the program says
+    otherwise; dfc keeps its stdout for results). A full ring
+    drops the line and counts it rather than hold up the caller;
+    the writer reports how many went missing. Before log_start()
+    and after log_stop() lines are written straight away, one
+    write() each.
+    The ring is Vyukov's bounded queue: every slot carries a
+    sequence number saying whose turn it is, so a producer
+    claims a slot with one CAS and the writer never locks.
+    log_level can be changed at any time, from any thread (or a
+    signal handler).
+------------------------------------------------------ */
+enum LogLevel { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+#define LOG_SLOTS 4096
+#define LOG_LINE_MAX 512                // longer lines are cut short
+#define LOG_BATCH_BYTES (64 * 1024)
+#define LOG_IDLE_US 2000                // writer's nap when the ring is empty
+
+struct LogSlot {
+    std::atomic<uint64_t> seq;
+    int level;
+    size_t len;
+    char text[LOG_LINE_MAX];
+};
+
+static std::atomic<int> log_level(LOG_INFO);
+static int log_info_fd = STDOUT_FILENO;         // set before log_start()
+static LogSlot log_ring[LOG_SLOTS];
+static std::atomic<uint64_t> log_head(0);      // next slot a producer claims
+static std::atomic<uint64_t> log_dropped(0);
+static std::atomic<bool> log_running(false);
+static std::thread log_writer;
+
+static const char *log_level_names[] = {"error", "warn", "info", "debug"};
+
+// False if name isn't a level
+static inline bool log_set_level(const char *name) {
+    for (int l = LOG_ERROR; l <= LOG_DEBUG; l++) {
+        if (strcmp(name, log_level_names[l]) == 0) {
+            log_level.store(l, std::memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline int log_fd(int level) {
+    return level <= LOG_WARN ? STDERR_FILENO : log_info_fd;
+}
+
+static inline void log_write(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0) return;
+        buf += n;
+        len -= n;
+    }
+}
+
+static void log_push(int level, const char *text, size_t len) {
+    if (len > LOG_LINE_MAX) {
+        len = LOG_LINE_MAX;
+    }
+    if (!log_running.load(std::memory_order_acquire)) {
+        log_write(log_fd(level), text, len);
+        return;
+    }
+
+    uint64_t pos = log_head.load(std::memory_order_relaxed);
+    LogSlot *slot;
+    while (1) {
+        slot = &log_ring[pos % LOG_SLOTS];
+        int64_t diff = (int64_t)slot->seq.load(std::memory_order_acquire) - (int64_t)pos;
+        if (diff == 0) {
+            if (log_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // The writer is a whole ring behind
+            log_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = log_head.load(std::memory_order_relaxed);
+        }
+    }
+    slot->level = level;
+    slot->len = len;
+    memcpy(slot->text, text, len);
+    if (len == LOG_LINE_MAX) slot->text[len - 1] = '\n';
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+static void log_drain() {
+    std::string out, err;
+    uint64_t tail = 0, reported = 0;
+    while (1) {
+        LogSlot &slot = log_ring[tail % LOG_SLOTS];
+        if (slot.seq.load(std::memory_order_acquire) == tail + 1) {
+            (log_fd(slot.level) == STDERR_FILENO ? err : out).append(slot.text, slot.len);
+            slot.seq.store(tail + LOG_SLOTS, std::memory_order_release);
+            tail++;
+            if (out.size() + err.size() < LOG_BATCH_BYTES) continue;
+        }
+
+        uint64_t dropped = log_dropped.load(std::memory_order_relaxed);
+        if (dropped != reported) {
+            err += "[LOG] " + std::to_string(dropped - reported) + " lines dropped\n";
+            reported = dropped;
+        }
+        log_write(STDERR_FILENO, err.data(), err.size());
+        log_write(log_info_fd, out.data(), out.size());
+        bool pending = !err.empty() || !out.empty();
+        err.clear();
+        out.clear();
+        if (pending) continue;
+
+        // Empty: stop once asked to and every claimed slot is written
+        if (!log_running.load(std::memory_order_acquire) &&
+            log_head.load(std::memory_order_acquire) == tail) {
+            return;
+        }
+        usleep(LOG_IDLE_US);
+    }
+}
+
+static void log_start() {
+    if (log_running.load()) return;
+    for (uint64_t i = 0; i < LOG_SLOTS; i++) {
+        log_ring[i].seq.store(i, std::memory_order_relaxed);
+    }
+    log_head.store(0);
+    log_running.store(true, std::memory_order_release);
+    log_writer = std::thread(log_drain);
+}
+
+// Write out what is queued and go back to writing directly
+static void log_stop() {
+    if (!log_running.load()) return;
+    log_running.store(false, std::memory_order_release);
+    log_writer.join();
+}
+
+class LogLine {
+public:
+    explicit LogLine(int level) : level_(level) {}
+    ~LogLine() {
+        out_ << '\n';
+        std::string line = out_.str();
+        log_push(level_, line.data(), line.size());
+    }
+
+    template <class T>
+    LogLine &operator<<(const T &value) {
+        out_ << value;
+        return *this;
+    }
+
+private:
+    int level_;
+    std::ostringstream out_;
+};
+
+#define LOG(level) \
+    if ((level) > log_level.load(std::memory_order_relaxed)) { \
+    } else LogLine(level)
+
+#endif
@@ -0,0 +1,354 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <new>
+#include <random>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <ctime>
+#include <unistd.h>
+#include "protocol.h"
+#include "checksum.h"
+#include "compress.h"
+#include "placement.h"
+#include "erasure.h"
+
+using namespace std;
+
+/* ------------------------------------------------------
+    MICROBENCH
+    Times the per-block work dfc does on its data path, in
+    memory and on one thread, for files from min_size to
+    max_size (x16 each step), using the same shared helpers dfc
+    is built from:
+        chunk       plan_layout, then per block what put does
+                    before sending: copy the data into a
+                    vector<char> behind room for its header in a
+                    map<int, vector<char>>, compress it (with -c),
+                    checksum it and encode the BlockInfo; with -e
+                    each stripe's parity blocks are computed from
+                    its raw data blocks first, as in read_stripe
+        place       hash_file_key and block_homes for every block,
+                    modulo placement and on a ring of -n servers
+        header      per block, the PUT frame dfc builds and the
+                    CHUNK frame header and BlockInfo it parses
+        reassemble  blocks arriving in random order, each checked
+                    against its crc32c and copied into the output
+                    at its offset (the in-memory read_range path;
+                    a GET to disk does a pwrite instead)
+    Each case repeats until it has run min_ms and prints ns per
+    operation and per byte, MB/s and the operator new calls made
+    per operation. Inputs are built outside the timed part.
+------------------------------------------------------ */
+#define DEFAULT_MIN_SIZE 1024
+#define DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+#define DEFAULT_SERVERS 4
+#define DEFAULT_MIN_MS 200
+#define MIN_ITERATIONS 3
+
+static uint64_t allocations = 0;
+
+void *operator new(size_t n) {
+    allocations++;
+    void *p = malloc(n ? n : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n) {
+    allocations++;
+    void *p = malloc(n ? n : 1);
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+struct BenchOptions {
+    uint64_t min_size, max_size;
+    uint64_t block_size;
+    int servers;
+    int ec_data, ec_parity;
+    int codec;
+    double min_ms;
+
+    BenchOptions() : min_size(DEFAULT_MIN_SIZE), max_size(DEFAULT_MAX_SIZE), block_size(DEFAULT_BLOCK_SIZE),
+                     servers(DEFAULT_SERVERS), ec_data(0), ec_parity(0), codec(BLOCK_CODEC_NONE),
+                     min_ms(DEFAULT_MIN_MS) {}
+};
+
+static BenchOptions opts;
+
+// What one case works on: a file of size bytes and its layout
+struct Input {
+    string name;
+    vector<char> data;
+    BlockInfo layout;
+};
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static string size_name(uint64_t size) {
+    if (size >= (1 << 30) && size % (1 << 30) == 0) return to_string(size >> 30) + "G";
+    if (size >= (1 << 20) && size % (1 << 20) == 0) return to_string(size >> 20) + "M";
+    if (size >= (1 << 10) && size % (1 << 10) == 0) return to_string(size >> 10) + "K";
+    return to_string(size);
+}
+
+static uint64_t parse_size(const char *value) {
+    char *end;
+    uint64_t size = strtoull(value, &end, 10);
+    if (*end == 'K' || *end == 'k') size <<= 10;
+    if (*end == 'M' || *end == 'm') size <<= 20;
+    if (*end == 'G' || *end == 'g') size <<= 30;
+    return size;
+}
+
+// Runs op until min_ms have passed and prints one result line;
+// sink keeps the compiler from dropping the work
+static volatile uint64_t sink = 0;
+
+template <class Op>
+static void measure(const char *bench, const Input &in, Op op) {
+    uint64_t iterations = 0, allocs = allocations;
+    double start = now_ns(), elapsed;
+    do {
+        sink = sink + op();
+        iterations++;
+        elapsed = now_ns() - start;
+    } while (iterations < MIN_ITERATIONS || elapsed < opts.min_ms * 1e6);
+    allocs = allocations - allocs;
+
+    double per_op = elapsed / iterations;
+    printf("%-11s %6s %8u %10llu %14.0f %9.3f %10.1f %12.1f\n", bench, size_name(in.data.size()).c_str(),
+           in.layout.nblocks, (unsigned long long)iterations, per_op, per_op / in.data.size(),
+           in.data.size() / per_op * 1e9 / (1 << 20), (double)allocs / iterations);
+}
+
+/* ------------------------------------------------------
+    CASES
+------------------------------------------------------ */
+// Compress block j (with -c), checksum it and put its BlockInfo in
+// front, as seal_block does; returns the size stored
+static uint64_t seal_block(const BlockInfo &layout, uint32_t j, vector<char> &block) {
+    BlockInfo info = layout;
+    block_extent(layout, j, info.offset, info.length);
+    info.raw_length = info.length;
+
+    const uint8_t *data = (const uint8_t *)block.data() + BLOCK_INFO_SIZE;
+    vector<char> packed;
+    if (opts.codec != BLOCK_CODEC_NONE && codec_worth_trying(data, info.length) &&
+        codec_compress(opts.codec, data, info.length, packed, BLOCK_INFO_SIZE)) {
+        info.codec = opts.codec;
+        info.length = packed.size() - BLOCK_INFO_SIZE;
+        block.swap(packed);
+    }
+    info.crc = crc32c(0, block.data() + BLOCK_INFO_SIZE, info.length);
+    encode_block_info(info, block.data());
+    return info.length;
+}
+
+// Parity blocks of the stripe starting at block first, from its raw
+// data blocks
+static void encode_stripe(const BlockInfo &layout, uint32_t first, map<int, vector<char>> &chunks) {
+    vector<const uint8_t*> data;
+    vector<size_t> data_len;
+    vector<uint8_t*> parity;
+    for (int position = 0; position < stripe_width(layout); position++) {
+        vector<char> &block = chunks[first + position];
+        if (position < layout.ec_data) {
+            data.push_back((const uint8_t *)block.data() + BLOCK_INFO_SIZE);
+            data_len.push_back(block.size() - BLOCK_INFO_SIZE);
+        } else {
+            parity.push_back((uint8_t *)block.data() + BLOCK_INFO_SIZE);
+        }
+    }
+    ec_encode(layout.ec_data, layout.ec_parity, data.data(), data_len.data(), parity.data(),
+              chunks[first + layout.ec_data].size() - BLOCK_INFO_SIZE);
+}
+
+// A stripe at a time with -e (a block at a time otherwise), the way
+// put reads and seals them
+static uint64_t chunk_file(const Input &in) {
+    BlockInfo layout = plan_layout(in.data.size(), opts.servers, opts.block_size, opts.ec_data,
+                                   opts.ec_parity);
+    int width = stripe_width(layout);
+    uint32_t group = (width > 0) ? width : 1;
+    map<int, vector<char>> chunks;
+    uint64_t total = 0;
+    for (uint32_t first = 0; first < layout.nblocks; first += group) {
+        for (uint32_t j = first; j < first + group; j++) {
+            uint64_t offset, length;
+            block_extent(layout, j, offset, length);
+            vector<char> &block = chunks[j];
+            block.resize(BLOCK_INFO_SIZE + length);
+            if (!is_parity(layout, j)) memcpy(block.data() + BLOCK_INFO_SIZE, in.data.data() + offset, length);
+        }
+        if (width > 0) encode_stripe(layout, first, chunks);
+        for (uint32_t j = first; j < first + group; j++) {
+            total += seal_block(layout, j, chunks[j]);
+        }
+    }
+    return total;
+}
+
+static uint64_t place_file(const Input &in) {
+    uint32_t key = hash_file_key(in.name.c_str());
+    uint64_t total = 0;
+    for (uint32_t j = 0; j < in.layout.nblocks; j++) {
+        vector<int> homes = block_homes(in.layout, key, j, opts.servers);
+        total += homes[0];
+    }
+    return total;
+}
+
+// Frame header and BlockInfo of every block, as the servers send them
+static vector<string> chunk_headers(const Input &in) {
+    vector<string> headers;
+    for (uint32_t j = 0; j < in.layout.nblocks; j++) {
+        BlockInfo info = in.layout;
+        block_extent(in.layout, j, info.offset, info.length);
+        string frame = encode_frame(OP_CHUNK, 1, j, in.name, BLOCK_INFO_SIZE + info.length);
+        frame.resize(frame.size() + BLOCK_INFO_SIZE);
+        encode_block_info(info, &frame[frame.size() - BLOCK_INFO_SIZE]);
+        headers.push_back(frame);
+    }
+    return headers;
+}
+
+static uint64_t handle_headers(const Input &in, const vector<string> &headers) {
+    uint64_t total = 0;
+    for (uint32_t j = 0; j < in.layout.nblocks; j++) {
+        BlockInfo info = in.layout;
+        block_extent(in.layout, j, info.offset, info.length);
+        string put = encode_frame(OP_PUT, j + 1, j, in.name, BLOCK_INFO_SIZE + info.length);
+
+        FrameHeader hdr;
+        BlockInfo got;
+        const string &chunk = headers[j];
+        if (!decode_frame_header(chunk.data(), hdr) ||
+            !decode_block_info(chunk.data() + FRAME_HEADER_SIZE + hdr.name_len, got)) {
+            abort();
+        }
+        total += put.size() + got.length;
+    }
+    return total;
+}
+
+struct Arrival {
+    BlockInfo info;
+    vector<char> data;
+};
+
+// The data blocks of the file, in the order they might arrive
+static vector<Arrival> arrivals(const Input &in) {
+    vector<Arrival> blocks;
+    for (uint32_t j = 0; j < in.layout.nblocks; j++) {
+        if (is_parity(in.layout, j)) continue;
+        Arrival a;
+        a.info = in.layout;
+        block_extent(in.layout, j, a.info.offset, a.info.length);
+        a.data.assign(in.data.begin() + a.info.offset, in.data.begin() + a.info.offset + a.info.length);
+        a.info.crc = crc32c(0, a.data.data(), a.data.size());
+        blocks.push_back(a);
+    }
+    shuffle(blocks.begin(), blocks.end(), mt19937(1));
+    return blocks;
+}
+
+static uint64_t reassemble(const vector<Arrival> &blocks) {
+    vector<char> out;
+    for (const auto &a : blocks) {
+        if (crc32c(0, a.data.data(), a.data.size()) != a.info.crc) abort();
+        if (a.info.offset + a.data.size() > out.size()) out.resize(a.info.offset + a.data.size());
+        memcpy(out.data() + a.info.offset, a.data.data(), a.data.size());
+    }
+    return out.size();
+}
+
+/* ------------------------------------------------------
+    MAIN
+------------------------------------------------------ */
+int main(int argc, char *argv[]) {
+    const char *usage = " [-s min_size] [-S max_size] [-b block_size] [-n servers] [-e k+m] [-c lz4]"
+                        " [-t min_ms]";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:S:b:n:e:c:t:")) != -1) {
+        switch (opt) {
+        case 's':
+            opts.min_size = max<uint64_t>(1, parse_size(optarg));
+            break;
+        case 'S':
+            opts.max_size = parse_size(optarg);
+            break;
+        case 'b':
+            opts.block_size = max<uint64_t>(1, parse_size(optarg));
+            break;
+        case 'n':
+            opts.servers = max(1, atoi(optarg));
+            break;
+        case 'e':
+            if (sscanf(optarg, "%d+%d", &opts.ec_data, &opts.ec_parity) != 2 || opts.ec_data < 1 ||
+                opts.ec_parity < 1) {
+                cerr << "Invalid erasure setting " << optarg << endl;
+                exit(1);
+            }
+            break;
+        case 'c':
+            if (strcmp(optarg, "lz4") != 0) {
+                cerr << "Only lz4 is built in" << endl;
+                exit(1);
+            }
+            opts.codec = BLOCK_CODEC_LZ4;
+            break;
+        case 't':
+            opts.min_ms = atof(optarg);
+            break;
+        default:
+            cerr << "usage: " << argv[0] << usage << endl;
+            exit(0);
+        }
+    }
+
+    vector<ServerAddress> servers(opts.servers);
+    for (int i = 0; i < opts.servers; i++) {
+        servers[i].name = "dfs" + to_string(i + 1);
+    }
+
+    gf_init();
+    printf("%-11s %6s %8s %10s %14s %9s %10s %12s\n", "bench", "size", "blocks", "iters", "ns/op", "ns/byte",
+           "MB/s", "allocs/op");
+    mt19937_64 rng(1);
+    for (uint64_t size = opts.min_size; size <= opts.max_size; size *= 16) {
+        // Text-like bytes, so -c lz4 has something to find
+        Input in;
+        in.name = "bench-" + size_name(size);
+        in.data.resize(size);
+        for (auto &c : in.data) c = "etaoin shrdlu\n"[rng() % 14];
+        in.layout = plan_layout(size, opts.servers, opts.block_size, opts.ec_data, opts.ec_parity);
+
+        measure("chunk", in, [&]() { return chunk_file(in); });
+        ring.clear();
+        measure("place-mod", in, [&]() { return place_file(in); });
+        build_ring(servers, DEFAULT_VNODES);
+        measure("place-ring", in, [&]() { return place_file(in); });
+        vector<string> headers = chunk_headers(in);
+        measure("header", in, [&]() { return handle_headers(in, headers); });
+        vector<Arrival> blocks = arrivals(in);
+        measure("reassemble", in, [&]() { return reassemble(blocks); });
+    }
+    return 0;
+}
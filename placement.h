@@ -0,0 +1,249 @@
+#ifndef DFS_PLACEMENT_H
+#define DFS_PLACEMENT_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+#include <openssl/evp.h>
+#include "protocol.h"
+
+/* ------------------------------------------------------
+    CLUSTER MEMBERSHIP (shared by dfc and dfs)
+    The servers are listed in dfc.conf, one per line, as
+    "server <name> <ip:port> [weight]" or just "ip:port". Their
+    order is their number; every client (and a dfs running
+    repair, which reads the same file) must see the same list.
+------------------------------------------------------ */
+struct ServerAddress {
+    std::string name;       // places it on the ring
+    std::string ip;
+    int port;
+    double weight;          // share of the ring relative to 1
+
+    ServerAddress() : port(0), weight(1) {}
+};
+
+// False if the line names no ip:port
+static inline bool parse_server_line(std::string line, ServerAddress &server) {
+    std::vector<std::string> words;
+    char *save = nullptr;
+    for (char *w = strtok_r(&line[0], " \t\r", &save); w; w = strtok_r(nullptr, " \t\r", &save)) {
+        words.push_back(w);
+    }
+    size_t at = 0;
+    while (at < words.size() && words[at].find(':') == std::string::npos) at++;
+    if (at == words.size()) return false;
+
+    size_t pos = words[at].find(':');
+    server.ip = words[at].substr(0, pos);
+    server.port = atoi(words[at].c_str() + pos + 1);
+    server.name = (at >= 2 && words[0] == "server") ? words[at - 1] : words[at];
+    if (at + 1 < words.size() && atof(words[at + 1].c_str()) > 0) {
+        server.weight = atof(words[at + 1].c_str());
+    }
+    return true;
+}
+
+static inline uint32_t hash_file_key(const char *filename) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    EVP_Digest(filename, strlen(filename), digest, &len, EVP_md5(), NULL);
+    uint32_t h;
+    memcpy(&h, digest, sizeof(h));
+    return h;
+}
+
+/* ------------------------------------------------------
+    BLOCK LAYOUT
+    A file that fits in one block per server keeps the original
+    layout: exactly server_count blocks of near-equal size
+    (BLOCK_EVEN). Larger files are cut into block_size blocks
+    (the last one short). Either way block i goes to servers
+    first+i and first+i+1, so blocks stripe round-robin over
+    every server. Any block's header describes the layout of the
+    whole file.
+    With erasure coding (BLOCK_ERASURE) the file is cut into
+    stripes of k data blocks of block_size (one stripe of k
+    near-equal blocks for a small file), each followed by m
+    parity blocks as long as its first data block. Block i is
+    position i % (k+m) of stripe i / (k+m); a stripe's blocks go
+    to k+m consecutive servers starting at first+stripe, one copy
+    each. (first is the file's placement hash modulo the server
+    count; with "placement ring" the servers come from the ring
+    instead, see below.)
+------------------------------------------------------ */
+#define DEFAULT_BLOCK_SIZE (4 * 1024 * 1024)
+
+// Blocks per stripe, 0 for a replicated layout
+static inline int stripe_width(const BlockInfo &layout) {
+    return (layout.flags & BLOCK_ERASURE) ? layout.ec_data + layout.ec_parity : 0;
+}
+
+static inline bool is_parity(const BlockInfo &layout, uint32_t i) {
+    int width = stripe_width(layout);
+    return width > 0 && (int)(i % width) >= layout.ec_data;
+}
+
+// Layout of a new file_size-byte file; ec_data 0 replicates, as
+// does a cluster too small for k+m. The generation is left to the
+// caller.
+static inline BlockInfo plan_layout(uint64_t file_size, int server_count, uint64_t block_size,
+                                    int ec_data, int ec_parity) {
+    BlockInfo layout;
+    layout.file_size = file_size;
+    if (ec_data > 0 && ec_data + ec_parity <= server_count) {
+        uint64_t k = ec_data;
+        uint64_t stripes = (file_size + k * block_size - 1) / (k * block_size);
+        layout.flags = BLOCK_ERASURE;
+        layout.ec_data = ec_data;
+        layout.ec_parity = ec_parity;
+        layout.block_size = (stripes > 1) ? block_size : (file_size + k - 1) / k;
+        layout.nblocks = std::max<uint64_t>(stripes, 1) * stripe_width(layout);
+        return layout;
+    }
+
+    uint64_t n = (file_size + block_size - 1) / block_size;
+    layout.block_size = block_size;
+    if (n > (uint64_t)server_count) {
+        layout.nblocks = n;
+    } else {
+        layout.nblocks = server_count;
+        layout.flags = BLOCK_EVEN;
+    }
+    return layout;
+}
+
+static inline void block_extent(const BlockInfo &layout, uint32_t i, uint64_t &offset, uint64_t &length) {
+    if (layout.flags & BLOCK_ERASURE) {
+        int width = stripe_width(layout);
+        uint64_t position = i % width;
+        offset = (uint64_t)(i / width) * layout.ec_data * layout.block_size;
+        if (position < layout.ec_data) offset += position * layout.block_size;
+        offset = std::min(offset, layout.file_size);
+        length = std::min<uint64_t>(layout.block_size, layout.file_size - offset);
+    } else if (layout.flags & BLOCK_EVEN) {
+        uint64_t base = layout.file_size / layout.nblocks;
+        uint64_t remaining = layout.file_size % layout.nblocks;
+        offset = i * base + std::min<uint64_t>(i, remaining);
+        length = base + (i < remaining ? 1 : 0);
+    } else {
+        offset = (uint64_t)i * layout.block_size;
+        length = std::min<uint64_t>(layout.block_size, layout.file_size - offset);
+    }
+}
+
+// Block holding byte pos of the file
+static inline uint32_t block_at(const BlockInfo &layout, uint64_t pos) {
+    if (layout.flags & BLOCK_ERASURE) {
+        uint64_t unit = pos / layout.block_size;
+        return (unit / layout.ec_data) * stripe_width(layout) + unit % layout.ec_data;
+    }
+    if (layout.flags & BLOCK_EVEN) {
+        uint64_t base = layout.file_size / layout.nblocks;
+        uint64_t remaining = layout.file_size % layout.nblocks;
+        if (pos < remaining * (base + 1)) return pos / (base + 1);
+        return remaining + (pos - remaining * (base + 1)) / base;
+    }
+    return pos / layout.block_size;
+}
+
+/* ------------------------------------------------------
+    PLACEMENT
+    By default block i of a file goes to servers first+i and
+    first+i+1, first being the file's key (MD5 of its name)
+    modulo the server count; an erasure stripe s takes k+m
+    consecutive servers from first+s.
+    With "placement ring" each server sits on a consistent-hash
+    ring at vnodes points per unit of weight, hashed from its
+    name. A block (an erasure stripe) hashes to a point from its
+    file's key and index, and its copies (stripe positions) go to
+    the distinct servers met walking clockwise from there. Adding
+    or removing a server only moves the blocks whose points fall
+    next to its own, about 1/N of them, where the modulo layout
+    moves nearly all of them.
+------------------------------------------------------ */
+#define DEFAULT_VNODES 128
+
+struct RingPoint {
+    uint32_t point;
+    int server;
+
+    bool operator<(const RingPoint &other) const {
+        return point < other.point || (point == other.point && server < other.server);
+    }
+};
+
+static std::vector<RingPoint> ring;     // sorted; empty = modulo placement
+
+// servers: anything with a name and a weight, in cluster order
+template <class Server>
+static void build_ring(const std::vector<Server> &servers, int vnodes) {
+    ring.clear();
+    for (size_t s = 0; s < servers.size(); s++) {
+        long points = std::max(1L, lround(vnodes * servers[s].weight));
+        for (long v = 0; v < points; v++) {
+            std::string id = servers[s].name + "#" + std::to_string(v);
+            ring.push_back({hash_file_key(id.c_str()), (int)s});
+        }
+    }
+    std::sort(ring.begin(), ring.end());
+}
+
+// Point of block or stripe unit of the file with this key
+static inline uint32_t ring_point(uint32_t key, uint32_t unit) {
+    uint32_t h = key ^ (unit * 0x9e3779b9u);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// The nth distinct server clockwise from point; -1 if there are
+// fewer servers than that
+static inline int ring_server(uint32_t point, int nth) {
+    auto it = std::lower_bound(ring.begin(), ring.end(), RingPoint{point, -1});
+    std::vector<int> seen;
+    for (size_t step = 0; step < ring.size(); step++, ++it) {
+        if (it == ring.end()) it = ring.begin();
+        if (std::find(seen.begin(), seen.end(), it->server) != seen.end()) continue;
+        if ((int)seen.size() == nth) return it->server;
+        seen.push_back(it->server);
+    }
+    return -1;
+}
+
+// Server holding copy rank of block i (0 = primary, 1 = replica,
+// then the rest); -1 if there is no such copy
+static inline int block_server(const BlockInfo &layout, uint32_t key, uint32_t i, int rank,
+                               int server_count) {
+    int width = stripe_width(layout);
+    if (!ring.empty()) {
+        if (width > 0) return rank == 0 ? ring_server(ring_point(key, i / width), i % width) : -1;
+        return ring_server(ring_point(key, i), rank);
+    }
+    int first = key % server_count;
+    if (width > 0) {
+        return rank == 0 ? (first + i / width + i % width) % server_count : -1;
+    }
+    return rank < server_count ? (first + i + rank) % server_count : -1;
+}
+
+// Servers a block is stored on: primary and replica, or the one
+// home of an erasure-coded block
+static inline std::vector<int> block_homes(const BlockInfo &layout, uint32_t key, uint32_t i,
+                                           int server_count) {
+    std::vector<int> homes;
+    for (int rank = 0; rank < 2; rank++) {
+        int srv = block_server(layout, key, i, rank, server_count);
+        if (srv >= 0 && std::find(homes.begin(), homes.end(), srv) == homes.end()) homes.push_back(srv);
+    }
+    return homes;
+}
+
+#endif
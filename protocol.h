@@ -0,0 +1,348 @@
+#ifndef DFS_PROTOCOL_H
+#define DFS_PROTOCOL_H
+
+#include <string>
+#include <cstring>
+#include <stdint.h>
+
+/* ------------------------------------------------------
+    WIRE PROTOCOL (shared by dfc and dfs)
+    Every message in either direction starts with a fixed
+    FRAME_HEADER_SIZE-byte header, all fields big-endian:
+        magic     u16   PROTO_MAGIC
+        version   u8    PROTO_VERSION
+        opcode    u8    OP_*
+        req_id    u32   chosen by the client, echoed in replies
+        arg       u32   chunk index (PUT, CHUNK), target id (CANCEL),
+                        page size (LIST)
+        name_len  u32   bytes of file name following the header
+        body_len  u64   bytes of body following the name
+    Requests:
+        OP_LIST   name = prefix to match,    -> OP_LISTING, body = "name.N
+                  arg = page size (0 = all),    generation nblocks flags
+                  body = empty, or u32 N +      ec_data ec_parity" lines
+                  name of the last entry seen:  (just "name.N" for a
+                  the page starts after it      chunk without a block
+                                                header) in name then N
+                                                order, arg = LIST_MORE if
+                                                entries remain past this
+                                                page
+        OP_GET    name, body = u32 indices   -> OP_CHUNK..., OP_END
+                  (no indices = every chunk)    or OP_NOT_FOUND
+                  arg = GET_RANGES: body = {u32 index, u64 offset,
+                  u64 length}..., byte ranges within those blocks
+        OP_PUT    name, arg, body = block    -> OP_OK or OP_ERROR
+        OP_CANCEL arg = id of an earlier GET    (no reply)
+        OP_HAVE   body = BLOCK_HASH_SIZE-byte -> OP_HAVE_LIST, body = one
+                  hashes                        byte per hash (1 = stored),
+                                                or OP_ERROR if the server
+                                                isn't content-addressed
+        OP_PUT_REF name, arg, body = BlockInfo -> OP_OK, or OP_NOT_FOUND if
+                  + hash of a stored block      the hash is not stored
+        OP_SUMMARY arg = asking server's number -> OP_SUMMARY_LIST, or
+                  (dfs to dfs, see REPAIR in    OP_ERROR if the server has
+                  dfs.cpp); body = empty:       no cluster configuration
+                  SUMMARY_BUCKETS u64 digests,
+                  or u16 bucket numbers: the
+                  entries in them
+        OP_STAT   name, arg = first block    -> OP_STAT_LIST, body = {u32
+                  index to describe             index, BlockInfo}... from
+                                                the server's index, no data;
+                                                arg = LIST_MORE if the rest
+                                                didn't fit
+        OP_METRICS                           -> OP_METRICS_REPORT, body =
+                                                "name value" lines (see
+                                                METRICS in dfs.cpp)
+    CHUNK and PUT bodies are a block (BlockInfo + data, below)
+    and are streamed; every other body is bounded by
+    PROTO_MAX_CONTROL and buffered whole.
+------------------------------------------------------ */
+#define PROTO_MAGIC 0x4446      // "DF"
+#define PROTO_VERSION 1
+#define FRAME_HEADER_SIZE 24
+#define PROTO_MAX_NAME 255
+#define PROTO_MAX_CONTROL (64 * 1024)
+#define GET_RANGES 1
+#define GET_RANGE_ENTRY 20
+#define LIST_MORE 1
+#define STAT_ENTRY (4 + BLOCK_INFO_SIZE)
+#define SUMMARY_BUCKETS 256
+#define SUMMARY_ANY 0xffffffff  // OP_SUMMARY arg: every chunk the server is a home of
+
+enum Opcode {
+    // requests
+    OP_LIST = 0x01,
+    OP_GET = 0x02,
+    OP_PUT = 0x03,
+    OP_CANCEL = 0x04,
+    OP_HAVE = 0x05,
+    OP_PUT_REF = 0x06,
+    OP_SUMMARY = 0x07,
+    OP_STAT = 0x08,
+    OP_METRICS = 0x09,
+    // replies
+    OP_OK = 0x80,
+    OP_ERROR = 0x81,
+    OP_LISTING = 0x82,
+    OP_CHUNK = 0x83,
+    OP_END = 0x84,
+    OP_NOT_FOUND = 0x85,
+    OP_HAVE_LIST = 0x86,
+    OP_SUMMARY_LIST = 0x87,
+    OP_STAT_LIST = 0x88,
+    OP_METRICS_REPORT = 0x89
+};
+
+struct FrameHeader {
+    uint8_t opcode;
+    uint32_t req_id;
+    uint32_t arg;
+    uint32_t name_len;
+    uint64_t body_len;
+};
+
+static inline void put_u16(unsigned char *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void put_u64(unsigned char *p, uint64_t v) {
+    put_u32(p, (uint32_t)(v >> 32));
+    put_u32(p + 4, (uint32_t)v);
+}
+
+static inline uint16_t get_u16(const unsigned char *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint64_t get_u64(const unsigned char *p) {
+    return ((uint64_t)get_u32(p) << 32) | get_u32(p + 4);
+}
+
+// Serialize a header followed by the name into a new string; the
+// caller appends (or sends separately) body_len bytes of body
+static inline std::string encode_frame(uint8_t opcode, uint32_t req_id, uint32_t arg,
+                                       const std::string &name, uint64_t body_len) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    put_u16(hdr, PROTO_MAGIC);
+    hdr[2] = PROTO_VERSION;
+    hdr[3] = opcode;
+    put_u32(hdr + 4, req_id);
+    put_u32(hdr + 8, arg);
+    put_u32(hdr + 12, (uint32_t)name.size());
+    put_u64(hdr + 16, body_len);
+
+    std::string frame((const char *)hdr, FRAME_HEADER_SIZE);
+    frame += name;
+    return frame;
+}
+
+// Parse FRAME_HEADER_SIZE bytes; false if this isn't a frame we speak
+static inline bool decode_frame_header(const char *buf, FrameHeader &hdr) {
+    const unsigned char *p = (const unsigned char *)buf;
+    if (get_u16(p) != PROTO_MAGIC || p[2] != PROTO_VERSION) {
+        return false;
+    }
+    hdr.opcode = p[3];
+    hdr.req_id = get_u32(p + 4);
+    hdr.arg = get_u32(p + 8);
+    hdr.name_len = get_u32(p + 12);
+    hdr.body_len = get_u64(p + 16);
+    return true;
+}
+
+static inline const char *opcode_name(uint8_t opcode) {
+    switch (opcode) {
+    case OP_LIST: return "list";
+    case OP_GET: return "get";
+    case OP_PUT: return "put";
+    case OP_CANCEL: return "cancel";
+    case OP_HAVE: return "have";
+    case OP_PUT_REF: return "put_ref";
+    case OP_SUMMARY: return "summary";
+    case OP_STAT: return "stat";
+    case OP_METRICS: return "metrics";
+    case OP_OK: return "OK";
+    case OP_ERROR: return "ERROR";
+    case OP_LISTING: return "LIST";
+    case OP_CHUNK: return "CHUNK";
+    case OP_END: return "END";
+    case OP_NOT_FOUND: return "FILE_NOT_FOUND";
+    case OP_HAVE_LIST: return "HAVE";
+    case OP_SUMMARY_LIST: return "SUMMARY";
+    case OP_STAT_LIST: return "STAT";
+    case OP_METRICS_REPORT: return "METRICS";
+    default: return "?";
+    }
+}
+
+/* ------------------------------------------------------
+    BLOCK INFO
+    Files are striped into blocks; every block starts with a
+    BLOCK_INFO_SIZE-byte header, big-endian like the frames:
+        magic      u32   BLOCK_MAGIC
+        version    u8    BLOCK_VERSION
+        flags      u8    BLOCK_*
+        ec_data    u8    BLOCK_ERASURE: data shards per stripe (k)
+        ec_parity  u8    BLOCK_ERASURE: parity shards per stripe (m)
+        nblocks    u32   blocks in the whole file
+        block_size u32   stripe unit, unless BLOCK_EVEN
+        file_size  u64
+        offset     u64   where this block's data goes in the file
+        length     u64   bytes of data following the header
+        crc32c     u32   CRC32C of those bytes (see checksum.h)
+        codec      u8    BLOCK_CODEC_*: how those bytes are compressed
+        reserved   u8[3]
+        raw_length u64   length of the data once decompressed
+        generation u64   which upload of the file the block is from
+    The header is stored on disk in front of the data and the
+    same bytes travel on the wire, so a PUT body is written out
+    verbatim and a CHUNK body is sent straight from the file.
+    A CHUNK answering a byte range carries the header of the
+    slice instead: offset, length and crc32c describe the bytes
+    sent. A compressed block can't be cut, so it is always sent
+    whole.
+    Every upload of a file stamps its blocks with a new, larger
+    generation. A server keeps the highest generation of each
+    block it is sent, and a client assembles a file from the
+    blocks of one generation only, so two uploads racing each
+    other never leave a reader with a mix of both.
+------------------------------------------------------ */
+#define BLOCK_MAGIC 0x44465342  // "DFSB"
+#define BLOCK_VERSION 4
+#define BLOCK_INFO_SIZE 64
+
+// Synthesized by the server for a chunk written before blocks had
+// headers: nblocks, file_size and offset are unknown (0)
+#define BLOCK_LEGACY 0x01
+// The file is split into exactly nblocks near-equal blocks rather
+// than block_size ones
+#define BLOCK_EVEN 0x02
+// On disk only: the data lives in the content-addressed store and
+// BLOCK_HASH_SIZE bytes of hash follow the header instead
+#define BLOCK_REF 0x04
+// The file is erasure-coded: blocks form stripes of ec_data data
+// blocks followed by ec_parity parity blocks (see dfc's layout)
+#define BLOCK_ERASURE 0x08
+
+// Codecs for a block's data (see compress.h)
+#define BLOCK_CODEC_NONE 0
+#define BLOCK_CODEC_LZ4 1
+#define BLOCK_CODEC_ZSTD 2
+
+// Blocks are content-addressed by the SHA-256 of their data
+#define BLOCK_HASH_SIZE 32
+
+struct BlockInfo {
+    uint8_t flags;
+    uint8_t ec_data;
+    uint8_t ec_parity;
+    uint32_t nblocks;
+    uint32_t block_size;
+    uint64_t file_size;
+    uint64_t offset;
+    uint64_t length;
+    uint32_t crc;
+    uint8_t codec;
+    uint64_t raw_length;
+    uint64_t generation;
+
+    BlockInfo() : flags(0), ec_data(0), ec_parity(0), nblocks(0), block_size(0), file_size(0),
+                  offset(0), length(0), crc(0), codec(BLOCK_CODEC_NONE), raw_length(0),
+                  generation(0) {}
+};
+
+// Bytes of file data the block holds once decompressed
+static inline uint64_t block_raw_length(const BlockInfo &info) {
+    return (info.codec == BLOCK_CODEC_NONE) ? info.length : info.raw_length;
+}
+
+static inline void encode_block_info(const BlockInfo &info, char *buf) {
+    unsigned char *p = (unsigned char *)buf;
+    memset(p, 0, BLOCK_INFO_SIZE);
+    put_u32(p, BLOCK_MAGIC);
+    p[4] = BLOCK_VERSION;
+    p[5] = info.flags;
+    p[6] = info.ec_data;
+    p[7] = info.ec_parity;
+    put_u32(p + 8, info.nblocks);
+    put_u32(p + 12, info.block_size);
+    put_u64(p + 16, info.file_size);
+    put_u64(p + 24, info.offset);
+    put_u64(p + 32, info.length);
+    put_u32(p + 40, info.crc);
+    p[44] = info.codec;
+    put_u64(p + 48, info.raw_length);
+    put_u64(p + 56, info.generation);
+}
+
+// False if buf doesn't start with a block header
+static inline bool decode_block_info(const char *buf, BlockInfo &info) {
+    const unsigned char *p = (const unsigned char *)buf;
+    if (get_u32(p) != BLOCK_MAGIC || p[4] != BLOCK_VERSION) {
+        return false;
+    }
+    info.flags = p[5];
+    info.ec_data = p[6];
+    info.ec_parity = p[7];
+    info.nblocks = get_u32(p + 8);
+    info.block_size = get_u32(p + 12);
+    info.file_size = get_u64(p + 16);
+    info.offset = get_u64(p + 24);
+    info.length = get_u64(p + 32);
+    info.crc = get_u32(p + 40);
+    info.codec = p[44];
+    info.raw_length = get_u64(p + 48);
+    info.generation = get_u64(p + 56);
+    return true;
+}
+
+/* ------------------------------------------------------
+    RecvBuffer: bytes received but not yet consumed. Messages
+    are consumed from the front by advancing an offset; the dead
+    prefix is only dropped once it outweighs the live bytes, so
+    parsing a stream of small frames doesn't memmove per frame.
+------------------------------------------------------ */
+struct RecvBuffer {
+    std::string buf;
+    size_t pos;
+
+    RecvBuffer() : pos(0) {}
+
+    const char *data() const { return buf.data() + pos; }
+    size_t size() const { return buf.size() - pos; }
+    bool empty() const { return pos == buf.size(); }
+
+    void append(const char *p, size_t n) {
+        if (pos > 0 && pos >= buf.size() - pos) {
+            buf.erase(0, pos);
+            pos = 0;
+        }
+        buf.append(p, n);
+    }
+
+    void consume(size_t n) {
+        pos += n;
+        if (pos >= buf.size()) {
+            clear();
+        }
+    }
+
+    void clear() {
+        buf.clear();
+        pos = 0;
+    }
+};
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef DFS_STATS_H
+#define DFS_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* ------------------------------------------------------
+    LATENCY HISTOGRAMS (shared by dfc and dfs)
+    Log-linear buckets in the manner of HdrHistogram, in
+    microseconds: each value below 2^LAT_SUB_BITS has a bucket
+    of its own, and every power of two above that is cut into
+    2^LAT_SUB_BITS equal buckets, so a value is known to within
+    1/2^LAT_SUB_BITS (12.5%) from LAT_BUCKETS counters and a
+    record is a single increment. Histograms from several
+    servers (or runs) merge by adding their counts.
+------------------------------------------------------ */
+#define LAT_SUB_BITS 3
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (40 * LAT_SUB_BUCKETS)  // up to 2^40 us, about 12 days
+
+static inline int lat_bucket(uint64_t us) {
+    if (us < LAT_SUB_BUCKETS) return (int)us;
+    int msb = 63 - __builtin_clzll(us);
+    int shift = msb - LAT_SUB_BITS;
+    int b = (shift + 1) * LAT_SUB_BUCKETS + (int)((us >> shift) & (LAT_SUB_BUCKETS - 1));
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+// Largest value that falls in bucket b
+static inline uint64_t lat_bucket_high(int b) {
+    if (b < LAT_SUB_BUCKETS) return b;
+    int shift = b / LAT_SUB_BUCKETS - 1;
+    uint64_t mantissa = LAT_SUB_BUCKETS + b % LAT_SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+// Value at or below which a fraction p of the recorded values lie
+// (0 if there are none)
+static inline uint64_t lat_percentile(const uint64_t *counts, double p) {
+    uint64_t total = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) total += counts[b];
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(p * total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > rank) return lat_bucket_high(b);
+    }
+    return lat_bucket_high(LAT_BUCKETS - 1);
+}
+
+#endif